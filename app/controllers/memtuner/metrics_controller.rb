@@ -0,0 +1,8 @@
+module Memtuner
+  class MetricsController < ApplicationController
+    # Prometheus text exposition format
+    def show
+      render body: Memtuner.metrics_text, content_type: 'text/plain; version=0.0.4'
+    end
+  end
+end
@@ -1,3 +1,4 @@
 Memtuner::Engine.routes.draw do
   root to: 'dashboards#show'
+  get 'metrics', to: 'metrics#show'
 end
@@ -0,0 +1,107 @@
+#include "allocation_profile.h"
+#include "stack_table.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* indexed by stack id */
+static call_summary_t* s_summaries = NULL;
+static size_t s_summary_capacity = 0;
+
+static VALUE sym_frames;
+static VALUE sym_alloc_count;
+static VALUE sym_alloc_size;
+static VALUE sym_free_count;
+static VALUE sym_realloc_count;
+static VALUE sym_realloc_size;
+static VALUE sym_map_count;
+static VALUE sym_map_size;
+static VALUE sym_unmap_size;
+
+static call_summary_t* summary_of(uint32_t stack_id) {
+	if (stack_id >= s_summary_capacity) {
+		size_t capacity = s_summary_capacity ? s_summary_capacity : 512;
+		call_summary_t* summaries;
+		while (capacity <= stack_id)
+			capacity *= 2;
+		summaries = realloc(s_summaries, sizeof(call_summary_t) * capacity);
+		if (summaries == NULL)
+			return NULL;
+		memset(summaries + s_summary_capacity, 0, sizeof(call_summary_t) * (capacity - s_summary_capacity));
+		s_summaries = summaries;
+		s_summary_capacity = capacity;
+	}
+	return &s_summaries[stack_id];
+}
+
+void allocation_profile_add(uint32_t stack_id, call_summary_t const* summary) {
+	call_summary_t* entry;
+	if (stack_id == STACK_ID_INVALID || (entry = summary_of(stack_id)) == NULL)
+		return;
+	entry->alloc_count += summary->alloc_count;
+	entry->alloc_size += summary->alloc_size;
+	entry->free_count += summary->free_count;
+	entry->realloc_count += summary->realloc_count;
+	entry->realloc_size += summary->realloc_size;
+	entry->map_count += summary->map_count;
+	entry->map_size += summary->map_size;
+	entry->unmap_size += summary->unmap_size;
+	entry->dropped_count += summary->dropped_count;
+}
+
+static int compare_alloc_size_desc(void const* a, void const* b) {
+	size_t const lhs = s_summaries[*(uint32_t const*)a].alloc_size;
+	size_t const rhs = s_summaries[*(uint32_t const*)b].alloc_size;
+	return lhs < rhs ? 1 : lhs > rhs ? -1 : 0;
+}
+
+static VALUE stack_summary_to_hash(uint32_t stack_id) {
+	call_summary_t const* const summary = &s_summaries[stack_id];
+	VALUE hash = rb_hash_new();
+	rb_hash_aset(hash, sym_frames, stack_table_frames_to_a(stack_id));
+	rb_hash_aset(hash, sym_alloc_count, SIZET2NUM(summary->alloc_count));
+	rb_hash_aset(hash, sym_alloc_size, SIZET2NUM(summary->alloc_size));
+	rb_hash_aset(hash, sym_free_count, SIZET2NUM(summary->free_count));
+	rb_hash_aset(hash, sym_realloc_count, SIZET2NUM(summary->realloc_count));
+	rb_hash_aset(hash, sym_realloc_size, SIZET2NUM(summary->realloc_size));
+	rb_hash_aset(hash, sym_map_count, SIZET2NUM(summary->map_count));
+	rb_hash_aset(hash, sym_map_size, SIZET2NUM(summary->map_size));
+	rb_hash_aset(hash, sym_unmap_size, SIZET2NUM(summary->unmap_size));
+	return hash;
+}
+
+VALUE allocation_profile_to_a(size_t limit) {
+	size_t const count = stack_table_count() < s_summary_capacity ? stack_table_count() : s_summary_capacity;
+	uint32_t* order;
+	VALUE ary;
+	size_t i;
+
+	if (limit > count)
+		limit = count;
+	ary = rb_ary_new_capa(limit);
+	if (count == 0)
+		return ary;
+	order = malloc(sizeof(uint32_t) * count);
+	if (order == NULL)
+		rb_raise(rb_eNoMemError, "failed to allocate allocation profile order");
+	for (i = 0; i < count; ++i)
+		order[i] = (uint32_t)i;
+	qsort(order, count, sizeof(uint32_t), compare_alloc_size_desc);
+	for (i = 0; i < limit; ++i)
+		rb_ary_push(ary, stack_summary_to_hash(order[i]));
+	free(order);
+	return ary;
+}
+
+void init_allocation_profile(void) {
+#define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
+	DEF_SYM(frames);
+	DEF_SYM(alloc_count);
+	DEF_SYM(alloc_size);
+	DEF_SYM(free_count);
+	DEF_SYM(realloc_count);
+	DEF_SYM(realloc_size);
+	DEF_SYM(map_count);
+	DEF_SYM(map_size);
+	DEF_SYM(unmap_size);
+#undef DEF_SYM
+}
@@ -0,0 +1,14 @@
+#ifndef __ALLOCATION_PROFILE_H
+#define __ALLOCATION_PROFILE_H
+#include <ruby/ruby.h>
+#include "call_info.h"
+
+/*
+ * Allocation counters aggregated per Ruby call stack.
+ * All functions must be called with the GVL held.
+ */
+extern void init_allocation_profile(void);
+extern void allocation_profile_add(uint32_t stack_id, call_summary_t const* summary);
+extern VALUE allocation_profile_to_a(size_t limit);
+
+#endif
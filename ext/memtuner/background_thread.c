@@ -0,0 +1,78 @@
+#include "background_thread.h"
+#include <errno.h>
+#include <ruby/ruby.h>
+#include <ruby/thread.h>
+
+/* every thread ever started, for the fork handler */
+#define BACKGROUND_THREAD_MAX 8
+static background_thread_t* s_threads[BACKGROUND_THREAD_MAX];
+static int s_thread_count = 0;
+
+static void reset_background_threads_in_child(void) {
+	int i;
+	for (i = 0; i < s_thread_count; ++i) {
+		pthread_mutex_init(&s_threads[i]->mutex, NULL);
+		pthread_cond_init(&s_threads[i]->cond, NULL);
+		s_threads[i]->running = 0;
+		s_threads[i]->stopping = 0;
+	}
+}
+
+static void remember_thread(background_thread_t* bt) {
+	int i;
+	for (i = 0; i < s_thread_count; ++i) {
+		if (s_threads[i] == bt)
+			return;
+	}
+	if (s_thread_count == 0)
+		pthread_atfork(NULL, NULL, reset_background_threads_in_child);
+	if (s_thread_count < BACKGROUND_THREAD_MAX)
+		s_threads[s_thread_count++] = bt;
+}
+
+int background_thread_start(background_thread_t* bt, void* (*run)(void*)) {
+	int error;
+	pthread_mutex_lock(&bt->mutex);
+	bt->stopping = 0;
+	error = pthread_create(&bt->thread, NULL, run, NULL);
+	bt->running = error == 0;
+	pthread_mutex_unlock(&bt->mutex);
+	if (error == 0)
+		remember_thread(bt);
+	return error;
+}
+
+static void* join_background_thread(void* arg) {
+	background_thread_t* const bt = arg;
+	pthread_join(bt->thread, NULL);
+	return NULL;
+}
+
+int background_thread_stop(background_thread_t* bt) {
+	if (!bt->running)
+		return 0;
+	pthread_mutex_lock(&bt->mutex);
+	bt->stopping = 1;
+	pthread_cond_signal(&bt->cond);
+	pthread_mutex_unlock(&bt->mutex);
+	rb_thread_call_without_gvl(join_background_thread, bt, NULL, NULL);
+	pthread_mutex_lock(&bt->mutex);
+	bt->running = 0;
+	pthread_mutex_unlock(&bt->mutex);
+	return 1;
+}
+
+int background_thread_sleep_until(background_thread_t* bt, struct timespec const* deadline) {
+	while (!bt->stopping && pthread_cond_timedwait(&bt->cond, &bt->mutex, deadline) != ETIMEDOUT)
+		;
+	return !bt->stopping;
+}
+
+void timespec_add_ns(struct timespec* ts, uint64_t ns) {
+	ts->tv_sec += (time_t)(ns / 1000000000);
+	ts->tv_nsec += (long)(ns % 1000000000);
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec += 1;
+		ts->tv_nsec -= 1000000000;
+	}
+}
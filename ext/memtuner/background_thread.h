@@ -0,0 +1,31 @@
+#ifndef __BACKGROUND_THREAD_H
+#define __BACKGROUND_THREAD_H
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * A native thread that runs until stopped, with the mutex and condition
+ * variable it sleeps on. The mutex also guards whatever state the owner
+ * shares with the thread. Background threads don't survive fork: in the
+ * child they are marked stopped and their mutexes reinitialized.
+ */
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running; /* written with the GVL and mutex held */
+	int stopping; /* guarded by mutex */
+} background_thread_t;
+
+#define BACKGROUND_THREAD_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER }
+
+/* With the GVL. Returns 0 or the pthread_create error. */
+extern int background_thread_start(background_thread_t* bt, void* (*run)(void*));
+/* With the GVL; joins the thread without it. Returns 0 when it wasn't running. */
+extern int background_thread_stop(background_thread_t* bt);
+/* With bt->mutex held. Sleeps until stopped or deadline (CLOCK_REALTIME); returns 0 once stopped. */
+extern int background_thread_sleep_until(background_thread_t* bt, struct timespec const* deadline);
+extern void timespec_add_ns(struct timespec* ts, uint64_t ns);
+
+#endif
@@ -1,66 +1,198 @@
 #include "call_info.h"
+#include "call_info_encoding.h"
+#include "allocation_profile.h"
+#include "live_heap.h"
+#include "stack_table.h"
+#include "mmap_tracer.h"
+#include "malloc_tracer.h"
+#include "request_stats.h"
+#include "trace_writer.h"
 #include "debug.h"
 #include <pthread.h>
+#include <string.h> /* memcpy, memset */
+#include <time.h> /* nanosleep */
 #include <unistd.h> /* getpagesize */
+#include <stdlib.h> /* malloc */
+#include <sys/syscall.h> /* SYS_gettid */
 #include <sys/mman.h> /* mmap */
 #include <ruby/ruby.h>
 #include <ruby/debug.h>
+#include <ruby/vm.h> /* ruby_vm_at_exit */
 
 #define ROUND_UP(n, align) (((n) + (align) - 1) / (align) * (align))
-#define MALLOC_TRACER_THREAD_MAX 256
 
-static call_info_buffer_t s_thread_call_info_buffers[MALLOC_TRACER_THREAD_MAX];
-static size_t s_used_thread_count = 0;
+/*
+ * Every buffer ever created, newest first. Buffers are never unmapped:
+ * when their thread exits they are flushed and put on the free list for
+ * the next thread, so the number of buffers follows the peak thread count.
+ */
+static call_info_buffer_t* s_buffers = NULL;
+static call_info_buffer_t* s_free_buffers = NULL;
+static uint32_t s_next_owner = 0;
 static pthread_mutex_t s_buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* serializes consumers so each ring stays single-producer/single-consumer */
+static pthread_mutex_t s_collector_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* bumped by every job run; the job may run on another thread than the one that queued it */
+static unsigned int s_job_generation = 0;
+/* its destructor releases the buffer of an exiting thread */
+static pthread_key_t s_buffer_key;
+/* cleared when the VM is destructed; postponed jobs can't be queued after that */
+static int s_vm_alive = 1;
+/* flushed from exited threads, not yet reported; guarded by s_collector_mutex */
+static call_summary_t s_exited_summary;
 
+/* Must be called with s_buffer_mutex held. */
 static call_info_buffer_t* new_call_info_buffer(pthread_t thread_id)
 {
-	if (s_used_thread_count < MALLOC_TRACER_THREAD_MAX) {
-		call_info_buffer_t* const buffer = &s_thread_call_info_buffers[s_used_thread_count++];
-	    size_t const page_size = getpagesize();
-	    size_t const len = ROUND_UP(sizeof(call_info_t) * CALL_INFO_MAX, page_size);
-		call_info_t* infos = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-		if (infos == MAP_FAILED) {
+	call_info_buffer_t* buffer = s_free_buffers;
+	if (buffer != NULL) {
+		s_free_buffers = buffer->next_free;
+	} else {
+		size_t const page_size = getpagesize();
+		size_t const header_len = ROUND_UP(sizeof(call_info_buffer_t), page_size);
+		size_t const len = header_len + ROUND_UP(CALL_INFO_BUFFER_SIZE + sizeof(uint32_t) * LIVE_PENDING_MAX, page_size);
+		uint8_t* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (p == MAP_FAILED) {
 			memtuner_debug_print("new_call_info_buffer failed\n");
 			return NULL;
 		}
-	    buffer->thread_id = thread_id;
-    	buffer->call_infos = infos;
-    	buffer->size = 0;
-    	buffer->in_handler_calls = 0;
-    	buffer->job_handler_queued = 0;
-    	return buffer;
-    } else {
-    	return NULL;
-    }
+		add_tracer_mapping(p, len);
+		buffer = (call_info_buffer_t*)p;
+		buffer->events = p + header_len;
+		buffer->pending_slots = (uint32_t*)(buffer->events + CALL_INFO_BUFFER_SIZE);
+		buffer->next = s_buffers;
+		/* the collector walks the list without s_buffer_mutex */
+		__atomic_store_n(&s_buffers, buffer, __ATOMIC_RELEASE);
+	}
+	if (++s_next_owner == 0)
+		++s_next_owner;
+	buffer->thread_id = thread_id;
+	buffer->tid = (pid_t)syscall(SYS_gettid);
+	buffer->ruby_thread = Qnil;
+	memset(&buffer->stats, 0, sizeof(buffer->stats));
+	buffer->budget_limit = 0;
+	buffer->escalated = 0;
+	buffer->owner = s_next_owner;
+	buffer->job_generation = s_job_generation - 1;
+	buffer->next_free = NULL;
+	return buffer;
 }
 
-call_info_buffer_t* find_call_info_buffer() {
-	call_info_buffer_t* ret = NULL;
-	size_t i = 0;
-	pthread_t current_thread_id = pthread_self();
+/* initial-exec TLS never calls __tls_get_addr, so it is safe inside malloc hooks */
+static __thread call_info_buffer_t* s_current_buffer __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread int s_buffer_unavailable __attribute__((tls_model("initial-exec"))) = 0;
 
+static call_info_buffer_t* register_call_info_buffer(void) {
+	call_info_buffer_t* buffer;
+
+	/* the buffer's own mmap is traced too; don't recurse into registration */
+	s_buffer_unavailable = 1;
 	pthread_mutex_lock(&s_buffer_mutex);
-	for(i = 0; i < s_used_thread_count; ++i) {
-		call_info_buffer_t* buffer = &s_thread_call_info_buffers[i];
-		if (buffer->call_infos != NULL && pthread_equal(buffer->thread_id, current_thread_id)) {
-			ret = buffer;
-			break;
-		}
-	}
-	if (ret == NULL)
-		ret = new_call_info_buffer(current_thread_id);
+	buffer = new_call_info_buffer(pthread_self());
 	pthread_mutex_unlock(&s_buffer_mutex);
+	if (buffer != NULL)
+		pthread_setspecific(s_buffer_key, buffer);
+
+	/* don't retry on every call once buffers can't be mapped */
+	s_buffer_unavailable = buffer == NULL;
+	s_current_buffer = buffer;
+	return buffer;
+}
+
+call_info_buffer_t* find_call_info_buffer(void) {
+	call_info_buffer_t* buffer = s_current_buffer;
+	if (buffer == NULL && !s_buffer_unavailable)
+		buffer = register_call_info_buffer();
+	return buffer;
+}
+
+void count_thread_allocation(size_t size) {
+	call_info_buffer_t* const buffer = find_call_info_buffer();
+	thread_allocation_stats_t* stats;
+	if (buffer == NULL)
+		return;
+	stats = &buffer->stats;
+	stats->alloc_count += 1;
+	stats->allocated_bytes += size;
+	/* frees of other threads' memory can push freed past allocated */
+	if (stats->allocated_bytes > stats->freed_bytes && stats->allocated_bytes - stats->freed_bytes > stats->peak_live_bytes)
+		stats->peak_live_bytes = stats->allocated_bytes - stats->freed_bytes;
+	if (buffer->budget_limit != 0 && stats->allocated_bytes >= buffer->budget_limit) {
+		buffer->budget_limit = 0;
+		buffer->escalated = 1;
+		set_thread_record_all_calls(1);
+	}
+}
+
+void count_thread_free(size_t size) {
+	call_info_buffer_t* const buffer = find_call_info_buffer();
+	if (buffer == NULL)
+		return;
+	buffer->stats.free_count += 1;
+	buffer->stats.freed_bytes += size;
+}
+
+int current_thread_allocation_stats(thread_allocation_stats_t* stats) {
+	call_info_buffer_t const* const buffer = s_current_buffer;
+	if (buffer == NULL)
+		return 0;
+	*stats = buffer->stats;
+	return 1;
+}
+
+int arm_thread_allocation_budget(size_t limit) {
+	call_info_buffer_t* const buffer = s_current_buffer;
+	if (buffer == NULL)
+		return 0;
+	buffer->escalated = 0;
+	buffer->budget_limit = limit;
+	return 1;
+}
+
+int disarm_thread_allocation_budget(void) {
+	call_info_buffer_t* const buffer = s_current_buffer;
+	int escalated;
+	if (buffer == NULL)
+		return 0;
+	escalated = buffer->escalated;
+	buffer->budget_limit = 0;
+	buffer->escalated = 0;
+	set_thread_record_all_calls(0);
+	return escalated;
+}
 
-	return ret;
+size_t collect_thread_allocation_stats(thread_allocation_entry_t** entries) {
+	call_info_buffer_t* const first = __atomic_load_n(&s_buffers, __ATOMIC_ACQUIRE);
+	call_info_buffer_t* buffer;
+	size_t capacity = 0, count = 0;
+
+	/* allocate outside s_buffer_mutex: malloc may register a buffer */
+	for (buffer = first; buffer != NULL; buffer = buffer->next)
+		++capacity;
+	*entries = malloc(sizeof(thread_allocation_entry_t) * (capacity ? capacity : 1));
+	if (*entries == NULL)
+		return 0;
+
+	pthread_mutex_lock(&s_buffer_mutex);
+	/* buffers are only ever prepended, so this visits the same capacity buffers */
+	for (buffer = first; buffer != NULL; buffer = buffer->next) {
+		thread_allocation_entry_t* const entry = &(*entries)[count];
+		if (buffer->owner == 0)
+			continue;
+		entry->thread_id = buffer->thread_id;
+		entry->tid = buffer->tid;
+		entry->ruby_thread = buffer->ruby_thread;
+		entry->stats = buffer->stats;
+		++count;
+	}
+	pthread_mutex_unlock(&s_buffer_mutex);
+	return count;
 }
 
 void clear_call_info_buffer(void) {
 	call_info_buffer_t* buffer = find_call_info_buffer();
 	if (buffer) {
-    	buffer->size = 0;
     	buffer->in_handler_calls = 0;
-    	buffer->job_handler_queued = 0;
 	}
 }
 
@@ -68,83 +200,284 @@ void clear_call_info_buffer(void) {
 static VALUE s_memtuner_frame_buffer[MEMTUNER_FRAME_BUFFER_SIZE];
 static int s_memtuner_line_buffer[MEMTUNER_FRAME_BUFFER_SIZE];
 
-typedef struct {
-	size_t alloc_count;
-	size_t realloc_count;
-	size_t free_count;
-	size_t alloc_size;
-	size_t realloc_size;
-} call_summary_t;
+static void accumulate_call_summary(call_summary_t* summary, call_info_t const* info) {
+	switch (info->type) {
+	case CALL_FUNC_MALLOC:
+		summary->alloc_count += 1;
+		summary->alloc_size += info->malloc.size;
+		break;
+	case CALL_FUNC_FREE:
+		summary->free_count += 1;
+		break;
+	case CALL_FUNC_CALLOC:
+		summary->alloc_count += 1;
+		summary->alloc_size += info->calloc.size * info->calloc.count;
+		break;
+	case CALL_FUNC_REALLOC:
+		summary->realloc_count += 1;
+		summary->realloc_size += info->realloc.size;
+		break;
+	case CALL_FUNC_MEMALIGN:
+		summary->alloc_count += 1;
+		summary->alloc_size += info->memalign.size;
+		break;
+	case CALL_FUNC_POSIX_MEMALIGN:
+		summary->alloc_count += 1;
+		summary->alloc_size += info->posix_memalign.size;
+		break;
+	case CALL_FUNC_ALIGNED_ALLOC:
+		summary->alloc_count += 1;
+		summary->alloc_size += info->aligned_alloc.size;
+		break;
+	case CALL_FUNC_VALLOC:
+	case CALL_FUNC_PVALLOC:
+		summary->alloc_count += 1;
+		summary->alloc_size += info->valloc.size;
+		break;
+	case CALL_FUNC_MMAP:
+		summary->map_count += 1;
+		summary->map_size += info->mmap.size;
+		break;
+	case CALL_FUNC_MUNMAP:
+		summary->unmap_size += info->munmap.size;
+		break;
+	case CALL_FUNC_MREMAP:
+		summary->map_count += 1;
+		summary->map_size += info->mremap.size;
+		summary->unmap_size += info->mremap.old_size;
+		break;
+	case CALL_FUNC_SBRK:
+		summary->map_count += 1;
+		if (info->sbrk.increment >= 0)
+			summary->map_size += (size_t)info->sbrk.increment;
+		else
+			summary->unmap_size += (size_t)-info->sbrk.increment;
+		break;
+	default:
+		break;
+	}
+}
 
-static call_summary_t build_call_summary(call_info_buffer_t const* buffer) {
-	size_t i;
-	call_summary_t summary = { 0 };
-	for (i = 0; i < buffer->size; ++i) {
-		call_info_t const* info = &buffer->call_infos[i];
-		switch (info->type) {
-	    case CALL_FUNC_MALLOC:
-	    	summary.alloc_count += 1;
-	    	summary.alloc_size += info->malloc.size;
-		    break;
-        case CALL_FUNC_FREE:		
-	    	summary.free_count += 1;
-		    break;
-	    case CALL_FUNC_CALLOC:
-	    	summary.alloc_count += 1;
-	    	summary.alloc_size += info->calloc.size * info->calloc.count;
-		    break;
-	    case CALL_FUNC_REALLOC:
-	    	summary.realloc_count += 1;
-	    	summary.realloc_size += info->realloc.size;
-		    break;
-	    case CALL_FUNC_MEMALIGN:
-	    	summary.alloc_count += 1;
-	    	summary.alloc_size += info->memalign.size;
-		    break;
-	    case CALL_FUNC_POSIX_MEMALIGN:
-	    	summary.alloc_count += 1;
-	    	summary.alloc_size += info->posix_memalign.size;
-		    break;
-	    default:
-		    break;
-		}
+/* Must be called with s_collector_mutex held. */
+static size_t drain_call_info_buffer(call_info_buffer_t* buffer) {
+	size_t const head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+	size_t const dropped = __atomic_load_n(&buffer->dropped, __ATOMIC_RELAXED);
+	int const tracing = head != buffer->tail && trace_enabled();
+	call_info_decoder_t decoder;
+	size_t count = 0;
+
+	decoder.data = buffer->events;
+	decoder.mask = CALL_INFO_BUFFER_SIZE - 1;
+	decoder.pos = buffer->tail;
+	decoder.last_ptr = buffer->decoded_last_ptr;
+	if (tracing)
+		trace_begin_events(buffer->owner);
+	while (decoder.pos != head) {
+		call_info_t info;
+		decode_call_info(&decoder, &info);
+		accumulate_call_summary(&buffer->summary, &info);
+		if (tracing)
+			trace_add_event(&info);
+		++count;
 	}
+	if (tracing)
+		trace_end_events();
+	buffer->decoded_last_ptr = decoder.last_ptr;
+	__atomic_store_n(&buffer->tail, decoder.pos, __ATOMIC_RELEASE);
+
+	buffer->summary.dropped_count += dropped - buffer->collected_dropped;
+	buffer->collected_dropped = dropped;
+	return count;
+}
+
+static call_summary_t take_call_summary(call_info_buffer_t* buffer) {
+	call_summary_t summary;
+	pthread_mutex_lock(&s_collector_mutex);
+	drain_call_info_buffer(buffer);
+	summary = buffer->summary;
+	memset(&buffer->summary, 0, sizeof(buffer->summary));
+	pthread_mutex_unlock(&s_collector_mutex);
 	return summary;
 }
 
-static void memtuner_dump_sample() {
-	call_info_buffer_t* buffer = find_call_info_buffer();
-    if (buffer != NULL && buffer->size > 0) {
-	    int num = rb_profile_frames(0, MEMTUNER_FRAME_BUFFER_SIZE, s_memtuner_frame_buffer, s_memtuner_line_buffer);
-	    int i;
-
-		memtuner_debug_print("---------------------------\n");
-    	for(i = 0; i < num; ++i) {
-    		VALUE frame = s_memtuner_frame_buffer[i];
-    		int line = s_memtuner_line_buffer[i];
-			VALUE name = rb_profile_frame_full_label(frame);
-			char const* name_cstr = StringValueCStr(name);
-		    VALUE file = rb_profile_frame_absolute_path(frame);
-		    if (NIL_P(file))
-				file = rb_profile_frame_path(frame);    		
-			memtuner_debug_print(StringValueCStr(file));
-			if (line > 0)
-				memtuner_debug_print_signed(":", line);
-			memtuner_debug_print(" ");
-			memtuner_debug_println(name_cstr);
-    	}
-    	{
-			call_summary_t summary = build_call_summary(buffer);
-			memtuner_debug_println_unsigned("  alloc count  : ", summary.alloc_count);
-			memtuner_debug_println_unsigned("  free count   : ", summary.free_count);
-			memtuner_debug_println_unsigned("  realloc count: ", summary.realloc_count);
-			memtuner_debug_println_unsigned("  alloc size  : ", summary.alloc_size);
-			memtuner_debug_println_unsigned("  realloc size: ", summary.realloc_size);
-	    	memtuner_debug_println_unsigned("  in handler calls: ", buffer->in_handler_calls );
+/* Must be called with s_collector_mutex held. Unresolved live entries lose their stack. */
+static void reset_call_info_buffer(call_info_buffer_t* buffer) {
+	size_t i;
+	for (i = 0; i < buffer->pending_count; ++i)
+		live_heap_resolve(buffer->pending_slots[i], buffer->owner, STACK_ID_INVALID);
+	memset(&buffer->summary, 0, sizeof(buffer->summary));
+	buffer->head = 0;
+	buffer->tail = 0;
+	buffer->last_ptr = 0;
+	buffer->decoded_last_ptr = 0;
+	buffer->dropped = 0;
+	buffer->collected_dropped = 0;
+	buffer->in_handler_calls = 0;
+	buffer->pending_count = 0;
+}
+
+/*
+ * Runs at thread exit, whether the thread returned or called pthread_exit.
+ * What the thread traced but never reported moves to s_exited_summary and
+ * the buffer goes back to the free list.
+ */
+static void release_call_info_buffer(void* p) {
+	call_info_buffer_t* const buffer = p;
+
+	/* the rest of thread teardown is not traced */
+	s_buffer_unavailable = 1;
+	s_current_buffer = NULL;
+
+	pthread_mutex_lock(&s_collector_mutex);
+	drain_call_info_buffer(buffer);
+	s_exited_summary.alloc_count += buffer->summary.alloc_count;
+	s_exited_summary.alloc_size += buffer->summary.alloc_size;
+	s_exited_summary.free_count += buffer->summary.free_count;
+	s_exited_summary.realloc_count += buffer->summary.realloc_count;
+	s_exited_summary.realloc_size += buffer->summary.realloc_size;
+	s_exited_summary.map_count += buffer->summary.map_count;
+	s_exited_summary.map_size += buffer->summary.map_size;
+	s_exited_summary.unmap_size += buffer->summary.unmap_size;
+	s_exited_summary.dropped_count += buffer->summary.dropped_count;
+	reset_call_info_buffer(buffer);
+	pthread_mutex_unlock(&s_collector_mutex);
+
+	pthread_mutex_lock(&s_buffer_mutex);
+	buffer->owner = 0;
+	buffer->ruby_thread = Qnil;
+	buffer->next_free = s_free_buffers;
+	s_free_buffers = buffer;
+	pthread_mutex_unlock(&s_buffer_mutex);
+}
+
+static void* call_info_collector(void* arg) {
+	struct timespec const idle_interval = { 0, 1000000 };
+
+	/* the collector's own allocations are not traced */
+	s_buffer_unavailable = 1;
+	for (;;) {
+		call_info_buffer_t* buffer;
+		size_t drained = 0;
+
+		pthread_mutex_lock(&s_collector_mutex);
+		for (buffer = __atomic_load_n(&s_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next)
+			drained += drain_call_info_buffer(buffer);
+		pthread_mutex_unlock(&s_collector_mutex);
+		trace_flush_if_due();
+
+		if (drained == 0)
+			nanosleep(&idle_interval, NULL);
+	}
+	return NULL;
+}
+
+/* process teardown still frees and unmaps after the VM is gone */
+static void stop_call_info_jobs(ruby_vm_t* vm) {
+	__atomic_store_n(&s_vm_alive, 0, __ATOMIC_RELEASE);
+}
+
+static void start_call_info_collector(void) {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, call_info_collector, NULL) == 0)
+		pthread_detach(thread);
+	else
+		memtuner_debug_print("start_call_info_collector failed\n");
+}
+
+/*
+ * Held across fork so the child never inherits them mid-drain or
+ * mid-registration; taken in the order the drain and registration nest them.
+ */
+static void lock_call_info_before_fork(void) {
+	pthread_mutex_lock(&s_collector_mutex);
+	trace_lock_before_fork();
+	pthread_mutex_lock(&s_buffer_mutex);
+	mmap_tracer_lock_before_fork();
+}
+
+static void unlock_call_info_after_fork(void) {
+	mmap_tracer_unlock_after_fork();
+	pthread_mutex_unlock(&s_buffer_mutex);
+	trace_unlock_after_fork();
+	pthread_mutex_unlock(&s_collector_mutex);
+}
+
+/*
+ * Only the forking thread survives: the buffers of the others are
+ * recycled with their unreported events, and the collector is restarted.
+ */
+static void reset_call_info_in_child(void) {
+	call_info_buffer_t* buffer;
+
+	pthread_mutex_init(&s_collector_mutex, NULL);
+	pthread_mutex_init(&s_buffer_mutex, NULL);
+	mmap_tracer_reset_in_child();
+	trace_reset_in_child();
+	for (buffer = s_buffers; buffer != NULL; buffer = buffer->next) {
+		if (buffer->owner == 0)
+			continue;
+		if (pthread_equal(buffer->thread_id, pthread_self())) {
+			buffer->tid = (pid_t)syscall(SYS_gettid);
+			continue;
 		}
+		reset_call_info_buffer(buffer);
+		buffer->owner = 0;
+		buffer->ruby_thread = Qnil;
+		buffer->next_free = s_free_buffers;
+		s_free_buffers = buffer;
+	}
+	start_call_info_collector();
+}
 
-    	clear_call_info_buffer();
+/* marks each buffer's Thread, so an unreferenced one can't be recycled as another object */
+static void mark_buffer_threads(void* buffers) {
+	call_info_buffer_t* buffer;
+	for (buffer = __atomic_load_n((call_info_buffer_t**)buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next)
+		rb_gc_mark(__atomic_load_n(&buffer->ruby_thread, __ATOMIC_RELAXED));
+}
+
+void init_call_info_collector(void) {
+	rb_gc_register_mark_object(rb_data_object_wrap(0, &s_buffers, mark_buffer_threads, NULL));
+	ruby_vm_at_exit(stop_call_info_jobs);
+	if (pthread_key_create(&s_buffer_key, release_call_info_buffer) != 0)
+		memtuner_debug_print("init_call_info_collector: pthread_key_create failed\n");
+	pthread_atfork(lock_call_info_before_fork, unlock_call_info_after_fork, reset_call_info_in_child);
+	start_call_info_collector();
+}
+
+/* exited threads have no Ruby stack left; report them under the empty stack */
+static void report_exited_summary(void) {
+	call_summary_t summary;
+	pthread_mutex_lock(&s_collector_mutex);
+	summary = s_exited_summary;
+	memset(&s_exited_summary, 0, sizeof(s_exited_summary));
+	pthread_mutex_unlock(&s_collector_mutex);
+	if (summary.alloc_count + summary.free_count + summary.realloc_count + summary.map_count + summary.unmap_size + summary.dropped_count > 0)
+		allocation_profile_add(intern_stack(NULL, NULL, 0), &summary);
+}
+
+static void memtuner_record_sample() {
+	call_info_buffer_t* buffer = find_call_info_buffer();
+	call_summary_t summary;
+	report_exited_summary();
+	if (buffer == NULL)
+		return;
+	buffer->ruby_thread = rb_thread_current();
+	summary = take_call_summary(buffer);
+	if (summary.alloc_count + summary.free_count + summary.realloc_count + summary.map_count + summary.unmap_size + summary.dropped_count > 0) {
+		int const num = rb_profile_frames(0, MEMTUNER_FRAME_BUFFER_SIZE, s_memtuner_frame_buffer, s_memtuner_line_buffer);
+		uint32_t const stack_id = intern_stack(s_memtuner_frame_buffer, s_memtuner_line_buffer, num);
+		size_t i;
+		allocation_profile_add(stack_id, &summary);
+		if (buffer->escalated)
+			add_incident_stack(stack_id, &summary);
+		if (trace_enabled())
+			trace_attribute(buffer->owner, stack_id);
+		for (i = 0; i < buffer->pending_count; ++i)
+			live_heap_resolve(buffer->pending_slots[i], buffer->owner, stack_id);
+		buffer->pending_count = 0;
 	}
+	clear_call_info_buffer();
 }
 
 static int memtuner_in_handler = 0;
@@ -152,22 +485,98 @@ static void memtuner_job_handler(void* data) {
     if (memtuner_in_handler) return;
 
     memtuner_in_handler++;
-    memtuner_dump_sample();
+    ++s_job_generation;
+    memtuner_record_sample();
     memtuner_in_handler--;
 }
 
+void record_thread_sample(void) {
+    if (memtuner_in_handler) return;
+
+    memtuner_in_handler++;
+    memtuner_record_sample();
+    memtuner_in_handler--;
+}
+
+static void track_live_allocation(call_info_buffer_t* buffer, call_info_t const* info) {
+	void const* ptr = NULL;
+	size_t size = 0;
+	switch (info->type) {
+	case CALL_FUNC_MALLOC:
+		ptr = info->malloc.allocated;
+		size = info->malloc.size;
+		break;
+	case CALL_FUNC_FREE:
+		/* free_hook already detached it */
+		return;
+	case CALL_FUNC_CALLOC:
+		ptr = info->calloc.allocated;
+		size = info->calloc.size * info->calloc.count;
+		break;
+	case CALL_FUNC_REALLOC:
+		/* realloc_hook already detached the old pointer */
+		ptr = info->realloc.allocated;
+		size = info->realloc.size;
+		break;
+	case CALL_FUNC_MEMALIGN:
+		ptr = info->memalign.allocated;
+		size = info->memalign.size;
+		break;
+	case CALL_FUNC_POSIX_MEMALIGN:
+		if (info->posix_memalign.return_value == 0) {
+			ptr = info->posix_memalign.allocated;
+			size = info->posix_memalign.size;
+		}
+		break;
+	case CALL_FUNC_ALIGNED_ALLOC:
+		ptr = info->aligned_alloc.allocated;
+		size = info->aligned_alloc.size;
+		break;
+	case CALL_FUNC_VALLOC:
+	case CALL_FUNC_PVALLOC:
+		ptr = info->valloc.allocated;
+		size = info->valloc.size;
+		break;
+	default:
+		break;
+	}
+	if (ptr == NULL)
+		return;
+	if (buffer != NULL && !memtuner_in_handler && buffer->pending_count < LIVE_PENDING_MAX) {
+		uint32_t const slot = live_heap_insert(ptr, size, STACK_ID_PENDING, buffer->owner);
+		if (slot != LIVE_HEAP_SLOT_INVALID)
+			buffer->pending_slots[buffer->pending_count++] = slot;
+	} else {
+		live_heap_insert(ptr, size, STACK_ID_INVALID, 0);
+	}
+}
+
 void add_call_info(call_info_t const* info) {
 	call_info_buffer_t* buffer = find_call_info_buffer();
-    if (buffer != NULL && buffer->size < CALL_INFO_MAX) {
+	track_live_allocation(buffer, info);
+    if (buffer != NULL) {
     	if (memtuner_in_handler)
     	{
     		++buffer->in_handler_calls;
     	}
     	else
     	{
-        	buffer->call_infos[buffer->size++] = *info;
-        	if (buffer->job_handler_queued == 0) {
-	        	buffer->job_handler_queued = 1;
+    		size_t const head = buffer->head;
+    		uint8_t encoded[CALL_INFO_ENCODED_MAX];
+    		uintptr_t last_ptr = buffer->last_ptr;
+    		size_t const len = encode_call_info(info, &last_ptr, encoded);
+    		if (len <= CALL_INFO_BUFFER_SIZE - (head - __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE))) {
+    			size_t const offset = head & (CALL_INFO_BUFFER_SIZE - 1);
+    			size_t const first = CALL_INFO_BUFFER_SIZE - offset < len ? CALL_INFO_BUFFER_SIZE - offset : len;
+    			memcpy(buffer->events + offset, encoded, first);
+    			memcpy(buffer->events, encoded + first, len - first);
+    			buffer->last_ptr = last_ptr;
+    			__atomic_store_n(&buffer->head, head + len, __ATOMIC_RELEASE);
+    		} else {
+    			__atomic_store_n(&buffer->dropped, buffer->dropped + 1, __ATOMIC_RELAXED);
+    		}
+        	if (buffer->job_generation != s_job_generation && __atomic_load_n(&s_vm_alive, __ATOMIC_ACQUIRE)) {
+	        	buffer->job_generation = s_job_generation;
     	    	rb_postponed_job_register_one(0, memtuner_job_handler, 0);
         	}
     	}
@@ -2,6 +2,10 @@
 #ifndef __CALL_INFO_H
 #define __CALL_INFO_H
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h> /* pid_t */
+#include <ruby/ruby.h>
 
 typedef enum {
     CALL_FUNC_MALLOC,
@@ -10,6 +14,14 @@ typedef enum {
     CALL_FUNC_REALLOC,
     CALL_FUNC_MEMALIGN,
     CALL_FUNC_POSIX_MEMALIGN,
+    CALL_FUNC_ALIGNED_ALLOC,
+    CALL_FUNC_VALLOC,
+    CALL_FUNC_PVALLOC,
+    CALL_FUNC_MALLOC_USABLE_SIZE,
+    CALL_FUNC_MMAP,
+    CALL_FUNC_MUNMAP,
+    CALL_FUNC_MREMAP,
+    CALL_FUNC_SBRK, /* brk is recorded as the equivalent sbrk */
 } call_func_type_t;
 
 typedef struct {
@@ -46,6 +58,47 @@ typedef struct {
     int return_value;
 } posix_memalign_call_info_t;
 
+typedef struct {
+    size_t align;
+    size_t size;
+    void* allocated;
+} aligned_alloc_call_info_t;
+
+/* valloc and pvalloc */
+typedef struct {
+    size_t size;
+    void* allocated;
+} valloc_call_info_t;
+
+typedef struct {
+    void* ptr;
+    size_t usable_size;
+} malloc_usable_size_call_info_t;
+
+typedef struct {
+    size_t size;
+    int prot;
+    int flags;
+    void* allocated;
+} mmap_call_info_t;
+
+typedef struct {
+    void* ptr;
+    size_t size;
+} munmap_call_info_t;
+
+typedef struct {
+    size_t old_size;
+    size_t size;
+    void* ptr;
+    void* allocated;
+} mremap_call_info_t;
+
+typedef struct {
+    intptr_t increment;
+    void* allocated; /* previous program break */
+} sbrk_call_info_t;
+
 typedef struct {
     call_func_type_t type;
     union {
@@ -53,21 +106,103 @@ typedef struct {
         calloc_call_info_t calloc;
         memalign_call_info_t memalign;
         posix_memalign_call_info_t posix_memalign;
+        aligned_alloc_call_info_t aligned_alloc;
+        valloc_call_info_t valloc;
+        malloc_usable_size_call_info_t malloc_usable_size;
+        mmap_call_info_t mmap;
+        munmap_call_info_t munmap;
+        mremap_call_info_t mremap;
+        sbrk_call_info_t sbrk;
         realloc_call_info_t realloc;
         free_call_info_t free;
     };
 } call_info_t;
 
-static size_t const CALL_INFO_MAX = 10000;
 typedef struct {
+    size_t alloc_count;
+    size_t realloc_count;
+    size_t free_count;
+    size_t alloc_size;
+    size_t realloc_size;
+    size_t map_count;
+    size_t map_size;
+    size_t unmap_size;
+    size_t dropped_count;
+} call_summary_t;
+
+/* ring capacity in bytes of packed events; must be a power of two */
+static size_t const CALL_INFO_BUFFER_SIZE = 1 << 20;
+/* live heap slots allocated since the last sample, waiting for a stack id */
+static size_t const LIVE_PENDING_MAX = 4096;
+/*
+ * Cumulative counters of one native thread, charged only for recorded
+ * calls so that unsampled calls stay a countdown: with sampling the bytes
+ * are estimates (reported sizes) and the counts are of sampled calls.
+ */
+typedef struct {
+    size_t allocated_bytes;
+    size_t freed_bytes;
+    size_t alloc_count;
+    size_t free_count;
+    size_t peak_live_bytes; /* peak of allocated_bytes - freed_bytes */
+} thread_allocation_stats_t;
+
+typedef struct call_info_buffer {
+    struct call_info_buffer* next; /* all buffers; set once before publishing */
+    struct call_info_buffer* next_free; /* free list, guarded by the buffer mutex */
     pthread_t thread_id;
-    call_info_t* call_infos;
-    size_t size;
+    pid_t tid;
+    VALUE ruby_thread; /* Thread last seen sampling here; marked until replaced */
+    thread_allocation_stats_t stats; /* written only by the owning thread, read racily */
+    size_t budget_limit; /* stats.allocated_bytes that escalates the thread; 0 when disarmed */
+    int escalated; /* every call is recorded until the budget is disarmed */
+    uint32_t owner; /* nonzero tag of the current thread in the live heap; 0 while free */
+    uint8_t* events;
+    size_t head; /* written only by the owning thread */
+    size_t tail; /* written only by the consumer */
+    uintptr_t last_ptr; /* pointer delta base of the producer */
+    uintptr_t decoded_last_ptr; /* pointer delta base of the consumer */
+    size_t dropped; /* events lost because the ring was full */
+    size_t collected_dropped;
     size_t in_handler_calls;
-    int job_handler_queued;
+    unsigned int job_generation; /* s_job_generation when the job was last queued */
+    call_summary_t summary; /* drained but not yet reported */
+    uint32_t* pending_slots;
+    size_t pending_count;
 } call_info_buffer_t;
 
+/* Registers a buffer for the calling thread on first use; NULL if unavailable. */
+extern call_info_buffer_t* find_call_info_buffer(void);
 extern void clear_call_info_buffer(void);
+
+/* Plain increments on the calling thread's counters; no-ops without a buffer. */
+extern void count_thread_allocation(size_t size);
+extern void count_thread_free(size_t size);
+/* Copies the calling thread's counters; 0 when it has no buffer. Never registers one. */
+extern int current_thread_allocation_stats(thread_allocation_stats_t* stats);
+/*
+ * Once the calling thread's allocated_bytes reaches limit, it records every
+ * allocation with its stack until disarmed. Returns 0 when it has no buffer.
+ */
+extern int arm_thread_allocation_budget(size_t limit);
+/* Returns whether the thread escalated since it was armed. */
+extern int disarm_thread_allocation_budget(void);
+/*
+ * With the GVL held: attributes what the calling thread traced since its
+ * last sample to the current stack, as the postponed job would.
+ */
+extern void record_thread_sample(void);
+
+typedef struct {
+    pthread_t thread_id;
+    pid_t tid;
+    VALUE ruby_thread;
+    thread_allocation_stats_t stats;
+} thread_allocation_entry_t;
+
+/* Copies the counters of live threads; caller frees *entries. */
+extern size_t collect_thread_allocation_stats(thread_allocation_entry_t** entries);
 extern void add_call_info(call_info_t const* info);
+extern void init_call_info_collector(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include "call_info_encoding.h"
+#include "varint.h"
+
+/*
+ * Packed event layout:
+ *   1 byte  call_func_type_t tag
+ *   varint  sizes / counts / alignments (LEB128)
+ *   varint  pointers as zigzag deltas from the previous pointer of the same thread
+ *
+ * A free costs 2-5 bytes instead of sizeof(call_info_t).
+ */
+
+static size_t encode_pointer(void const* ptr, uintptr_t* last_ptr, uint8_t* out) {
+	uintptr_t const p = (uintptr_t)ptr;
+	int64_t const delta = (int64_t)(p - *last_ptr);
+	*last_ptr = p;
+	return encode_varint(zigzag_encode(delta), out);
+}
+
+size_t encode_call_info(call_info_t const* info, uintptr_t* last_ptr, uint8_t* out) {
+	size_t len = 0;
+	out[len++] = (uint8_t)info->type;
+	switch (info->type) {
+	case CALL_FUNC_MALLOC:
+		len += encode_varint(info->malloc.size, out + len);
+		len += encode_pointer(info->malloc.allocated, last_ptr, out + len);
+		break;
+	case CALL_FUNC_FREE:
+		len += encode_pointer(info->free.ptr, last_ptr, out + len);
+		break;
+	case CALL_FUNC_CALLOC:
+		len += encode_varint(info->calloc.count, out + len);
+		len += encode_varint(info->calloc.size, out + len);
+		len += encode_pointer(info->calloc.allocated, last_ptr, out + len);
+		break;
+	case CALL_FUNC_REALLOC:
+		len += encode_varint(info->realloc.size, out + len);
+		len += encode_pointer(info->realloc.ptr, last_ptr, out + len);
+		len += encode_pointer(info->realloc.allocated, last_ptr, out + len);
+		break;
+	case CALL_FUNC_MEMALIGN:
+		len += encode_varint(info->memalign.align, out + len);
+		len += encode_varint(info->memalign.size, out + len);
+		len += encode_pointer(info->memalign.allocated, last_ptr, out + len);
+		break;
+	case CALL_FUNC_POSIX_MEMALIGN:
+		len += encode_varint(info->posix_memalign.align, out + len);
+		len += encode_varint(info->posix_memalign.size, out + len);
+		len += encode_pointer(info->posix_memalign.allocated, last_ptr, out + len);
+		len += encode_varint(zigzag_encode(info->posix_memalign.return_value), out + len);
+		break;
+	case CALL_FUNC_ALIGNED_ALLOC:
+		len += encode_varint(info->aligned_alloc.align, out + len);
+		len += encode_varint(info->aligned_alloc.size, out + len);
+		len += encode_pointer(info->aligned_alloc.allocated, last_ptr, out + len);
+		break;
+	case CALL_FUNC_VALLOC:
+	case CALL_FUNC_PVALLOC:
+		len += encode_varint(info->valloc.size, out + len);
+		len += encode_pointer(info->valloc.allocated, last_ptr, out + len);
+		break;
+	case CALL_FUNC_MALLOC_USABLE_SIZE:
+		len += encode_pointer(info->malloc_usable_size.ptr, last_ptr, out + len);
+		len += encode_varint(info->malloc_usable_size.usable_size, out + len);
+		break;
+	case CALL_FUNC_MMAP:
+		len += encode_varint(info->mmap.size, out + len);
+		len += encode_varint((uint32_t)info->mmap.prot, out + len);
+		len += encode_varint((uint32_t)info->mmap.flags, out + len);
+		len += encode_pointer(info->mmap.allocated, last_ptr, out + len);
+		break;
+	case CALL_FUNC_MUNMAP:
+		len += encode_pointer(info->munmap.ptr, last_ptr, out + len);
+		len += encode_varint(info->munmap.size, out + len);
+		break;
+	case CALL_FUNC_MREMAP:
+		len += encode_varint(info->mremap.old_size, out + len);
+		len += encode_varint(info->mremap.size, out + len);
+		len += encode_pointer(info->mremap.ptr, last_ptr, out + len);
+		len += encode_pointer(info->mremap.allocated, last_ptr, out + len);
+		break;
+	case CALL_FUNC_SBRK:
+		len += encode_varint(zigzag_encode(info->sbrk.increment), out + len);
+		len += encode_pointer(info->sbrk.allocated, last_ptr, out + len);
+		break;
+	default:
+		break;
+	}
+	return len;
+}
+
+static uint64_t decode_ring_varint(call_info_decoder_t* decoder) {
+	uint64_t n = 0;
+	int shift = 0;
+	for (;;) {
+		uint8_t const byte = decoder->data[decoder->pos++ & decoder->mask];
+		n |= (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0 || shift >= 63)
+			break;
+		shift += 7;
+	}
+	return n;
+}
+
+static void* decode_pointer(call_info_decoder_t* decoder) {
+	decoder->last_ptr += (uintptr_t)zigzag_decode(decode_ring_varint(decoder));
+	return (void*)decoder->last_ptr;
+}
+
+void decode_call_info(call_info_decoder_t* decoder, call_info_t* info) {
+	info->type = (call_func_type_t)decoder->data[decoder->pos++ & decoder->mask];
+	switch (info->type) {
+	case CALL_FUNC_MALLOC:
+		info->malloc.size = decode_ring_varint(decoder);
+		info->malloc.allocated = decode_pointer(decoder);
+		break;
+	case CALL_FUNC_FREE:
+		info->free.ptr = decode_pointer(decoder);
+		break;
+	case CALL_FUNC_CALLOC:
+		info->calloc.count = decode_ring_varint(decoder);
+		info->calloc.size = decode_ring_varint(decoder);
+		info->calloc.allocated = decode_pointer(decoder);
+		break;
+	case CALL_FUNC_REALLOC:
+		info->realloc.size = decode_ring_varint(decoder);
+		info->realloc.ptr = decode_pointer(decoder);
+		info->realloc.allocated = decode_pointer(decoder);
+		break;
+	case CALL_FUNC_MEMALIGN:
+		info->memalign.align = decode_ring_varint(decoder);
+		info->memalign.size = decode_ring_varint(decoder);
+		info->memalign.allocated = decode_pointer(decoder);
+		break;
+	case CALL_FUNC_POSIX_MEMALIGN:
+		info->posix_memalign.align = decode_ring_varint(decoder);
+		info->posix_memalign.size = decode_ring_varint(decoder);
+		info->posix_memalign.allocated = decode_pointer(decoder);
+		info->posix_memalign.return_value = (int)zigzag_decode(decode_ring_varint(decoder));
+		break;
+	case CALL_FUNC_ALIGNED_ALLOC:
+		info->aligned_alloc.align = decode_ring_varint(decoder);
+		info->aligned_alloc.size = decode_ring_varint(decoder);
+		info->aligned_alloc.allocated = decode_pointer(decoder);
+		break;
+	case CALL_FUNC_VALLOC:
+	case CALL_FUNC_PVALLOC:
+		info->valloc.size = decode_ring_varint(decoder);
+		info->valloc.allocated = decode_pointer(decoder);
+		break;
+	case CALL_FUNC_MALLOC_USABLE_SIZE:
+		info->malloc_usable_size.ptr = decode_pointer(decoder);
+		info->malloc_usable_size.usable_size = decode_ring_varint(decoder);
+		break;
+	case CALL_FUNC_MMAP:
+		info->mmap.size = decode_ring_varint(decoder);
+		info->mmap.prot = (int)decode_ring_varint(decoder);
+		info->mmap.flags = (int)decode_ring_varint(decoder);
+		info->mmap.allocated = decode_pointer(decoder);
+		break;
+	case CALL_FUNC_MUNMAP:
+		info->munmap.ptr = decode_pointer(decoder);
+		info->munmap.size = decode_ring_varint(decoder);
+		break;
+	case CALL_FUNC_MREMAP:
+		info->mremap.old_size = decode_ring_varint(decoder);
+		info->mremap.size = decode_ring_varint(decoder);
+		info->mremap.ptr = decode_pointer(decoder);
+		info->mremap.allocated = decode_pointer(decoder);
+		break;
+	case CALL_FUNC_SBRK:
+		info->sbrk.increment = (intptr_t)zigzag_decode(decode_ring_varint(decoder));
+		info->sbrk.allocated = decode_pointer(decoder);
+		break;
+	default:
+		break;
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef __CALL_INFO_ENCODING_H
+#define __CALL_INFO_ENCODING_H
+#include <stddef.h>
+#include <stdint.h>
+#include "call_info.h"
+
+/* tag byte + up to four 10-byte varints (posix_memalign, mmap, mremap) */
+#define CALL_INFO_ENCODED_MAX (1 + 10 * 4)
+
+/*
+ * Reads packed events. For ring buffers mask is capacity - 1 and pos is
+ * a free-running offset; for flat buffers mask is SIZE_MAX.
+ */
+typedef struct {
+    uint8_t const* data;
+    size_t mask;
+    size_t pos;
+    uintptr_t last_ptr;
+} call_info_decoder_t;
+
+extern size_t encode_call_info(call_info_t const* info, uintptr_t* last_ptr, uint8_t* out);
+extern void decode_call_info(call_info_decoder_t* decoder, call_info_t* info);
+
+#endif
@@ -4,9 +4,18 @@ require "mkmf"
 
 if have_header('malloc.h')
   have_func('malloc_info')
+  # mallinfo2 (glibc 2.33+) reports size_t totals; mallinfo's ints wrap past 2GB
+  have_func('mallinfo2', 'malloc.h') || have_func('mallinfo', 'malloc.h')
   have_func('memalign')
   have_func('posix_memalign')
+  have_func('valloc')
+  have_func('pvalloc')
+  have_func('malloc_usable_size')
+  have_func('mallopt', 'malloc.h')
+  have_func('malloc_trim', 'malloc.h')
 end
+have_func('aligned_alloc', 'stdlib.h')
+have_func('rb_objspace_each_objects')
 have_library("stdc++")
 puts "$CXXFLAGS: #{$CXXFLAGS}"
 $CXXFLAGS += ' -std=c++14'
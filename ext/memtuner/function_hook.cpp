@@ -126,6 +126,9 @@ struct patch_data_t{
     rip_patch_t rip_patch[RIP_PATCH_MAX];
     size_t jmp_code_offset;
     uintptr_t jmp_address;
+    size_t jcc_code_offset;
+    uint8_t jcc_condition;
+    uintptr_t jcc_address;
 };
 
 struct trampoline_t {
@@ -162,6 +165,22 @@ static void* jump_address(uint8_t* code) {
     return nullptr;
 }
 
+// Decodes "Jcc rel8" / "Jcc rel32". Returns the target and stores the condition code.
+static void* conditional_jump_address(uint8_t* code, size_t length, uint8_t* condition) {
+    if (length == 2 && (code[0] & 0xf0) == 0x70) {
+        int8_t offset;
+        memcpy(&offset, code + 1, sizeof(offset));
+        *condition = code[0] & 0x0f;
+        return code + 2 + offset;
+    } else if (length == 6 && code[0] == 0x0f && (code[1] & 0xf0) == 0x80) {
+        int32_t offset;
+        memcpy(&offset, code + 2, sizeof(offset));
+        *condition = code[1] & 0x0f;
+        return code + 6 + offset;
+    }
+    return nullptr;
+}
+
 static void* skip_jumps(void* func) {
     uint8_t* const code = static_cast<uint8_t*>(func);
     void* ptr = jump_address(code);
@@ -185,6 +204,9 @@ size_t disassemble_and_skip(void *func, patch_data_t& patch_data)
     patch_data.rip_count = 0;
     patch_data.jmp_code_offset = 0;
     patch_data.jmp_address = 0;
+    patch_data.jcc_code_offset = 0;
+    patch_data.jcc_condition = 0;
+    patch_data.jcc_address = 0;
 
     size_t size = 0;
     while (size < JMP_CODE_BYTES && decoder.decodeInstruction(info)) {
@@ -207,14 +229,10 @@ size_t disassemble_and_skip(void *func, patch_data_t& patch_data)
                 }
                 return size;
             }
-        case Zydis::InstructionMnemonic::RET:
-        case Zydis::InstructionMnemonic::RETF:
         case Zydis::InstructionMnemonic::JA:
         case Zydis::InstructionMnemonic::JB:
         case Zydis::InstructionMnemonic::JBE:
-        case Zydis::InstructionMnemonic::JCXZ:
         case Zydis::InstructionMnemonic::JE:
-        case Zydis::InstructionMnemonic::JECXZ:
         case Zydis::InstructionMnemonic::JG:
         case Zydis::InstructionMnemonic::JGE:
         case Zydis::InstructionMnemonic::JL:
@@ -226,69 +244,63 @@ size_t disassemble_and_skip(void *func, patch_data_t& patch_data)
         case Zydis::InstructionMnemonic::JNS:
         case Zydis::InstructionMnemonic::JO:
         case Zydis::InstructionMnemonic::JP:
-        case Zydis::InstructionMnemonic::JRCXZ:
         case Zydis::InstructionMnemonic::JS:
+            // A conditional jump can end the patched range (e.g. "test rdi, rdi; je" at the
+            // top of glibc's free); the trampoline re-emits it as "Jcc rel32".
+            {
+                void* address = conditional_jump_address(reinterpret_cast<uint8_t*>(func) + size, info.length, &patch_data.jcc_condition);
+                // A loop back into the patched bytes would land in the middle of the hook's jmp.
+                if (address >= func && address < reinterpret_cast<uint8_t*>(func) + size + info.length)
+                    return 0;
+                if (size + info.length >= JMP_CODE_BYTES && address) {
+                    patch_data.jcc_code_offset = size;
+                    patch_data.jcc_address = reinterpret_cast<uintptr_t>(address);
+                    ptrdiff_t const adjusted_displacement = patch_data.jcc_address - reinterpret_cast<uintptr_t>(func);
+                    if (adjusted_displacement < patch_data.bottom)
+                        patch_data.bottom = adjusted_displacement;
+                    if (patch_data.top < adjusted_displacement)
+                        patch_data.top = adjusted_displacement;
+                    return size + info.length;
+                }
+                return size;
+            }
+        case Zydis::InstructionMnemonic::RET:
+        case Zydis::InstructionMnemonic::RETF:
+        case Zydis::InstructionMnemonic::JCXZ:
+        case Zydis::InstructionMnemonic::JECXZ:
+        case Zydis::InstructionMnemonic::JRCXZ:
         case Zydis::InstructionMnemonic::CALL:
             return size;
-        case Zydis::InstructionMnemonic::MOV:
-        case Zydis::InstructionMnemonic::MOVAPD:
-        case Zydis::InstructionMnemonic::MOVAPS:
-        case Zydis::InstructionMnemonic::MOVBE:
-        case Zydis::InstructionMnemonic::MOVD:
-        case Zydis::InstructionMnemonic::MOVDDUP:
-        case Zydis::InstructionMnemonic::MOVDQ2Q:
-        case Zydis::InstructionMnemonic::MOVDQA:
-        case Zydis::InstructionMnemonic::MOVDQU:
-        case Zydis::InstructionMnemonic::MOVHLPS:
-        case Zydis::InstructionMnemonic::MOVHPD:
-        case Zydis::InstructionMnemonic::MOVHPS:
-        case Zydis::InstructionMnemonic::MOVLHPS:
-        case Zydis::InstructionMnemonic::MOVLPD:
-        case Zydis::InstructionMnemonic::MOVLPS:
-        case Zydis::InstructionMnemonic::MOVMSKPD:
-        case Zydis::InstructionMnemonic::MOVMSKPS:
-        case Zydis::InstructionMnemonic::MOVNTDQ:
-        case Zydis::InstructionMnemonic::MOVNTDQA:
-        case Zydis::InstructionMnemonic::MOVNTI:
-        case Zydis::InstructionMnemonic::MOVNTPD:
-        case Zydis::InstructionMnemonic::MOVNTPS:
-        case Zydis::InstructionMnemonic::MOVNTQ:
-        case Zydis::InstructionMnemonic::MOVQ:
-        case Zydis::InstructionMnemonic::MOVQ2DQ:
-        case Zydis::InstructionMnemonic::MOVSB:
-        case Zydis::InstructionMnemonic::MOVSD:
-        case Zydis::InstructionMnemonic::MOVSHDUP:
-        case Zydis::InstructionMnemonic::MOVSLDUP:
-        case Zydis::InstructionMnemonic::MOVSQ:
-        case Zydis::InstructionMnemonic::MOVSS:
-        case Zydis::InstructionMnemonic::MOVSW:
-        case Zydis::InstructionMnemonic::MOVSX:
-        case Zydis::InstructionMnemonic::MOVSXD:
-        case Zydis::InstructionMnemonic::MOVUPD:
-        case Zydis::InstructionMnemonic::MOVUPS:
-        case Zydis::InstructionMnemonic::MOVZX:
-        case Zydis::InstructionMnemonic::LEA:
+        default:
+            break;
+        }
+
+        // Any instruction may address memory relative to RIP (e.g. "cmp byte ptr [rip+x], 0"
+        // at the top of glibc's malloc). The disp32 is followed only by the immediate, if any.
+        {
+            size_t immediate_bytes = 0;
+            for(size_t i = 0; i < sizeof(info.operand)/sizeof(info.operand[0]); ++i) {
+                if (info.operand[i].type == Zydis::OperandType::IMMEDIATE)
+                    immediate_bytes += info.operand[i].size / 8;
+            }
             for(size_t i = 0; i < sizeof(info.operand)/sizeof(info.operand[0]); ++i) {
                 Zydis::OperandInfo& operand = info.operand[i];
                 if (operand.type == Zydis::OperandType::MEMORY && operand.base == Zydis::Register::RIP) {
-                    if (patch_data.rip_count < RIP_PATCH_MAX) {
-                        rip_patch_t& patch = patch_data.rip_patch[patch_data.rip_count];
-                        patch.offset = size + 3;
-                        patch.displacement = operand.lval.sdword;
-
-                        ptrdiff_t const adjusted_displacement = patch.displacement + static_cast<ptrdiff_t>(info.instrAddress - reinterpret_cast<uintptr_t>(func));
-                        if (adjusted_displacement < patch_data.bottom)
-                            patch_data.bottom = adjusted_displacement;
-                        if (patch_data.top < adjusted_displacement)
-                            patch_data.top = adjusted_displacement;
-
-                        ++patch_data.rip_count;
-                    }
+                    if (patch_data.rip_count >= RIP_PATCH_MAX)
+                        return 0;
+                    rip_patch_t& patch = patch_data.rip_patch[patch_data.rip_count];
+                    patch.offset = size + info.length - sizeof(int32_t) - immediate_bytes;
+                    patch.displacement = operand.lval.sdword;
+
+                    ptrdiff_t const adjusted_displacement = patch.displacement + static_cast<ptrdiff_t>(info.instrAddress - reinterpret_cast<uintptr_t>(func));
+                    if (adjusted_displacement < patch_data.bottom)
+                        patch_data.bottom = adjusted_displacement;
+                    if (patch_data.top < adjusted_displacement)
+                        patch_data.top = adjusted_displacement;
+
+                    ++patch_data.rip_count;
                 }
             }
-            break;
-        default:
-            break;
         }
 
 #if DEBUG_FUNCTION_HOOK
@@ -393,6 +405,15 @@ void fixup_ip_relative(uint8_t *code, uint8_t *original_code, patch_data_t const
     }
 }
 
+// Emits "Jcc rel32" and returns the end of the emitted code.
+uint8_t* emit_conditional_jump(uint8_t* code, uint8_t condition, uint8_t* jump_to) {
+    int32_t const displacement = static_cast<int32_t>(jump_to - (code + 6));
+    code[0] = 0x0f;
+    code[1] = 0x80 | condition;
+    memcpy(code + 2, &displacement, sizeof(displacement));
+    return code + 6;
+}
+
 void flush_icache(void* lower, void* upper) {
     // x64: no need to flush icache
     // see https://github.com/LuaJIT/LuaJIT/blob/f50bf7585a32738c4fb719cb8fc59d02231fc8c3/src/lj_mcode.c#L36
@@ -425,7 +446,12 @@ void* hook_function(void* func, void* hook_func) {
             memcpy(trampoline->original_code, func, size);
             memcpy(trampoline->entry_code, func, size);
             fixup_ip_relative(trampoline->entry_code, static_cast<uint8_t *>(func), patch_data);
-            uint8_t* const end_entry_code = emit_jump(trampoline->entry_code + size, static_cast<uint8_t *>(func) + size);
+            uint8_t* entry_code_end = trampoline->entry_code + size;
+            if (patch_data.jcc_address != 0) {
+                entry_code_end = emit_conditional_jump(trampoline->entry_code + patch_data.jcc_code_offset,
+                                                       patch_data.jcc_condition, reinterpret_cast<uint8_t*>(patch_data.jcc_address));
+            }
+            uint8_t* const end_entry_code = emit_jump(entry_code_end, static_cast<uint8_t *>(func) + size);
             flush_icache(trampoline->entry_code, end_entry_code);
 
             uintptr_t const func_addr = reinterpret_cast<uintptr_t>(func);
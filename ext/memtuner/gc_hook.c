@@ -0,0 +1,65 @@
+#include "gc_hook.h"
+#include <ruby/ruby.h>
+#include <ruby/debug.h>
+
+#define GC_END_LISTENER_MAX 4
+
+static VALUE s_stat_keys[GC_HOOK_STAT_COUNT];
+/* written with the GVL, read by any thread */
+static size_t s_stats[GC_HOOK_STAT_COUNT];
+static VALUE s_tracepoint = Qnil;
+/* guarded by the GVL */
+static gc_end_listener_t s_listeners[GC_END_LISTENER_MAX];
+static int s_listener_count = 0;
+
+void gc_hook_refresh(void) {
+	int i;
+	for (i = 0; i < GC_HOOK_STAT_COUNT; ++i)
+		__atomic_store_n(&s_stats[i], rb_gc_stat(s_stat_keys[i]), __ATOMIC_RELAXED);
+}
+
+size_t gc_hook_stat(gc_hook_stat_t stat) {
+	return __atomic_load_n(&s_stats[stat], __ATOMIC_RELAXED);
+}
+
+static void gc_end_hook(VALUE tpval, void* data) {
+	int i;
+	gc_hook_refresh();
+	for (i = 0; i < s_listener_count; ++i) {
+		if (s_listeners[i] != NULL)
+			s_listeners[i]();
+	}
+}
+
+void add_gc_end_listener(gc_end_listener_t listener) {
+	if (s_listener_count == GC_END_LISTENER_MAX)
+		rb_raise(rb_eRuntimeError, "too many GC listeners");
+	s_listeners[s_listener_count++] = listener;
+	gc_hook_refresh();
+	if (NIL_P(s_tracepoint)) {
+		s_tracepoint = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_END_SWEEP, gc_end_hook, NULL);
+		rb_gc_register_address(&s_tracepoint);
+	}
+	if (s_listener_count == 1)
+		rb_tracepoint_enable(s_tracepoint);
+}
+
+void remove_gc_end_listener(gc_end_listener_t listener) {
+	int i;
+	for (i = 0; i < s_listener_count; ++i) {
+		if (s_listeners[i] == listener) {
+			s_listeners[i] = s_listeners[--s_listener_count];
+			break;
+		}
+	}
+	if (s_listener_count == 0 && !NIL_P(s_tracepoint))
+		rb_tracepoint_disable(s_tracepoint);
+}
+
+void init_gc_hook(void) {
+	s_stat_keys[GC_HOOK_HEAP_AVAILABLE_SLOTS] = ID2SYM(rb_intern("heap_available_slots"));
+	s_stat_keys[GC_HOOK_HEAP_LIVE_SLOTS] = ID2SYM(rb_intern("heap_live_slots"));
+	s_stat_keys[GC_HOOK_HEAP_FREE_SLOTS] = ID2SYM(rb_intern("heap_free_slots"));
+	s_stat_keys[GC_HOOK_COUNT] = ID2SYM(rb_intern("count"));
+	s_stat_keys[GC_HOOK_MAJOR_GC_COUNT] = ID2SYM(rb_intern("major_gc_count"));
+}
@@ -0,0 +1,32 @@
+#ifndef __GC_HOOK_H
+#define __GC_HOOK_H
+#include <stddef.h>
+
+/*
+ * One GC_END_SWEEP tracepoint shared by the modules that follow GC. It
+ * copies a few GC.stat counters for threads that don't hold the GVL and
+ * then calls the listeners. All functions but gc_hook_stat need the GVL.
+ */
+typedef enum {
+	GC_HOOK_HEAP_AVAILABLE_SLOTS,
+	GC_HOOK_HEAP_LIVE_SLOTS,
+	GC_HOOK_HEAP_FREE_SLOTS,
+	GC_HOOK_COUNT,
+	GC_HOOK_MAJOR_GC_COUNT,
+	GC_HOOK_STAT_COUNT
+} gc_hook_stat_t;
+
+typedef void (*gc_end_listener_t)(void);
+
+extern void init_gc_hook(void);
+/*
+ * The tracepoint is enabled while any listener is added; a NULL listener
+ * only keeps the counters current. Adding one also refreshes them.
+ */
+extern void add_gc_end_listener(gc_end_listener_t listener);
+extern void remove_gc_end_listener(gc_end_listener_t listener);
+/* as of the latest GC, or the latest refresh */
+extern size_t gc_hook_stat(gc_hook_stat_t stat);
+extern void gc_hook_refresh(void);
+
+#endif
@@ -23,7 +23,8 @@
 #include <procfs.h>
 
 #elif defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
-#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #endif
 
@@ -82,6 +83,42 @@ size_t getPeakRSS( )
 
 
 
+#if defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
+/*
+ * /proc/self/statm stays open so a query is a single pread with no
+ * allocation; that keeps it out of the malloc trace and cheap enough for
+ * the collector. The fd names the opening process, so a forked child
+ * drops it and opens its own.
+ */
+static int statm_fd = -1;
+
+static void reset_statm_fd( void )
+{
+	if ( statm_fd >= 0 )
+		close( statm_fd );
+	statm_fd = -1;
+}
+
+static int open_statm_fd( void )
+{
+	int expected = -1;
+	int fd = open( "/proc/self/statm", O_RDONLY | O_CLOEXEC );
+	if ( fd < 0 )
+		return -1;
+	if ( !__atomic_compare_exchange_n( &statm_fd, &expected, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+	{
+		close( fd );		/* Another thread won. */
+		return expected;
+	}
+	{
+		static int atfork_registered = 0;
+		if ( !__atomic_exchange_n( &atfork_registered, 1, __ATOMIC_ACQ_REL ) )
+			pthread_atfork( NULL, NULL, reset_statm_fd );
+	}
+	return fd;
+}
+#endif
+
 /**
  * Returns the current resident set size (physical memory use) measured
  * in bytes, or zero if the value cannot be determined on this OS.
@@ -113,17 +150,30 @@ size_t getCurrentRSS( )
 #endif
 #elif defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
 	/* Linux ---------------------------------------------------- */
-	long rss = 0L;
-	FILE* fp = NULL;
-	if ( (fp = fopen( "/proc/self/statm", "r" )) == NULL )
+	static size_t page_size = 0;
+	char buf[128];
+	char const* p;
+	char const* end;
+	size_t rss = 0;
+	ssize_t len;
+	int fd = __atomic_load_n( &statm_fd, __ATOMIC_ACQUIRE );
+	if ( fd < 0 && (fd = open_statm_fd( )) < 0 )
 		return (size_t)0L;		/* Can't open? */
-	if ( fscanf( fp, "%*s%ld", &rss ) != 1 )
-	{
-		fclose( fp );
+	if ( (len = pread( fd, buf, sizeof(buf), 0 )) <= 0 )
 		return (size_t)0L;		/* Can't read? */
-	}
-	fclose( fp );
-	return (size_t)rss * (size_t)sysconf( _SC_PAGESIZE);
+	end = buf + len;
+
+	/* "size resident shared ...": skip size, parse resident */
+	for ( p = buf; p < end && *p != ' '; ++p )
+		;
+	if ( ++p >= end || *p < '0' || *p > '9' )
+		return (size_t)0L;
+	for ( ; p < end && *p >= '0' && *p <= '9'; ++p )
+		rss = rss * 10 + (size_t)(*p - '0');
+
+	if ( page_size == 0 )
+		page_size = (size_t)sysconf( _SC_PAGESIZE );
+	return rss * page_size;
 
 #else
 	/* AIX, BSD, Solaris, and Unknown OS ------------------------ */
@@ -0,0 +1,221 @@
+#include "heap_snapshot.h"
+#include "live_heap.h"
+#include "stack_table.h"
+#include "varint.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Columnar layout, one record per stack with live allocations, ordered by
+ * stack key (stack id + 1, 0 for unknown):
+ *   varint  key delta from the previous record
+ *   varint  zigzag delta of bytes from the previous record
+ *   varint  count
+ * A snapshot of a few thousand stacks takes a few kilobytes.
+ */
+typedef struct {
+	uint8_t* data;
+	size_t size;
+	size_t record_count;
+	size_t total_bytes;
+	size_t total_count;
+} heap_snapshot_t;
+
+typedef struct {
+	uint8_t const* pos;
+	size_t remaining;
+	uint64_t key;
+	int64_t bytes;
+	uint64_t count;
+} snapshot_cursor_t;
+
+typedef struct {
+	uint64_t key;
+	int64_t bytes;
+	int64_t count;
+} snapshot_delta_t;
+
+static VALUE rb_cHeapSnapshot;
+static VALUE sym_frames;
+static VALUE sym_bytes;
+static VALUE sym_count;
+
+static void heap_snapshot_free(void* ptr) {
+	heap_snapshot_t* const snapshot = ptr;
+	free(snapshot->data);
+	free(snapshot);
+}
+
+static size_t heap_snapshot_memsize(void const* ptr) {
+	heap_snapshot_t const* const snapshot = ptr;
+	return sizeof(*snapshot) + snapshot->size;
+}
+
+static rb_data_type_t const s_heap_snapshot_type = {
+	"memtuner_heap_snapshot",
+	{ NULL, heap_snapshot_free, heap_snapshot_memsize, },
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+VALUE heap_snapshot_new(void) {
+	size_t count = 0;
+	live_stack_t* stacks;
+	heap_snapshot_t* snapshot;
+	VALUE obj;
+	uint64_t previous_key = 0;
+	int64_t previous_bytes = 0;
+	size_t i;
+
+	/* allocate the object first so nothing raises while stacks is held */
+	obj = TypedData_Make_Struct(rb_cHeapSnapshot, heap_snapshot_t, &s_heap_snapshot_type, snapshot);
+	stacks = live_heap_aggregate(&count);
+	if (stacks == NULL)
+		return obj;
+	snapshot->data = malloc(count * VARINT_MAX_BYTES * 3);
+	if (snapshot->data == NULL) {
+		free(stacks);
+		rb_raise(rb_eNoMemError, "failed to allocate heap snapshot");
+	}
+	for (i = 0; i < count; ++i) {
+		live_stack_t const* const stack = &stacks[i];
+		if (stack->count == 0)
+			continue;
+		snapshot->size += encode_varint(i - previous_key, snapshot->data + snapshot->size);
+		snapshot->size += encode_varint(zigzag_encode((int64_t)stack->bytes - previous_bytes), snapshot->data + snapshot->size);
+		snapshot->size += encode_varint(stack->count, snapshot->data + snapshot->size);
+		previous_key = i;
+		previous_bytes = (int64_t)stack->bytes;
+		snapshot->record_count += 1;
+		snapshot->total_bytes += stack->bytes;
+		snapshot->total_count += stack->count;
+	}
+	free(stacks);
+	/* give back the worst-case reservation */
+	if (snapshot->size > 0) {
+		uint8_t* const data = realloc(snapshot->data, snapshot->size);
+		if (data != NULL)
+			snapshot->data = data;
+	}
+	return obj;
+}
+
+static int snapshot_cursor_next(snapshot_cursor_t* cursor) {
+	uint64_t n;
+	if (cursor->remaining == 0)
+		return 0;
+	cursor->pos += decode_varint(cursor->pos, &n);
+	cursor->key += n;
+	cursor->pos += decode_varint(cursor->pos, &n);
+	cursor->bytes += zigzag_decode(n);
+	cursor->pos += decode_varint(cursor->pos, &n);
+	cursor->count = n;
+	cursor->remaining -= 1;
+	return 1;
+}
+
+static void snapshot_cursor_init(snapshot_cursor_t* cursor, heap_snapshot_t const* snapshot) {
+	memset(cursor, 0, sizeof(*cursor));
+	cursor->pos = snapshot->data;
+	cursor->remaining = snapshot->record_count;
+}
+
+static int compare_delta_bytes_desc(void const* a, void const* b) {
+	int64_t const lhs = ((snapshot_delta_t const*)a)->bytes;
+	int64_t const rhs = ((snapshot_delta_t const*)b)->bytes;
+	return lhs < rhs ? 1 : lhs > rhs ? -1 : 0;
+}
+
+static heap_snapshot_t* get_heap_snapshot(VALUE obj) {
+	heap_snapshot_t* snapshot;
+	TypedData_Get_Struct(obj, heap_snapshot_t, &s_heap_snapshot_type, snapshot);
+	return snapshot;
+}
+
+/*
+ * newer.diff(older, limit = 20) -> [{frames:, bytes:, count:}, ...]
+ * Net growth per stack from older to newer, largest growth first.
+ */
+static VALUE rb_heap_snapshot_diff(int argc, VALUE* argv, VALUE self) {
+	VALUE other, limit_value, ary, buffer;
+	heap_snapshot_t const* newer = get_heap_snapshot(self);
+	heap_snapshot_t const* older;
+	snapshot_cursor_t a, b;
+	snapshot_delta_t* deltas;
+	size_t n = 0, i, limit;
+	int has_a, has_b;
+
+	rb_scan_args(argc, argv, "11", &other, &limit_value);
+	older = get_heap_snapshot(other);
+	limit = NIL_P(limit_value) ? 20 : NUM2SIZET(limit_value);
+
+	/* owned by the GC, so a raising allocation below doesn't leak it */
+	deltas = ALLOCV_N(snapshot_delta_t, buffer, newer->record_count + older->record_count + 1);
+
+	snapshot_cursor_init(&a, older);
+	snapshot_cursor_init(&b, newer);
+	has_a = snapshot_cursor_next(&a);
+	has_b = snapshot_cursor_next(&b);
+	while (has_a || has_b) {
+		snapshot_delta_t* const delta = &deltas[n];
+		if (has_b && (!has_a || b.key < a.key)) {
+			delta->key = b.key;
+			delta->bytes = b.bytes;
+			delta->count = (int64_t)b.count;
+			has_b = snapshot_cursor_next(&b);
+		} else if (has_a && (!has_b || a.key < b.key)) {
+			delta->key = a.key;
+			delta->bytes = -a.bytes;
+			delta->count = -(int64_t)a.count;
+			has_a = snapshot_cursor_next(&a);
+		} else {
+			delta->key = a.key;
+			delta->bytes = b.bytes - a.bytes;
+			delta->count = (int64_t)b.count - (int64_t)a.count;
+			has_a = snapshot_cursor_next(&a);
+			has_b = snapshot_cursor_next(&b);
+		}
+		if (delta->bytes != 0 || delta->count != 0)
+			++n;
+	}
+	qsort(deltas, n, sizeof(snapshot_delta_t), compare_delta_bytes_desc);
+
+	if (limit > n)
+		limit = n;
+	ary = rb_ary_new_capa(limit);
+	for (i = 0; i < limit; ++i) {
+		VALUE hash = rb_hash_new();
+		rb_hash_aset(hash, sym_frames, deltas[i].key == 0 ? rb_ary_new() : stack_table_frames_to_a((uint32_t)(deltas[i].key - 1)));
+		rb_hash_aset(hash, sym_bytes, LL2NUM(deltas[i].bytes));
+		rb_hash_aset(hash, sym_count, LL2NUM(deltas[i].count));
+		rb_ary_push(ary, hash);
+	}
+	ALLOCV_END(buffer);
+	return ary;
+}
+
+static VALUE rb_heap_snapshot_total_bytes(VALUE self) {
+	return SIZET2NUM(get_heap_snapshot(self)->total_bytes);
+}
+
+static VALUE rb_heap_snapshot_total_count(VALUE self) {
+	return SIZET2NUM(get_heap_snapshot(self)->total_count);
+}
+
+static VALUE rb_heap_snapshot_bytesize(VALUE self) {
+	return SIZET2NUM(get_heap_snapshot(self)->size);
+}
+
+void init_heap_snapshot(VALUE module) {
+#define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
+	DEF_SYM(frames);
+	DEF_SYM(bytes);
+	DEF_SYM(count);
+#undef DEF_SYM
+
+	rb_cHeapSnapshot = rb_define_class_under(module, "HeapSnapshot", rb_cObject);
+	rb_undef_alloc_func(rb_cHeapSnapshot);
+	rb_define_method(rb_cHeapSnapshot, "diff", rb_heap_snapshot_diff, -1);
+	rb_define_method(rb_cHeapSnapshot, "total_bytes", rb_heap_snapshot_total_bytes, 0);
+	rb_define_method(rb_cHeapSnapshot, "total_count", rb_heap_snapshot_total_count, 0);
+	rb_define_method(rb_cHeapSnapshot, "bytesize", rb_heap_snapshot_bytesize, 0);
+}
@@ -0,0 +1,9 @@
+#ifndef __HEAP_SNAPSHOT_H
+#define __HEAP_SNAPSHOT_H
+#include <ruby/ruby.h>
+
+/* Memtuner::HeapSnapshot: compact copies of the live heap for diffing. */
+extern void init_heap_snapshot(VALUE module);
+extern VALUE heap_snapshot_new(void);
+
+#endif
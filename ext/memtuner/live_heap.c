@@ -0,0 +1,322 @@
+#include "live_heap.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h> /* mmap */
+#include "debug.h"
+#include "mmap_tracer.h"
+
+typedef struct {
+	uintptr_t key; /* LIVE_KEY_EMPTY, LIVE_KEY_DELETED or a live pointer */
+	size_t size;
+	uint64_t timestamp_ms;
+	uint32_t stack_id;
+	uint32_t owner;
+} live_entry_t;
+
+#define LIVE_KEY_EMPTY ((uintptr_t)0)
+#define LIVE_KEY_DELETED ((uintptr_t)1)
+/* virtual size 128MB; pages are only touched as slots are used */
+#define LIVE_HEAP_CAPACITY ((size_t)1 << 22)
+#define LIVE_HEAP_PROBE_MAX 1024
+/* live keys per block of slots, so aggregation skips the empty ones */
+#define LIVE_HEAP_BLOCK_SHIFT 6
+#define LIVE_HEAP_BLOCK_COUNT (LIVE_HEAP_CAPACITY >> LIVE_HEAP_BLOCK_SHIFT)
+
+static live_entry_t* s_entries = NULL;
+static uint32_t s_block_counts[LIVE_HEAP_BLOCK_COUNT];
+static size_t s_overflow_count = 0;
+
+static VALUE sym_frames;
+static VALUE sym_bytes;
+static VALUE sym_count;
+static VALUE sym_oldest_age;
+static VALUE sym_untracked_count;
+
+int init_live_heap(void) {
+	void* p;
+	if (s_entries != NULL)
+		return 1;
+	p = mmap(NULL, sizeof(live_entry_t) * LIVE_HEAP_CAPACITY, PROT_READ | PROT_WRITE,
+	         MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		memtuner_debug_print("init_live_heap failed\n");
+		return 0;
+	}
+	add_tracer_mapping(p, sizeof(live_entry_t) * LIVE_HEAP_CAPACITY);
+	s_entries = p;
+	return 1;
+}
+
+static size_t home_slot(uintptr_t key) {
+	return (size_t)(((uint64_t)(key >> 4) * 0x9E3779B97F4A7C15ULL) >> 42) & (LIVE_HEAP_CAPACITY - 1);
+}
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static live_entry_t* find_entry(uintptr_t key) {
+	size_t i, n;
+	for (i = home_slot(key), n = 0; n < LIVE_HEAP_PROBE_MAX; i = (i + 1) & (LIVE_HEAP_CAPACITY - 1), ++n) {
+		uintptr_t const k = __atomic_load_n(&s_entries[i].key, __ATOMIC_SEQ_CST);
+		if (k == key)
+			return &s_entries[i];
+		if (k == LIVE_KEY_EMPTY)
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * A key is only looked up by the thread that inserted it, so it may be
+ * invisible while it is being placed, but never afterwards: a slot that
+ * ends up behind an empty one, because compact_tombstones emptied a slot
+ * on the way concurrently, is given up and claimed again.
+ */
+static uint32_t claim_slot(uintptr_t key) {
+	size_t const home = home_slot(key);
+	size_t i, n;
+retry:
+	{
+		size_t deleted = LIVE_HEAP_CAPACITY;
+		size_t claimed = LIVE_HEAP_CAPACITY;
+		for (i = home, n = 0; n < LIVE_HEAP_PROBE_MAX; i = (i + 1) & (LIVE_HEAP_CAPACITY - 1), ++n) {
+			uintptr_t k = __atomic_load_n(&s_entries[i].key, __ATOMIC_SEQ_CST);
+			/* a stale entry for a reused address whose free we missed */
+			if (k == key)
+				return (uint32_t)i;
+			if (k == LIVE_KEY_DELETED) {
+				if (deleted == LIVE_HEAP_CAPACITY)
+					deleted = i;
+				continue;
+			}
+			if (k == LIVE_KEY_EMPTY) {
+				claimed = deleted != LIVE_HEAP_CAPACITY ? deleted : i;
+				break;
+			}
+		}
+		/* without an empty slot in reach, the key can only go in a tombstone */
+		if (claimed == LIVE_HEAP_CAPACITY)
+			claimed = deleted;
+		if (claimed == LIVE_HEAP_CAPACITY) {
+			__atomic_fetch_add(&s_overflow_count, 1, __ATOMIC_RELAXED);
+			return LIVE_HEAP_SLOT_INVALID;
+		}
+		{
+			uintptr_t expected = claimed == deleted ? LIVE_KEY_DELETED : LIVE_KEY_EMPTY;
+			if (!__atomic_compare_exchange_n(&s_entries[claimed].key, &expected, key, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+				goto retry;
+		}
+		for (i = home; i != claimed; i = (i + 1) & (LIVE_HEAP_CAPACITY - 1)) {
+			if (__atomic_load_n(&s_entries[i].key, __ATOMIC_SEQ_CST) == LIVE_KEY_EMPTY) {
+				__atomic_store_n(&s_entries[claimed].key, LIVE_KEY_DELETED, __ATOMIC_SEQ_CST);
+				goto retry;
+			}
+		}
+		__atomic_fetch_add(&s_block_counts[claimed >> LIVE_HEAP_BLOCK_SHIFT], 1, __ATOMIC_RELAXED);
+		return (uint32_t)claimed;
+	}
+}
+
+/*
+ * Tombstones followed by an empty slot end no probe sequence that
+ * continues past them, so they are turned back into empty slots, from
+ * slot i backwards. If an insert took the following slot meanwhile, the
+ * tombstone is restored; claim_slot sees either that or the empty slot.
+ */
+static void compact_tombstones(size_t i) {
+	size_t n;
+	for (n = 0; n < LIVE_HEAP_PROBE_MAX; i = (i - 1) & (LIVE_HEAP_CAPACITY - 1), ++n) {
+		size_t const next = (i + 1) & (LIVE_HEAP_CAPACITY - 1);
+		uintptr_t expected = LIVE_KEY_DELETED;
+		if (__atomic_load_n(&s_entries[next].key, __ATOMIC_SEQ_CST) != LIVE_KEY_EMPTY)
+			return;
+		if (!__atomic_compare_exchange_n(&s_entries[i].key, &expected, LIVE_KEY_EMPTY, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return;
+		if (__atomic_load_n(&s_entries[next].key, __ATOMIC_SEQ_CST) != LIVE_KEY_EMPTY) {
+			expected = LIVE_KEY_EMPTY;
+			__atomic_compare_exchange_n(&s_entries[i].key, &expected, LIVE_KEY_DELETED, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			return;
+		}
+	}
+}
+
+uint32_t live_heap_insert(void const* ptr, size_t size, uint32_t stack_id, uint32_t owner) {
+	uint32_t slot;
+	live_entry_t* entry;
+	if (s_entries == NULL || (uintptr_t)ptr <= LIVE_KEY_DELETED)
+		return LIVE_HEAP_SLOT_INVALID;
+	slot = claim_slot((uintptr_t)ptr);
+	if (slot == LIVE_HEAP_SLOT_INVALID)
+		return slot;
+	entry = &s_entries[slot];
+	entry->size = size;
+	entry->timestamp_ms = now_ms();
+	entry->owner = owner;
+	__atomic_store_n(&entry->stack_id, stack_id, __ATOMIC_RELEASE);
+	return slot;
+}
+
+int live_heap_detach(void const* ptr, live_allocation_t* allocation) {
+	live_entry_t* entry;
+	uintptr_t expected = (uintptr_t)ptr;
+	if (s_entries == NULL || (uintptr_t)ptr <= LIVE_KEY_DELETED)
+		return 0;
+	entry = find_entry((uintptr_t)ptr);
+	if (entry == NULL)
+		return 0;
+	if (allocation != NULL) {
+		allocation->size = entry->size;
+		allocation->timestamp_ms = entry->timestamp_ms;
+		allocation->stack_id = __atomic_load_n(&entry->stack_id, __ATOMIC_ACQUIRE);
+		allocation->owner = entry->owner;
+	}
+	if (!__atomic_compare_exchange_n(&entry->key, &expected, LIVE_KEY_DELETED, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		return 0;
+	__atomic_fetch_sub(&s_block_counts[(size_t)(entry - s_entries) >> LIVE_HEAP_BLOCK_SHIFT], 1, __ATOMIC_RELAXED);
+	compact_tombstones((size_t)(entry - s_entries));
+	return 1;
+}
+
+void live_heap_remove(void const* ptr) {
+	live_heap_detach(ptr, NULL);
+}
+
+void live_heap_attach(void const* ptr, live_allocation_t const* allocation) {
+	live_entry_t* entry;
+	uint32_t slot;
+	if (s_entries == NULL || (uintptr_t)ptr <= LIVE_KEY_DELETED)
+		return;
+	slot = claim_slot((uintptr_t)ptr);
+	if (slot == LIVE_HEAP_SLOT_INVALID)
+		return;
+	entry = &s_entries[slot];
+	entry->size = allocation->size;
+	entry->timestamp_ms = allocation->timestamp_ms;
+	entry->owner = allocation->owner;
+	__atomic_store_n(&entry->stack_id, allocation->stack_id, __ATOMIC_RELEASE);
+}
+
+size_t live_heap_overflow_count(void) {
+	return __atomic_load_n(&s_overflow_count, __ATOMIC_RELAXED);
+}
+
+void live_heap_resolve(uint32_t slot, uint32_t owner, uint32_t stack_id) {
+	live_entry_t* const entry = &s_entries[slot];
+	uint32_t expected = STACK_ID_PENDING;
+	/* the slot may have been freed and reused by another thread since */
+	if (entry->owner == owner)
+		__atomic_compare_exchange_n(&entry->stack_id, &expected, stack_id, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static live_stack_t* s_sort_stacks;
+
+static int compare_live_bytes_desc(void const* a, void const* b) {
+	size_t const lhs = s_sort_stacks[*(uint32_t const*)a].bytes;
+	size_t const rhs = s_sort_stacks[*(uint32_t const*)b].bytes;
+	return lhs < rhs ? 1 : lhs > rhs ? -1 : 0;
+}
+
+live_stack_t* live_heap_aggregate(size_t* count) {
+	size_t const stack_count = stack_table_count();
+	live_stack_t* stacks;
+	size_t block, i;
+
+	if (s_entries == NULL)
+		return NULL;
+	stacks = calloc(stack_count + 1, sizeof(live_stack_t));
+	if (stacks == NULL)
+		rb_raise(rb_eNoMemError, "failed to allocate live heap aggregation");
+	/* blocks that were empty when checked are skipped; entries inserted meanwhile may be missed anyway */
+	for (block = 0; block < LIVE_HEAP_BLOCK_COUNT; ++block) {
+		if (__atomic_load_n(&s_block_counts[block], __ATOMIC_RELAXED) == 0)
+			continue;
+		for (i = block << LIVE_HEAP_BLOCK_SHIFT; i < (block + 1) << LIVE_HEAP_BLOCK_SHIFT; ++i) {
+			live_entry_t const* const entry = &s_entries[i];
+			uint32_t stack_id;
+			live_stack_t* stack;
+			if (__atomic_load_n(&entry->key, __ATOMIC_ACQUIRE) <= LIVE_KEY_DELETED)
+				continue;
+			stack_id = __atomic_load_n(&entry->stack_id, __ATOMIC_ACQUIRE);
+			stack = &stacks[stack_id < stack_count ? stack_id + 1 : 0];
+			if (stack->count == 0 || entry->timestamp_ms < stack->oldest_ms)
+				stack->oldest_ms = entry->timestamp_ms;
+			stack->bytes += entry->size;
+			stack->count += 1;
+		}
+	}
+	*count = stack_count + 1;
+	return stacks;
+}
+
+static VALUE live_stack_to_hash(live_stack_t const* stacks, uint32_t index, uint64_t now) {
+	live_stack_t const* const stack = &stacks[index];
+	VALUE hash = rb_hash_new();
+	rb_hash_aset(hash, sym_frames, index == 0 ? rb_ary_new() : stack_table_frames_to_a(index - 1));
+	rb_hash_aset(hash, sym_bytes, SIZET2NUM(stack->bytes));
+	rb_hash_aset(hash, sym_count, SIZET2NUM(stack->count));
+	rb_hash_aset(hash, sym_oldest_age, stack->count > 0 ? DBL2NUM((now - stack->oldest_ms) / 1000.0) : Qnil);
+	return hash;
+}
+
+/*
+ * Retained bytes per allocation stack, largest first. When allocations
+ * found no slot, the entry of unknown stacks (empty frames) is always
+ * included and counts them as untracked_count.
+ */
+VALUE live_heap_snapshot_to_a(size_t limit) {
+	uint64_t const now = now_ms();
+	size_t const overflow_count = live_heap_overflow_count();
+	size_t count;
+	live_stack_t* const stacks = live_heap_aggregate(&count);
+	uint32_t* order;
+	size_t i, n = 0;
+	VALUE ary, unknown = Qnil;
+
+	if (stacks == NULL)
+		return rb_ary_new();
+	order = malloc(sizeof(uint32_t) * count);
+	if (order == NULL) {
+		free(stacks);
+		rb_raise(rb_eNoMemError, "failed to allocate live heap snapshot");
+	}
+	for (i = 0; i < count; ++i) {
+		if (stacks[i].count > 0)
+			order[n++] = (uint32_t)i;
+	}
+	s_sort_stacks = stacks;
+	qsort(order, n, sizeof(uint32_t), compare_live_bytes_desc);
+
+	if (limit > n)
+		limit = n;
+	ary = rb_ary_new_capa(limit + 1);
+	for (i = 0; i < limit; ++i) {
+		VALUE hash = live_stack_to_hash(stacks, order[i], now);
+		if (order[i] == 0)
+			unknown = hash;
+		rb_ary_push(ary, hash);
+	}
+	if (overflow_count > 0) {
+		if (NIL_P(unknown)) {
+			unknown = live_stack_to_hash(stacks, 0, now);
+			rb_ary_push(ary, unknown);
+		}
+		rb_hash_aset(unknown, sym_untracked_count, SIZET2NUM(overflow_count));
+	}
+	free(stacks);
+	free(order);
+	return ary;
+}
+
+void init_live_heap_snapshot(void) {
+#define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
+	DEF_SYM(frames);
+	DEF_SYM(bytes);
+	DEF_SYM(count);
+	DEF_SYM(oldest_age);
+	DEF_SYM(untracked_count);
+#undef DEF_SYM
+}
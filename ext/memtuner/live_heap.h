@@ -0,0 +1,57 @@
+#ifndef __LIVE_HEAP_H
+#define __LIVE_HEAP_H
+#include <stddef.h>
+#include <stdint.h>
+#include <ruby/ruby.h>
+#include "stack_table.h"
+
+/*
+ * Table of live allocations: pointer -> size, allocation stack id, timestamp.
+ * Insert/remove/move are lock-free and safe to call from malloc hooks.
+ *
+ * A new entry is owned by its thread and marked STACK_ID_PENDING until that
+ * thread's next sample resolves it to a stack, the same attribution
+ * allocation_profile uses. Entries without a thread buffer get
+ * STACK_ID_INVALID.
+ */
+#define STACK_ID_PENDING (STACK_ID_INVALID - 1)
+#define LIVE_HEAP_SLOT_INVALID UINT32_MAX
+
+typedef struct {
+    size_t size;
+    uint64_t timestamp_ms;
+    uint32_t stack_id;
+    uint32_t owner;
+} live_allocation_t;
+
+extern int init_live_heap(void);
+extern uint32_t live_heap_insert(void const* ptr, size_t size, uint32_t stack_id, uint32_t owner);
+extern void live_heap_remove(void const* ptr);
+/*
+ * Removes ptr's entry and copies it to allocation; returns 0 when ptr isn't
+ * tracked. realloc detaches the old pointer before it can be freed and
+ * reused, then attaches the entry to the new pointer, or back to the old
+ * one when realloc fails.
+ */
+extern int live_heap_detach(void const* ptr, live_allocation_t* allocation);
+extern void live_heap_attach(void const* ptr, live_allocation_t const* allocation);
+extern void live_heap_resolve(uint32_t slot, uint32_t owner, uint32_t stack_id);
+/* allocations that found no slot and aren't tracked */
+extern size_t live_heap_overflow_count(void);
+
+typedef struct {
+    size_t bytes;
+    size_t count;
+    uint64_t oldest_ms;
+} live_stack_t;
+
+/* with the GVL held */
+extern void init_live_heap_snapshot(void);
+/*
+ * Live bytes per stack: index 0 is unknown or unresolved stacks, index
+ * i + 1 is stack id i. Returns NULL when tracing is off; caller frees.
+ */
+extern live_stack_t* live_heap_aggregate(size_t* count);
+extern VALUE live_heap_snapshot_to_a(size_t limit);
+
+#endif
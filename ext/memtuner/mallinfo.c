@@ -0,0 +1,59 @@
+#include "mallinfo.h"
+#include "malloc_info_parser.h"
+#include <string.h>
+#if HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+
+#if !HAVE_MALLINFO2 && HAVE_MALLINFO && HAVE_MALLOC_INFO
+static void fix_byte_totals(memtuner_mallinfo_t* info) {
+	malloc_info_t mi;
+	malloc_arena_t const* total;
+	if (!read_malloc_info(&mi))
+		return;
+	/* the whole-process totals always report the system bytes; without them keep mallinfo's */
+	total = &mi.total;
+	if (total->system_current != 0) {
+		info->arena = total->system_current;
+		info->smblks = total->fast_count;
+		info->fsmblks = total->fast_size;
+		info->ordblks = total->rest_count;
+		info->fordblks = total->fast_size + total->rest_size;
+		info->uordblks = info->arena > info->fordblks ? info->arena - info->fordblks : 0;
+		info->hblks = total->mmap_count;
+		info->hblkhd = total->mmap_size;
+	}
+	free_malloc_info(&mi);
+}
+#endif
+
+int get_mallinfo(memtuner_mallinfo_t* info) {
+#if HAVE_MALLINFO2
+	struct mallinfo2 mi = mallinfo2();
+#define COPY_FIELD(name) info->name = mi.name
+#elif HAVE_MALLINFO
+	struct mallinfo mi = mallinfo();
+	/* the int fields wrap past 2GB; read them as unsigned and fix the bytes below */
+#define COPY_FIELD(name) info->name = (unsigned int)mi.name
+#else
+	memset(info, 0, sizeof(*info));
+	return 0;
+#endif
+#if HAVE_MALLINFO2 || HAVE_MALLINFO
+	COPY_FIELD(arena);
+	COPY_FIELD(ordblks);
+	COPY_FIELD(smblks);
+	COPY_FIELD(hblks);
+	COPY_FIELD(hblkhd);
+	COPY_FIELD(usmblks);
+	COPY_FIELD(fsmblks);
+	COPY_FIELD(uordblks);
+	COPY_FIELD(fordblks);
+	COPY_FIELD(keepcost);
+#undef COPY_FIELD
+#if !HAVE_MALLINFO2 && HAVE_MALLOC_INFO
+	fix_byte_totals(info);
+#endif
+	return 1;
+#endif
+}
@@ -0,0 +1,26 @@
+#ifndef __MALLINFO_H
+#define __MALLINFO_H
+#include <stddef.h>
+
+/* struct mallinfo with size_t fields, so totals past 2GB don't wrap */
+typedef struct {
+	size_t arena;    /* Non-mmapped space allocated (bytes) */
+	size_t ordblks;  /* Number of free chunks */
+	size_t smblks;   /* Number of free fastbin blocks */
+	size_t hblks;    /* Number of mmapped regions */
+	size_t hblkhd;   /* Space allocated in mmapped regions (bytes) */
+	size_t usmblks;  /* Maximum total allocated space (bytes) */
+	size_t fsmblks;  /* Space in freed fastbin blocks (bytes) */
+	size_t uordblks; /* Total allocated space (bytes) */
+	size_t fordblks; /* Total free space (bytes) */
+	size_t keepcost; /* Top-most, releasable space (bytes) */
+} memtuner_mallinfo_t;
+
+/*
+ * mallinfo2 where glibc has it (2.33+). Older glibc only has the int
+ * mallinfo, so its byte totals are rebuilt from malloc_info's XML.
+ * Returns 0 when neither is available.
+ */
+extern int get_mallinfo(memtuner_mallinfo_t* info);
+
+#endif
@@ -0,0 +1,232 @@
+#include "malloc_arenas.h"
+#include "malloc_info_parser.h"
+#include "mallinfo.h"
+#include <unistd.h> /* getpagesize */
+
+/* thresholds for recommendations */
+#define FRAGMENTATION_HIGH 0.3
+#define LARGEST_FREE_LOW 0.1
+#define TRIMMABLE_RATIO_HIGH 0.1
+#define TRIMMABLE_BYTES_HIGH ((size_t)32 << 20)
+/* glibc chunk header and minimum chunk on 64-bit */
+#define MALLOC_CHUNK_OVERHEAD 16
+
+static VALUE sym_arenas;
+static VALUE sym_total;
+static VALUE sym_nr;
+static VALUE sym_fast;
+static VALUE sym_rest;
+static VALUE sym_mmap;
+static VALUE sym_count;
+static VALUE sym_size;
+static VALUE sym_system_current;
+static VALUE sym_system_max;
+static VALUE sym_aspace_total;
+static VALUE sym_aspace_mprotect;
+static VALUE sym_subheaps;
+static VALUE sym_sizes;
+static VALUE sym_from;
+static VALUE sym_to;
+static VALUE sym_unsorted;
+
+static VALUE sym_system_bytes;
+static VALUE sym_free_bytes;
+static VALUE sym_fragmentation_ratio;
+static VALUE sym_largest_free_chunk;
+static VALUE sym_largest_free_ratio;
+static VALUE sym_trimmable_bytes;
+static VALUE sym_recommendations;
+static VALUE sym_name;
+static VALUE sym_value;
+static VALUE sym_reason;
+
+static VALUE count_size_to_hash(size_t count, size_t size) {
+	VALUE hash = rb_hash_new();
+	rb_hash_aset(hash, sym_count, SIZET2NUM(count));
+	rb_hash_aset(hash, sym_size, SIZET2NUM(size));
+	return hash;
+}
+
+static VALUE arena_to_hash(malloc_info_t const* info, malloc_arena_t const* arena) {
+	VALUE hash = rb_hash_new();
+	if (arena->nr >= 0)
+		rb_hash_aset(hash, sym_nr, INT2NUM(arena->nr));
+	rb_hash_aset(hash, sym_fast, count_size_to_hash(arena->fast_count, arena->fast_size));
+	rb_hash_aset(hash, sym_rest, count_size_to_hash(arena->rest_count, arena->rest_size));
+	rb_hash_aset(hash, sym_system_current, SIZET2NUM(arena->system_current));
+	rb_hash_aset(hash, sym_system_max, SIZET2NUM(arena->system_max));
+	rb_hash_aset(hash, sym_aspace_total, SIZET2NUM(arena->aspace_total));
+	rb_hash_aset(hash, sym_aspace_mprotect, SIZET2NUM(arena->aspace_mprotect));
+	if (arena->nr < 0) {
+		rb_hash_aset(hash, sym_mmap, count_size_to_hash(arena->mmap_count, arena->mmap_size));
+	} else {
+		VALUE sizes = rb_ary_new_capa((long)arena->sizes_count);
+		size_t i;
+		rb_hash_aset(hash, sym_subheaps, SIZET2NUM(arena->aspace_subheaps));
+		for (i = 0; i < arena->sizes_count; ++i) {
+			malloc_size_class_t const* size_class = &info->sizes[arena->sizes_offset + i];
+			VALUE entry = rb_hash_new();
+			rb_hash_aset(entry, sym_from, SIZET2NUM(size_class->from));
+			rb_hash_aset(entry, sym_to, SIZET2NUM(size_class->to));
+			rb_hash_aset(entry, sym_total, SIZET2NUM(size_class->total));
+			rb_hash_aset(entry, sym_count, SIZET2NUM(size_class->count));
+			if (size_class->unsorted)
+				rb_hash_aset(entry, sym_unsorted, Qtrue);
+			rb_ary_push(sizes, entry);
+		}
+		rb_hash_aset(hash, sym_sizes, sizes);
+	}
+	return hash;
+}
+
+VALUE malloc_arenas_to_hash(void) {
+	malloc_info_t info;
+	VALUE arenas, hash;
+	size_t i;
+	if (!read_malloc_info(&info))
+		return Qnil;
+	arenas = rb_ary_new_capa((long)info.arena_count);
+	for (i = 0; i < info.arena_count; ++i)
+		rb_ary_push(arenas, arena_to_hash(&info, &info.arenas[i]));
+	hash = rb_hash_new();
+	rb_hash_aset(hash, sym_arenas, arenas);
+	rb_hash_aset(hash, sym_total, arena_to_hash(&info, &info.total));
+	free_malloc_info(&info);
+	return hash;
+}
+
+typedef struct {
+	size_t system_bytes;
+	size_t free_bytes;
+	size_t largest_free_chunk;
+	size_t trimmable_bytes;
+} arena_fragmentation_t;
+
+/*
+ * malloc_trim returns whole pages inside free chunks with madvise and,
+ * for the main arena, the top chunk (mallinfo's keepcost). The histogram
+ * only has totals per size class, so chunks are taken at their average.
+ */
+static arena_fragmentation_t arena_fragmentation(malloc_info_t const* info, malloc_arena_t const* arena, size_t keepcost) {
+	size_t const page_size = (size_t)getpagesize();
+	arena_fragmentation_t result;
+	size_t i;
+	result.system_bytes = arena->system_current;
+	result.free_bytes = arena->fast_size + arena->rest_size;
+	result.largest_free_chunk = 0;
+	result.trimmable_bytes = arena->nr == 0 ? keepcost : 0;
+	for (i = 0; i < arena->sizes_count; ++i) {
+		malloc_size_class_t const* size_class = &info->sizes[arena->sizes_offset + i];
+		size_t average;
+		if (size_class->count == 0)
+			continue;
+		if (size_class->to > result.largest_free_chunk)
+			result.largest_free_chunk = size_class->to;
+		average = size_class->total / size_class->count;
+		if (average > page_size + MALLOC_CHUNK_OVERHEAD)
+			result.trimmable_bytes += size_class->count * ((average - MALLOC_CHUNK_OVERHEAD) / page_size - 1) * page_size;
+	}
+	return result;
+}
+
+static VALUE fragmentation_to_hash(int nr, arena_fragmentation_t const* fragmentation) {
+	VALUE hash = rb_hash_new();
+	if (nr >= 0)
+		rb_hash_aset(hash, sym_nr, INT2NUM(nr));
+	rb_hash_aset(hash, sym_system_bytes, SIZET2NUM(fragmentation->system_bytes));
+	rb_hash_aset(hash, sym_free_bytes, SIZET2NUM(fragmentation->free_bytes));
+	rb_hash_aset(hash, sym_fragmentation_ratio,
+	             DBL2NUM(fragmentation->system_bytes ? (double)fragmentation->free_bytes / fragmentation->system_bytes : 0.0));
+	rb_hash_aset(hash, sym_largest_free_chunk, SIZET2NUM(fragmentation->largest_free_chunk));
+	rb_hash_aset(hash, sym_largest_free_ratio,
+	             DBL2NUM(fragmentation->free_bytes ? (double)fragmentation->largest_free_chunk / fragmentation->free_bytes : 0.0));
+	rb_hash_aset(hash, sym_trimmable_bytes, SIZET2NUM(fragmentation->trimmable_bytes));
+	return hash;
+}
+
+static void add_recommendation(VALUE recommendations, char const* name, VALUE value, char const* reason) {
+	VALUE hash = rb_hash_new();
+	rb_hash_aset(hash, sym_name, rb_str_new_cstr(name));
+	rb_hash_aset(hash, sym_value, value);
+	rb_hash_aset(hash, sym_reason, rb_str_new_cstr(reason));
+	rb_ary_push(recommendations, hash);
+}
+
+VALUE fragmentation_report(void) {
+	malloc_info_t info;
+	memtuner_mallinfo_t mi;
+	arena_fragmentation_t total;
+	VALUE arenas, recommendations, hash;
+	size_t i, secondary_system = 0;
+
+	if (!read_malloc_info(&info))
+		return Qnil;
+	if (!get_mallinfo(&mi))
+		mi.keepcost = 0;
+	memset(&total, 0, sizeof(total));
+	arenas = rb_ary_new_capa((long)info.arena_count);
+	for (i = 0; i < info.arena_count; ++i) {
+		arena_fragmentation_t const fragmentation = arena_fragmentation(&info, &info.arenas[i], mi.keepcost);
+		rb_ary_push(arenas, fragmentation_to_hash(info.arenas[i].nr, &fragmentation));
+		total.system_bytes += fragmentation.system_bytes;
+		total.free_bytes += fragmentation.free_bytes;
+		total.trimmable_bytes += fragmentation.trimmable_bytes;
+		if (fragmentation.largest_free_chunk > total.largest_free_chunk)
+			total.largest_free_chunk = fragmentation.largest_free_chunk;
+		if (info.arenas[i].nr != 0)
+			secondary_system += fragmentation.system_bytes;
+	}
+
+	recommendations = rb_ary_new();
+	if (info.arena_count > 2 && total.system_bytes > 0 &&
+		((double)total.free_bytes / total.system_bytes > FRAGMENTATION_HIGH || secondary_system > total.system_bytes / 2)) {
+		int const scattered = total.free_bytes > 0 && (double)total.largest_free_chunk / total.free_bytes < LARGEST_FREE_LOW;
+		add_recommendation(recommendations, "MALLOC_ARENA_MAX", INT2FIX(2),
+		                   scattered ? "free memory is scattered in small chunks across many arenas"
+		                             : "secondary arenas hold much of the heap and free memory is spread across them");
+	}
+	if (total.trimmable_bytes > TRIMMABLE_BYTES_HIGH ||
+		(total.system_bytes > 0 && (double)total.trimmable_bytes / total.system_bytes > TRIMMABLE_RATIO_HIGH)) {
+		add_recommendation(recommendations, "MALLOC_TRIM_THRESHOLD_", SIZET2NUM(TRIMMABLE_BYTES_HIGH / 4),
+		                   "whole free pages stay resident; a lower trim threshold or periodic malloc_trim returns them");
+	}
+
+	hash = rb_hash_new();
+	rb_hash_aset(hash, sym_arenas, arenas);
+	rb_hash_aset(hash, sym_total, fragmentation_to_hash(-1, &total));
+	rb_hash_aset(hash, sym_recommendations, recommendations);
+	free_malloc_info(&info);
+	return hash;
+}
+
+void init_malloc_arenas(void) {
+#define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
+	DEF_SYM(arenas);
+	DEF_SYM(total);
+	DEF_SYM(nr);
+	DEF_SYM(fast);
+	DEF_SYM(rest);
+	DEF_SYM(mmap);
+	DEF_SYM(count);
+	DEF_SYM(size);
+	DEF_SYM(system_current);
+	DEF_SYM(system_max);
+	DEF_SYM(aspace_total);
+	DEF_SYM(aspace_mprotect);
+	DEF_SYM(subheaps);
+	DEF_SYM(sizes);
+	DEF_SYM(from);
+	DEF_SYM(to);
+	DEF_SYM(unsorted);
+	DEF_SYM(system_bytes);
+	DEF_SYM(free_bytes);
+	DEF_SYM(fragmentation_ratio);
+	DEF_SYM(largest_free_chunk);
+	DEF_SYM(largest_free_ratio);
+	DEF_SYM(trimmable_bytes);
+	DEF_SYM(recommendations);
+	DEF_SYM(name);
+	DEF_SYM(value);
+	DEF_SYM(reason);
+#undef DEF_SYM
+}
@@ -0,0 +1,12 @@
+#ifndef __MALLOC_ARENAS_H
+#define __MALLOC_ARENAS_H
+#include <ruby/ruby.h>
+
+/* Structured malloc_info per glibc arena. All functions need the GVL. */
+extern void init_malloc_arenas(void);
+/* { arenas: [...], total: {...} }, or nil without malloc_info */
+extern VALUE malloc_arenas_to_hash(void);
+/* per-arena fragmentation, trimmable bytes and tuning recommendations */
+extern VALUE fragmentation_report(void);
+
+#endif
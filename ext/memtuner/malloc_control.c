@@ -0,0 +1,274 @@
+#include "malloc_control.h"
+#include "mallinfo.h"
+#include "getrss.h"
+#include "background_thread.h"
+#include "gc_hook.h"
+#include <string.h>
+#include <time.h>
+#include <ruby/thread.h>
+#if HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+
+/* a trim that releases less than this backs the interval off */
+#define TRIM_RELEASED_LOW ((size_t)1 << 20)
+/* smaller heaps aren't worth trimming whatever their fragmentation */
+#define TRIM_FREE_BYTES_MIN ((size_t)4 << 20)
+
+static VALUE sym_arena_max;
+static VALUE sym_trim_threshold;
+static VALUE sym_mmap_threshold;
+static VALUE sym_top_pad;
+static VALUE sym_running;
+static VALUE sym_trim_count;
+static VALUE sym_skip_count;
+static VALUE sym_released_bytes;
+static VALUE sym_last_released_bytes;
+static VALUE sym_last_duration;
+static VALUE sym_last_fragmentation;
+static VALUE sym_interval;
+
+typedef struct {
+	double fragmentation;
+	uint64_t min_interval_ns;
+	uint64_t max_interval_ns;
+	size_t pad;
+} trim_scheduler_config_t;
+
+typedef struct {
+	size_t trim_count;
+	size_t skip_count; /* major GCs that found too little free */
+	size_t released_bytes;
+	size_t last_released_bytes;
+	uint64_t last_duration_ns;
+	double last_fragmentation;
+	uint64_t interval_ns;
+} trim_scheduler_stats_t;
+
+/* all guarded by s_scheduler.mutex */
+static background_thread_t s_scheduler = BACKGROUND_THREAD_INITIALIZER;
+static int s_major_gc_pending = 0;
+static trim_scheduler_config_t s_config;
+static trim_scheduler_stats_t s_stats;
+
+/* the GC hook only runs on threads holding the GVL */
+static size_t s_last_major_gc_count = 0;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t seconds_to_ns(double seconds) {
+	return (uint64_t)(seconds * 1e9);
+}
+
+VALUE malloc_control_mallopt(VALUE param, VALUE value) {
+#if HAVE_MALLOPT
+	int option;
+	if (param == sym_arena_max)
+		option = M_ARENA_MAX;
+	else if (param == sym_trim_threshold)
+		option = M_TRIM_THRESHOLD;
+	else if (param == sym_mmap_threshold)
+		option = M_MMAP_THRESHOLD;
+	else if (param == sym_top_pad)
+		option = M_TOP_PAD;
+	else
+		rb_raise(rb_eArgError, "unknown mallopt parameter: %"PRIsVALUE, rb_inspect(param));
+	return mallopt(option, NUM2INT(value)) ? Qtrue : Qfalse;
+#else
+	return Qnil;
+#endif
+}
+
+#if HAVE_MALLOC_TRIM
+typedef struct {
+	size_t pad;
+	size_t released_bytes;
+	uint64_t duration_ns;
+} trim_call_t;
+
+/* RSS is the measure; malloc_trim's own result only says whether it released anything */
+static void* trim_without_gvl(void* arg) {
+	trim_call_t* const call = arg;
+	size_t const before = getCurrentRSS();
+	uint64_t const start = now_ns();
+	size_t after;
+	malloc_trim(call->pad);
+	call->duration_ns = now_ns() - start;
+	after = getCurrentRSS();
+	call->released_bytes = before > after ? before - after : 0;
+	return NULL;
+}
+#endif
+
+VALUE malloc_control_trim(size_t pad) {
+#if HAVE_MALLOC_TRIM
+	trim_call_t call;
+	call.pad = pad;
+	rb_thread_call_without_gvl(trim_without_gvl, &call, RUBY_UBF_IO, NULL);
+	return SIZET2NUM(call.released_bytes);
+#else
+	return Qnil;
+#endif
+}
+
+#if HAVE_MALLOC_TRIM
+/*
+ * Trims at most once per interval. The interval doubles up to the maximum
+ * while trims release little, and drops back to the minimum once one
+ * releases a worthwhile amount.
+ */
+static void* trim_scheduler(void* arg) {
+	uint64_t next_allowed = 0;
+
+	pthread_mutex_lock(&s_scheduler.mutex);
+	for (;;) {
+		trim_scheduler_config_t config;
+		memtuner_mallinfo_t mi;
+		trim_call_t call;
+		double fragmentation;
+		uint64_t now;
+
+		while (!s_scheduler.stopping && !s_major_gc_pending)
+			pthread_cond_wait(&s_scheduler.cond, &s_scheduler.mutex);
+		if (s_scheduler.stopping)
+			break;
+		now = now_ns();
+		if (now < next_allowed) {
+			/* wait out the interval; major GCs in the meantime fold into one trim */
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			timespec_add_ns(&deadline, next_allowed - now);
+			if (!background_thread_sleep_until(&s_scheduler, &deadline))
+				break;
+		}
+		s_major_gc_pending = 0;
+		config = s_config;
+		pthread_mutex_unlock(&s_scheduler.mutex);
+
+		if (!get_mallinfo(&mi))
+			memset(&mi, 0, sizeof(mi));
+		fragmentation = mi.arena ? (double)mi.fordblks / mi.arena : 0.0;
+		if (fragmentation < config.fragmentation || mi.fordblks < TRIM_FREE_BYTES_MIN) {
+			pthread_mutex_lock(&s_scheduler.mutex);
+			s_stats.skip_count += 1;
+			s_stats.last_fragmentation = fragmentation;
+			continue;
+		}
+		call.pad = config.pad;
+		trim_without_gvl(&call);
+
+		pthread_mutex_lock(&s_scheduler.mutex);
+		s_stats.trim_count += 1;
+		s_stats.released_bytes += call.released_bytes;
+		s_stats.last_released_bytes = call.released_bytes;
+		s_stats.last_duration_ns = call.duration_ns;
+		s_stats.last_fragmentation = fragmentation;
+		if (call.released_bytes < TRIM_RELEASED_LOW)
+			s_stats.interval_ns = s_stats.interval_ns * 2 < config.max_interval_ns ? s_stats.interval_ns * 2 : config.max_interval_ns;
+		else
+			s_stats.interval_ns = config.min_interval_ns;
+		next_allowed = now_ns() + s_stats.interval_ns;
+	}
+	pthread_mutex_unlock(&s_scheduler.mutex);
+	return NULL;
+}
+
+/* major_gc_count is bumped when a major GC starts, so any GC ending after it sees the change */
+static void notify_major_gc(void) {
+	size_t const major_gc_count = gc_hook_stat(GC_HOOK_MAJOR_GC_COUNT);
+	if (major_gc_count == s_last_major_gc_count)
+		return;
+	s_last_major_gc_count = major_gc_count;
+	pthread_mutex_lock(&s_scheduler.mutex);
+	if (s_scheduler.running) {
+		s_major_gc_pending = 1;
+		pthread_cond_signal(&s_scheduler.cond);
+	}
+	pthread_mutex_unlock(&s_scheduler.mutex);
+}
+#endif
+
+VALUE start_trim_scheduler(double fragmentation, double min_interval, double max_interval, size_t pad) {
+#if HAVE_MALLOC_TRIM
+	int error;
+
+	if (min_interval <= 0 || max_interval < min_interval)
+		rb_raise(rb_eArgError, "intervals must be positive with min_interval <= max_interval");
+	if (s_scheduler.running)
+		return Qfalse;
+	pthread_mutex_lock(&s_scheduler.mutex);
+	s_config.fragmentation = fragmentation;
+	s_config.min_interval_ns = seconds_to_ns(min_interval);
+	s_config.max_interval_ns = seconds_to_ns(max_interval);
+	s_config.pad = pad;
+	memset(&s_stats, 0, sizeof(s_stats));
+	s_stats.interval_ns = s_config.min_interval_ns;
+	s_major_gc_pending = 0;
+	pthread_mutex_unlock(&s_scheduler.mutex);
+	error = background_thread_start(&s_scheduler, trim_scheduler);
+	if (error != 0)
+		rb_syserr_fail(error, "start_trim_scheduler");
+
+	add_gc_end_listener(notify_major_gc);
+	s_last_major_gc_count = gc_hook_stat(GC_HOOK_MAJOR_GC_COUNT);
+	return Qtrue;
+#else
+	return Qnil;
+#endif
+}
+
+VALUE stop_trim_scheduler(void) {
+#if HAVE_MALLOC_TRIM
+	if (!s_scheduler.running)
+		return Qfalse;
+	remove_gc_end_listener(notify_major_gc);
+	/* a trim in progress finishes first */
+	background_thread_stop(&s_scheduler);
+	return Qtrue;
+#else
+	return Qnil;
+#endif
+}
+
+VALUE trim_scheduler_stats(void) {
+	trim_scheduler_stats_t stats;
+	int running;
+	VALUE hash;
+
+	pthread_mutex_lock(&s_scheduler.mutex);
+	stats = s_stats;
+	running = s_scheduler.running;
+	pthread_mutex_unlock(&s_scheduler.mutex);
+
+	hash = rb_hash_new();
+	rb_hash_aset(hash, sym_running, running ? Qtrue : Qfalse);
+	rb_hash_aset(hash, sym_trim_count, SIZET2NUM(stats.trim_count));
+	rb_hash_aset(hash, sym_skip_count, SIZET2NUM(stats.skip_count));
+	rb_hash_aset(hash, sym_released_bytes, SIZET2NUM(stats.released_bytes));
+	rb_hash_aset(hash, sym_last_released_bytes, SIZET2NUM(stats.last_released_bytes));
+	rb_hash_aset(hash, sym_last_duration, DBL2NUM(stats.last_duration_ns / 1e9));
+	rb_hash_aset(hash, sym_last_fragmentation, DBL2NUM(stats.last_fragmentation));
+	rb_hash_aset(hash, sym_interval, DBL2NUM(stats.interval_ns / 1e9));
+	return hash;
+}
+
+void init_malloc_control(void) {
+#define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
+	DEF_SYM(arena_max);
+	DEF_SYM(trim_threshold);
+	DEF_SYM(mmap_threshold);
+	DEF_SYM(top_pad);
+	DEF_SYM(running);
+	DEF_SYM(trim_count);
+	DEF_SYM(skip_count);
+	DEF_SYM(released_bytes);
+	DEF_SYM(last_released_bytes);
+	DEF_SYM(last_duration);
+	DEF_SYM(last_fragmentation);
+	DEF_SYM(interval);
+#undef DEF_SYM
+}
@@ -0,0 +1,22 @@
+#ifndef __MALLOC_CONTROL_H
+#define __MALLOC_CONTROL_H
+#include <ruby/ruby.h>
+
+/*
+ * mallopt and malloc_trim at runtime, and a scheduler thread that trims
+ * after major GCs once enough of the heap is free. All functions need
+ * the GVL.
+ */
+extern void init_malloc_control(void);
+
+/* param is :arena_max, :trim_threshold, :mmap_threshold or :top_pad; nil without mallopt */
+extern VALUE malloc_control_mallopt(VALUE param, VALUE value);
+/* bytes of RSS released, or nil without malloc_trim */
+extern VALUE malloc_control_trim(size_t pad);
+
+/* Returns Qfalse when it's already running, nil without malloc_trim. */
+extern VALUE start_trim_scheduler(double fragmentation, double min_interval, double max_interval, size_t pad);
+extern VALUE stop_trim_scheduler(void);
+extern VALUE trim_scheduler_stats(void);
+
+#endif
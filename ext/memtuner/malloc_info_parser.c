@@ -0,0 +1,236 @@
+#include "malloc_info_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_MALLOC_INFO
+#include <malloc.h>
+#endif
+
+typedef struct {
+	char const* p;
+	char const* end;
+} cursor_t;
+
+typedef struct {
+	char const* name;
+	size_t name_len;
+	char const* value;
+	size_t value_len;
+} attribute_t;
+
+#define ATTRIBUTE_MAX 8
+
+typedef struct {
+	char const* name;
+	size_t name_len;
+	int closing;
+	attribute_t attributes[ATTRIBUTE_MAX];
+	size_t attribute_count;
+} element_t;
+
+static int is_name_char(char c) {
+	return c != ' ' && c != '\t' && c != '\n' && c != '\r' && c != '/' && c != '>' && c != '=';
+}
+
+static void skip_space(cursor_t* c) {
+	while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r'))
+		++c->p;
+}
+
+/* Reads the next tag; returns 0 at the end of the input. */
+static int next_element(cursor_t* c, element_t* element) {
+	char const* const open = memchr(c->p, '<', (size_t)(c->end - c->p));
+	if (open == NULL)
+		return 0;
+	c->p = open + 1;
+	element->closing = c->p < c->end && *c->p == '/';
+	if (element->closing)
+		++c->p;
+	element->name = c->p;
+	while (c->p < c->end && is_name_char(*c->p))
+		++c->p;
+	element->name_len = (size_t)(c->p - element->name);
+	element->attribute_count = 0;
+	for (;;) {
+		attribute_t* attribute;
+		char quote;
+		skip_space(c);
+		if (c->p >= c->end)
+			return 1;
+		if (*c->p == '>' || *c->p == '/' || *c->p == '?') {
+			char const* const close = memchr(c->p, '>', (size_t)(c->end - c->p));
+			c->p = close ? close + 1 : c->end;
+			return 1;
+		}
+		attribute = element->attribute_count < ATTRIBUTE_MAX ? &element->attributes[element->attribute_count++] : &element->attributes[ATTRIBUTE_MAX - 1];
+		attribute->name = c->p;
+		while (c->p < c->end && is_name_char(*c->p))
+			++c->p;
+		attribute->name_len = (size_t)(c->p - attribute->name);
+		skip_space(c);
+		if (c->p >= c->end || *c->p != '=') {
+			/* a bare word; nothing malloc_info emits */
+			attribute->value = c->p;
+			attribute->value_len = 0;
+			continue;
+		}
+		++c->p;
+		skip_space(c);
+		if (c->p >= c->end)
+			return 1;
+		quote = *c->p;
+		if (quote != '"' && quote != '\'') {
+			attribute->value = c->p;
+			while (c->p < c->end && is_name_char(*c->p))
+				++c->p;
+		} else {
+			char const* const close = memchr(c->p + 1, quote, (size_t)(c->end - c->p - 1));
+			attribute->value = c->p + 1;
+			c->p = close ? close + 1 : c->end;
+			attribute->value_len = (size_t)((close ? close : c->end) - attribute->value);
+			continue;
+		}
+		attribute->value_len = (size_t)(c->p - attribute->value);
+	}
+}
+
+static int equals(char const* s, size_t len, char const* literal) {
+	return len == strlen(literal) && memcmp(s, literal, len) == 0;
+}
+
+static attribute_t const* find_attribute(element_t const* element, char const* name) {
+	size_t i;
+	for (i = 0; i < element->attribute_count; ++i)
+		if (equals(element->attributes[i].name, element->attributes[i].name_len, name))
+			return &element->attributes[i];
+	return NULL;
+}
+
+static size_t size_attribute(element_t const* element, char const* name) {
+	attribute_t const* const attribute = find_attribute(element, name);
+	size_t value = 0, i;
+	if (attribute == NULL)
+		return 0;
+	for (i = 0; i < attribute->value_len && attribute->value[i] >= '0' && attribute->value[i] <= '9'; ++i)
+		value = value * 10 + (size_t)(attribute->value[i] - '0');
+	return value;
+}
+
+static int type_is(element_t const* element, char const* type) {
+	attribute_t const* const attribute = find_attribute(element, "type");
+	return attribute != NULL && equals(attribute->value, attribute->value_len, type);
+}
+
+static int grow(void** p, size_t* capacity, size_t count, size_t elem_size) {
+	if (count < *capacity)
+		return 1;
+	{
+		size_t const new_capacity = *capacity ? *capacity * 2 : 16;
+		void* const q = realloc(*p, elem_size * new_capacity);
+		if (q == NULL)
+			return 0;
+		*p = q;
+		*capacity = new_capacity;
+	}
+	return 1;
+}
+
+int parse_malloc_info(char const* xml, size_t len, malloc_info_t* info) {
+	cursor_t c;
+	element_t element;
+	malloc_arena_t* current = NULL; /* the open <heap>, or NULL for top-level totals */
+	size_t arena_capacity = 0, size_capacity = 0;
+
+	memset(info, 0, sizeof(*info));
+	info->total.nr = -1;
+	c.p = xml;
+	c.end = xml + len;
+	while (next_element(&c, &element)) {
+		malloc_arena_t* const target = current ? current : &info->total;
+		if (equals(element.name, element.name_len, "heap")) {
+			if (element.closing) {
+				current = NULL;
+				continue;
+			}
+			if (!grow((void**)&info->arenas, &arena_capacity, info->arena_count, sizeof(malloc_arena_t))) {
+				free_malloc_info(info);
+				return 0;
+			}
+			current = &info->arenas[info->arena_count++];
+			memset(current, 0, sizeof(*current));
+			current->nr = (int)size_attribute(&element, "nr");
+			current->sizes_offset = info->size_count;
+		} else if (element.closing) {
+			continue;
+		} else if (equals(element.name, element.name_len, "size") || equals(element.name, element.name_len, "unsorted")) {
+			malloc_size_class_t* size_class;
+			if (current == NULL)
+				continue;
+			if (!grow((void**)&info->sizes, &size_capacity, info->size_count, sizeof(malloc_size_class_t))) {
+				free_malloc_info(info);
+				return 0;
+			}
+			size_class = &info->sizes[info->size_count++];
+			size_class->from = size_attribute(&element, "from");
+			size_class->to = size_attribute(&element, "to");
+			size_class->total = size_attribute(&element, "total");
+			size_class->count = size_attribute(&element, "count");
+			size_class->unsorted = element.name_len == strlen("unsorted");
+			++current->sizes_count;
+		} else if (equals(element.name, element.name_len, "total")) {
+			size_t const count = size_attribute(&element, "count");
+			size_t const size = size_attribute(&element, "size");
+			if (type_is(&element, "fast")) {
+				target->fast_count = count;
+				target->fast_size = size;
+			} else if (type_is(&element, "rest")) {
+				target->rest_count = count;
+				target->rest_size = size;
+			} else if (type_is(&element, "mmap")) {
+				target->mmap_count = count;
+				target->mmap_size = size;
+			}
+		} else if (equals(element.name, element.name_len, "system")) {
+			if (type_is(&element, "current"))
+				target->system_current = size_attribute(&element, "size");
+			else if (type_is(&element, "max"))
+				target->system_max = size_attribute(&element, "size");
+		} else if (equals(element.name, element.name_len, "aspace")) {
+			if (type_is(&element, "total"))
+				target->aspace_total = size_attribute(&element, "size");
+			else if (type_is(&element, "mprotect"))
+				target->aspace_mprotect = size_attribute(&element, "size");
+			else if (type_is(&element, "subheaps"))
+				target->aspace_subheaps = size_attribute(&element, "size");
+		}
+	}
+	return 1;
+}
+
+int read_malloc_info(malloc_info_t* info) {
+#if HAVE_MALLOC_INFO
+	char* buf = NULL;
+	size_t size = 0;
+	int ok;
+	FILE* fp = open_memstream(&buf, &size);
+	if (fp == NULL)
+		return 0;
+	malloc_info(0, fp);
+	fclose(fp);
+	ok = buf != NULL && parse_malloc_info(buf, size, info);
+	free(buf);
+	return ok;
+#else
+	memset(info, 0, sizeof(*info));
+	return 0;
+#endif
+}
+
+void free_malloc_info(malloc_info_t* info) {
+	free(info->arenas);
+	free(info->sizes);
+	info->arenas = NULL;
+	info->sizes = NULL;
+	info->arena_count = 0;
+	info->size_count = 0;
+}
@@ -0,0 +1,48 @@
+#ifndef __MALLOC_INFO_PARSER_H
+#define __MALLOC_INFO_PARSER_H
+#include <stddef.h>
+
+/* one <size> or <unsorted> entry: free chunks in [from, to] */
+typedef struct {
+	size_t from;
+	size_t to;
+	size_t total;
+	size_t count;
+	int unsorted;
+} malloc_size_class_t;
+
+typedef struct {
+	int nr; /* -1 for the whole-process totals */
+	size_t fast_count;
+	size_t fast_size;
+	size_t rest_count;
+	size_t rest_size;
+	size_t mmap_count; /* only reported for the whole process */
+	size_t mmap_size;
+	size_t system_current;
+	size_t system_max;
+	size_t aspace_total;
+	size_t aspace_mprotect;
+	size_t aspace_subheaps; /* secondary arenas only */
+	size_t sizes_offset; /* into malloc_info_t.sizes */
+	size_t sizes_count;
+} malloc_arena_t;
+
+typedef struct {
+	malloc_arena_t* arenas;
+	size_t arena_count;
+	malloc_size_class_t* sizes;
+	size_t size_count;
+	malloc_arena_t total;
+} malloc_info_t;
+
+/*
+ * Streams over malloc_info's XML in place: no copy, no DOM. Unknown
+ * elements and attributes are skipped. Returns 0 on allocation failure.
+ */
+extern int parse_malloc_info(char const* xml, size_t len, malloc_info_t* info);
+/* malloc_info() into an open_memstream buffer, parsed without a Ruby string */
+extern int read_malloc_info(malloc_info_t* info);
+extern void free_malloc_info(malloc_info_t* info);
+
+#endif
@@ -2,6 +2,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h> /* exp, log */
+#include <time.h>
+#include <unistd.h> /* getpagesize */
 #if HAVE_MALLOC_INFO
 #include <malloc.h>
 #endif
@@ -9,6 +12,7 @@
 #include "function_hook.h"
 #include "debug.h"
 #include "call_info.h"
+#include "live_heap.h"
 
 typedef void *(*malloc_func_t)(size_t);
 typedef void (*free_func_t)(void *);
@@ -16,6 +20,9 @@ typedef void *(*realloc_func_t)(void *, size_t);
 typedef void *(*calloc_func_t)(size_t, size_t);
 typedef void *(*memalign_func_t)(size_t, size_t);
 typedef int (*posix_memalign_t)(void **memptr, size_t alignment, size_t size);
+typedef void *(*aligned_alloc_func_t)(size_t, size_t);
+typedef void *(*valloc_func_t)(size_t);
+typedef size_t (*malloc_usable_size_func_t)(void *);
 
 static malloc_func_t original_malloc;
 static free_func_t original_free;
@@ -27,11 +34,94 @@ static memalign_func_t original_memalign;
 #if HAVE_POSIX_MEMALIGN
 static posix_memalign_t original_posix_memalign;
 #endif
+#if HAVE_ALIGNED_ALLOC
+static aligned_alloc_func_t original_aligned_alloc;
+#endif
+#if HAVE_VALLOC
+static valloc_func_t original_valloc;
+#endif
+#if HAVE_PVALLOC
+static valloc_func_t original_pvalloc;
+#endif
+#if HAVE_MALLOC_USABLE_SIZE
+static malloc_usable_size_func_t original_malloc_usable_size;
+#endif
+/*
+ * Sampling mode: on average one call is recorded every s_sampling_interval
+ * allocated bytes (intervals are exponentially distributed, as in tcmalloc's
+ * heap profiler). Unsampled calls only decrement a per-thread countdown.
+ * 0 records every call.
+ */
+static size_t s_sampling_interval = 0;
+static __thread int64_t s_bytes_until_sample __attribute__((tls_model("initial-exec"))) = 0;
+static __thread uint64_t s_sampling_rng __attribute__((tls_model("initial-exec"))) = 0;
+/* set on threads escalated to recording every allocation */
+static __thread int s_record_all_calls __attribute__((tls_model("initial-exec"))) = 0;
+
+/* nonzero while inside an original allocator call, to tell malloc's own mmaps apart */
+static __thread int s_allocator_depth __attribute__((tls_model("initial-exec"))) = 0;
+
+int malloc_tracer_in_allocator(void) {
+    return s_allocator_depth;
+}
+
+void set_malloc_sampling_interval(size_t bytes) {
+    s_sampling_interval = bytes;
+}
+
+void set_thread_record_all_calls(int enabled) {
+    s_record_all_calls = enabled;
+}
+
+static double next_sampling_random(void) {
+    uint64_t x = s_sampling_rng;
+    if (x == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        x = ((uint64_t)(uintptr_t)&s_sampling_rng * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)ts.tv_nsec ^ 1;
+    }
+    /* xorshift64 */
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    s_sampling_rng = x;
+    /* uniform in (0, 1] */
+    return ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/* Returns 1 when the call should be recorded and stores the size to report. */
+static int sample_allocation(size_t size, size_t* reported_size) {
+    size_t const interval = s_sampling_interval;
+    if (interval == 0 || s_record_all_calls) {
+        *reported_size = size;
+        return 1;
+    }
+    s_bytes_until_sample -= (int64_t)size;
+    if (s_bytes_until_sample > 0)
+        return 0;
+    /* the countdown starts at 0; a thread's first call draws it instead of being sampled */
+    if (s_sampling_rng == 0) {
+        s_bytes_until_sample += (int64_t)(-log(next_sampling_random()) * interval) + 1;
+        if (s_bytes_until_sample > 0)
+            return 0;
+    }
+    s_bytes_until_sample = (int64_t)(-log(next_sampling_random()) * interval) + 1;
+    /* each sampled byte stands for 1 / P(sampled) bytes */
+    *reported_size = size == 0 ? 0 : (size_t)(size / (1.0 - exp(-(double)size / interval)));
+    return 1;
+}
+
 static void *malloc_hook(size_t size) {
-    void* p = original_malloc(size);
+    void* p;
     call_info_t info;
+    ++s_allocator_depth;
+    p = original_malloc(size);
+    --s_allocator_depth;
+    if (!sample_allocation(size, &info.malloc.size))
+        return p;
+    if (p != NULL)
+        count_thread_allocation(info.malloc.size);
     info.type = CALL_FUNC_MALLOC;
-    info.malloc.size = size;
     info.malloc.allocated = p;
     add_call_info(&info);
 
@@ -40,21 +130,57 @@ static void *malloc_hook(size_t size) {
     return p;
 }
 
-static void free_hook(void *p) {
+static void record_free(void *p) {
     call_info_t info;
     info.type = CALL_FUNC_FREE;
     info.free.ptr = p;
     add_call_info(&info);
+}
+
+static void free_hook(void *p) {
+    live_allocation_t live;
+    /* only recorded allocations are charged, so only their frees are */
+    int const was_live = live_heap_detach(p, &live);
+    if (was_live)
+        count_thread_free(live.size);
+    /* frees carry no size: when sampling, only those of recorded allocations are recorded */
+    if (was_live || s_sampling_interval == 0)
+        record_free(p);
 
     // memtuner_debug_print("call free\n");
+    ++s_allocator_depth;
     original_free(p);
+    --s_allocator_depth;
 }
 
 static void *realloc_hook(void *p, size_t size) {
-    void* new_p = original_realloc(p, size);
+    void* new_p;
     call_info_t info;
+    live_allocation_t live;
+    /* once realloc frees p, another thread may get it and insert its own entry */
+    int const was_live = live_heap_detach(p, &live);
+    ++s_allocator_depth;
+    new_p = original_realloc(p, size);
+    --s_allocator_depth;
+    /* realloc(p, 0) may free p and return NULL; otherwise NULL leaves p allocated */
+    if (was_live && new_p == NULL && size != 0)
+        live_heap_attach(p, &live);
+    if (!sample_allocation(size, &info.realloc.size)) {
+        if (was_live && new_p != NULL)
+            live_heap_attach(new_p, &live);
+        else if (was_live && size == 0)
+            count_thread_free(live.size);
+        /* a recorded allocation freed or moved by an unrecorded call leaves the trace */
+        if (was_live && (size == 0 || (new_p != NULL && new_p != p)))
+            record_free(p);
+        return new_p;
+    }
+    /* recorded as a new allocation; the old one is gone unless realloc failed */
+    if (was_live && (new_p != NULL || size == 0))
+        count_thread_free(live.size);
+    if (new_p != NULL)
+        count_thread_allocation(info.realloc.size);
     info.type = CALL_FUNC_REALLOC;
-    info.realloc.size = size;
     info.realloc.ptr = p;
     info.realloc.allocated = new_p;
     add_call_info(&info);
@@ -63,11 +189,24 @@ static void *realloc_hook(void *p, size_t size) {
     return new_p;
 }
 static void *calloc_hook(size_t n, size_t size) {
-    void* p = original_calloc(n, size);
+    void* p;
+    size_t bytes;
     call_info_t info;
+    ++s_allocator_depth;
+    p = original_calloc(n, size);
+    --s_allocator_depth;
+    /* an overflowing n * size fails without allocating, so it is never sampled */
+    if (s_sampling_interval == 0) {
+        info.calloc.size = size;
+        info.calloc.count = n;
+    } else if (!__builtin_mul_overflow(n, size, &bytes) && sample_allocation(bytes, &info.calloc.size)) {
+        info.calloc.count = 1;
+    } else {
+        return p;
+    }
+    if (p != NULL)
+        count_thread_allocation(info.calloc.size * info.calloc.count);
     info.type = CALL_FUNC_CALLOC;
-    info.calloc.size = size;
-    info.calloc.count = n;
     info.calloc.allocated = p;
     add_call_info(&info);
 
@@ -76,10 +215,16 @@ static void *calloc_hook(size_t n, size_t size) {
 }
 #if HAVE_MEMALIGN
 static void *memalign_hook(size_t align, size_t size) {
-    void* p = original_memalign(align, size);
+    void* p;
     call_info_t info;
+    ++s_allocator_depth;
+    p = original_memalign(align, size);
+    --s_allocator_depth;
+    if (!sample_allocation(size, &info.memalign.size))
+        return p;
+    if (p != NULL)
+        count_thread_allocation(info.memalign.size);
     info.type = CALL_FUNC_MEMALIGN;
-    info.memalign.size = size;
     info.memalign.align = align;
     info.memalign.allocated = p;
     add_call_info(&info);
@@ -91,10 +236,16 @@ static void *memalign_hook(size_t align, size_t size) {
 #if HAVE_POSIX_MEMALIGN
 static int posix_memalign_hook(void **pp, size_t align, size_t size)
 {
-    int ret = original_posix_memalign(pp, align, size);
+    int ret;
     call_info_t info;
+    ++s_allocator_depth;
+    ret = original_posix_memalign(pp, align, size);
+    --s_allocator_depth;
+    if (!sample_allocation(size, &info.posix_memalign.size))
+        return ret;
+    if (ret == 0)
+        count_thread_allocation(info.posix_memalign.size);
     info.type = CALL_FUNC_POSIX_MEMALIGN;
-    info.posix_memalign.size = size;
     info.posix_memalign.align = align;
     info.posix_memalign.allocated = *pp;
     info.posix_memalign.return_value = ret;
@@ -105,6 +256,76 @@ static int posix_memalign_hook(void **pp, size_t align, size_t size)
 }
 #endif
 
+#if HAVE_ALIGNED_ALLOC
+static void *aligned_alloc_hook(size_t align, size_t size) {
+    void* p;
+    call_info_t info;
+    ++s_allocator_depth;
+    p = original_aligned_alloc(align, size);
+    --s_allocator_depth;
+    if (!sample_allocation(size, &info.aligned_alloc.size))
+        return p;
+    if (p != NULL)
+        count_thread_allocation(info.aligned_alloc.size);
+    info.type = CALL_FUNC_ALIGNED_ALLOC;
+    info.aligned_alloc.align = align;
+    info.aligned_alloc.allocated = p;
+    add_call_info(&info);
+    return p;
+}
+#endif
+#if HAVE_VALLOC
+static void *valloc_hook(size_t size) {
+    void* p;
+    call_info_t info;
+    ++s_allocator_depth;
+    p = original_valloc(size);
+    --s_allocator_depth;
+    if (!sample_allocation(size, &info.valloc.size))
+        return p;
+    if (p != NULL)
+        count_thread_allocation(info.valloc.size);
+    info.type = CALL_FUNC_VALLOC;
+    info.valloc.allocated = p;
+    add_call_info(&info);
+    return p;
+}
+#endif
+#if HAVE_PVALLOC
+static void *pvalloc_hook(size_t size) {
+    void* p;
+    call_info_t info;
+    /* pvalloc rounds the request up to whole pages */
+    size_t const page_size = (size_t)getpagesize();
+    size_t const allocated_size = (size + page_size - 1) / page_size * page_size;
+    ++s_allocator_depth;
+    p = original_pvalloc(size);
+    --s_allocator_depth;
+    if (!sample_allocation(allocated_size, &info.valloc.size))
+        return p;
+    if (p != NULL)
+        count_thread_allocation(info.valloc.size);
+    info.type = CALL_FUNC_PVALLOC;
+    info.valloc.allocated = p;
+    add_call_info(&info);
+    return p;
+}
+#endif
+#if HAVE_MALLOC_USABLE_SIZE
+static size_t malloc_usable_size_hook(void *p) {
+    size_t const usable_size = original_malloc_usable_size(p);
+    /* a query, not an allocation: only traced when every call is recorded */
+    if (s_sampling_interval == 0) {
+        call_info_t info;
+        info.type = CALL_FUNC_MALLOC_USABLE_SIZE;
+        info.malloc_usable_size.ptr = p;
+        info.malloc_usable_size.usable_size = usable_size;
+        add_call_info(&info);
+    }
+    return usable_size;
+}
+#endif
+
 static void resolve_function_pointers(void) {
     void *p = malloc(1);
     p = realloc(p, 2);
@@ -119,6 +340,23 @@ static void resolve_function_pointers(void) {
     if(posix_memalign(&p, 4, 1) == 0)
       free(p);
 #endif
+#if HAVE_ALIGNED_ALLOC
+    p = aligned_alloc(16, 16);
+    free(p);
+#endif
+#if HAVE_VALLOC
+    p = valloc(1);
+    free(p);
+#endif
+#if HAVE_PVALLOC
+    p = pvalloc(1);
+    free(p);
+#endif
+#if HAVE_MALLOC_USABLE_SIZE
+    p = malloc(1);
+    malloc_usable_size(p);
+    free(p);
+#endif
 }
 
 static void hook_functions(void) {
@@ -149,9 +387,35 @@ static void hook_functions(void) {
     original_posix_memalign = hook_function(posix_memalign, posix_memalign_hook);
     DUMP_HOOK_RESULT(posix_memalign);
 #endif
+#if HAVE_ALIGNED_ALLOC
+    /* glibc exports aligned_alloc as an alias of memalign; patching it twice would hook the hook */
+#if HAVE_MEMALIGN
+    if ((void *)aligned_alloc == (void *)memalign) {
+        memtuner_debug_print("memtuner: aligned_alloc: traced as memalign.\n");
+    } else
+#endif
+    {
+        original_aligned_alloc = hook_function(aligned_alloc, aligned_alloc_hook);
+        DUMP_HOOK_RESULT(aligned_alloc);
+    }
+#endif
+#if HAVE_VALLOC
+    original_valloc = hook_function(valloc, valloc_hook);
+    DUMP_HOOK_RESULT(valloc);
+#endif
+#if HAVE_PVALLOC
+    original_pvalloc = hook_function(pvalloc, pvalloc_hook);
+    DUMP_HOOK_RESULT(pvalloc);
+#endif
+#if HAVE_MALLOC_USABLE_SIZE
+    original_malloc_usable_size = hook_function(malloc_usable_size, malloc_usable_size_hook);
+    DUMP_HOOK_RESULT(malloc_usable_size);
+#endif
 }
 
 void init_malloc_tracer(void){
     memtuner_debug_print("init_malloc_tracer\n");
+    init_call_info_collector();
+    init_live_heap();
     hook_functions();
 }
@@ -1 +1,8 @@
+#include <stddef.h>
+
 extern void init_malloc_tracer(void);
+extern void set_malloc_sampling_interval(size_t bytes);
+/* Records every allocation of the calling thread whatever the sampling interval. */
+extern void set_thread_record_all_calls(int enabled);
+/* nonzero while the calling thread is inside malloc, free or friends */
+extern int malloc_tracer_in_allocator(void);
@@ -0,0 +1,341 @@
+#include "mappings.h"
+#include "procfs.h"
+#include "mmap_tracer.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_RB_OBJSPACE_EACH_OBJECTS
+/* exported by libruby but only declared in its internal headers */
+void rb_objspace_each_objects(int (*callback)(void *, void *, size_t, void *), void *data);
+#endif
+
+/* glibc's HEAP_MAX_SIZE on 64-bit: secondary arenas are aligned to it */
+#define MALLOC_ARENA_ALIGNMENT ((uintptr_t)64 << 20)
+
+typedef enum {
+	MAPPING_CLASS_HEAP,
+	MAPPING_CLASS_MALLOC_ARENA,
+	MAPPING_CLASS_STACK,
+	MAPPING_CLASS_THREAD_STACK,
+	MAPPING_CLASS_RUBY_HEAP,
+	MAPPING_CLASS_LIBRARY_TEXT,
+	MAPPING_CLASS_LIBRARY_DATA,
+	MAPPING_CLASS_TRACER,
+	MAPPING_CLASS_FILE,
+	MAPPING_CLASS_ANONYMOUS,
+	MAPPING_CLASS_OTHER,
+	MAPPING_CLASS_COUNT
+} mapping_class_t;
+
+static char const* const s_class_names[MAPPING_CLASS_COUNT] = {
+	"heap", "malloc_arena", "stack", "thread_stack", "ruby_heap",
+	"library_text", "library_data", "tracer", "file", "anonymous", "other",
+};
+static VALUE s_class_syms[MAPPING_CLASS_COUNT];
+
+static VALUE sym_mappings;
+static VALUE sym_classes;
+static VALUE sym_start;
+static VALUE sym_end;
+static VALUE sym_perms;
+static VALUE sym_path;
+static VALUE sym_class;
+static VALUE sym_size;
+static VALUE sym_rss;
+static VALUE sym_pss;
+static VALUE sym_swap;
+static VALUE sym_ruby_heap_bytes;
+static VALUE sym_count;
+
+typedef struct {
+	uintptr_t start;
+	uintptr_t end;
+	char perms[5];
+	int anonymous;
+	char path[512]; /* truncated; the reader's chunk is overwritten by later reads */
+	size_t path_len;
+	size_t size, rss, pss, swap;
+} mapping_t;
+
+typedef struct {
+	size_t count, size, rss, pss;
+} class_total_t;
+
+/* Ruby heap page ranges, sorted, to split RSS of the mappings that hold them */
+typedef struct {
+	uintptr_t* ranges; /* start, end pairs */
+	size_t count;
+	size_t capacity;
+} ruby_pages_t;
+
+#if HAVE_RB_OBJSPACE_EACH_OBJECTS
+static int collect_ruby_page(void* start, void* end, size_t stride, void* data) {
+	ruby_pages_t* const pages = data;
+	if (pages->count == pages->capacity) {
+		size_t const capacity = pages->capacity ? pages->capacity * 2 : 1024;
+		uintptr_t* ranges = realloc(pages->ranges, sizeof(uintptr_t) * 2 * capacity);
+		if (ranges == NULL)
+			return 1;
+		pages->ranges = ranges;
+		pages->capacity = capacity;
+	}
+	pages->ranges[pages->count * 2] = (uintptr_t)start;
+	pages->ranges[pages->count * 2 + 1] = (uintptr_t)end;
+	++pages->count;
+	return 0;
+}
+
+static int compare_range(void const* a, void const* b) {
+	uintptr_t const lhs = *(uintptr_t const*)a;
+	uintptr_t const rhs = *(uintptr_t const*)b;
+	return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+#endif
+
+static void collect_ruby_pages(ruby_pages_t* pages) {
+	memset(pages, 0, sizeof(*pages));
+#if HAVE_RB_OBJSPACE_EACH_OBJECTS
+	rb_objspace_each_objects(collect_ruby_page, pages);
+	if (pages->count > 0)
+		qsort(pages->ranges, pages->count, sizeof(uintptr_t) * 2, compare_range);
+#endif
+}
+
+/* bytes of Ruby heap pages inside [start, end); *cursor walks the sorted pages once */
+static size_t ruby_page_bytes(ruby_pages_t const* pages, size_t* cursor, uintptr_t start, uintptr_t end) {
+	size_t bytes = 0;
+	size_t i = *cursor;
+	while (i < pages->count && pages->ranges[i * 2 + 1] <= start)
+		++i;
+	*cursor = i;
+	for (; i < pages->count && pages->ranges[i * 2] < end; ++i) {
+		uintptr_t const lo = pages->ranges[i * 2] > start ? pages->ranges[i * 2] : start;
+		uintptr_t const hi = pages->ranges[i * 2 + 1] < end ? pages->ranges[i * 2 + 1] : end;
+		bytes += hi - lo;
+	}
+	return bytes;
+}
+
+static uintptr_t parse_hex(char const** p, char const* end) {
+	uintptr_t value = 0;
+	for (; *p < end; ++*p) {
+		char const c = **p;
+		if (c >= '0' && c <= '9')
+			value = value * 16 + (uintptr_t)(c - '0');
+		else if (c >= 'a' && c <= 'f')
+			value = value * 16 + (uintptr_t)(c - 'a' + 10);
+		else
+			break;
+	}
+	return value;
+}
+
+static void skip_field(char const** p, char const* end) {
+	while (*p < end && **p != ' ')
+		++*p;
+	while (*p < end && **p == ' ')
+		++*p;
+}
+
+/* "start-end perms offset dev inode   path" */
+static int parse_header(char const* line, size_t len, mapping_t* mapping) {
+	char const* p = line;
+	char const* const end = line + len;
+	char const* inode;
+	memset(mapping, 0, sizeof(*mapping));
+	mapping->start = parse_hex(&p, end);
+	if (p == end || *p != '-')
+		return 0;
+	++p;
+	mapping->end = parse_hex(&p, end);
+	if (p == end || *p != ' ' || end - p < 5)
+		return 0;
+	memcpy(mapping->perms, p + 1, 4);
+	skip_field(&p, end); /* to perms */
+	skip_field(&p, end); /* to offset */
+	skip_field(&p, end); /* to dev */
+	skip_field(&p, end); /* to inode */
+	inode = p;
+	skip_field(&p, end); /* to path */
+	mapping->path_len = (size_t)(end - p) < sizeof(mapping->path) ? (size_t)(end - p) : sizeof(mapping->path);
+	memcpy(mapping->path, p, mapping->path_len);
+	mapping->anonymous = inode < end && *inode == '0' && (inode + 1 == end || inode[1] == ' ') && mapping->path_len == 0;
+	return 1;
+}
+
+static int is_header(char const* line, size_t len) {
+	/* field lines start with an upper-case name, headers with a lower-case hex address */
+	return len > 0 && ((line[0] >= '0' && line[0] <= '9') || (line[0] >= 'a' && line[0] <= 'f'));
+}
+
+static int path_contains(mapping_t const* mapping, char const* needle) {
+	size_t const n = strlen(needle);
+	size_t i;
+	for (i = 0; i + n <= mapping->path_len; ++i)
+		if (memcmp(mapping->path + i, needle, n) == 0)
+			return 1;
+	return 0;
+}
+
+static int path_is(mapping_t const* mapping, char const* name) {
+	return mapping->path_len == strlen(name) && memcmp(mapping->path, name, mapping->path_len) == 0;
+}
+
+typedef struct {
+	uintptr_t arena_base; /* 64MB window of the last secondary arena */
+	mapping_t previous;
+} classify_state_t;
+
+static mapping_class_t classify(mapping_t const* mapping, classify_state_t* state) {
+	mapping_t const* const previous = &state->previous;
+	if (is_tracer_mapping(mapping->start, mapping->end))
+		return MAPPING_CLASS_TRACER;
+	if (path_is(mapping, "[heap]"))
+		return MAPPING_CLASS_HEAP;
+	if (path_is(mapping, "[stack]") || path_contains(mapping, "[stack:"))
+		return MAPPING_CLASS_STACK;
+	if (mapping->path_len > 0 && mapping->path[0] == '[')
+		return MAPPING_CLASS_OTHER;
+	if (!mapping->anonymous) {
+		if (path_contains(mapping, ".so"))
+			return mapping->perms[2] == 'x' ? MAPPING_CLASS_LIBRARY_TEXT : MAPPING_CLASS_LIBRARY_DATA;
+		return MAPPING_CLASS_FILE;
+	}
+	/* a secondary arena: used part at a 64MB boundary, PROT_NONE rest of the window */
+	if (mapping->start % MALLOC_ARENA_ALIGNMENT == 0 && mapping->perms[0] == 'r' && mapping->perms[1] == 'w') {
+		state->arena_base = mapping->start;
+		return MAPPING_CLASS_MALLOC_ARENA;
+	}
+	if (state->arena_base != 0 && mapping->start >= state->arena_base && mapping->end <= state->arena_base + MALLOC_ARENA_ALIGNMENT)
+		return MAPPING_CLASS_MALLOC_ARENA;
+	/* a thread stack sits right above its PROT_NONE guard */
+	if (mapping->perms[0] == 'r' && mapping->perms[1] == 'w' && previous->anonymous &&
+		previous->end == mapping->start && memcmp(previous->perms, "---", 3) == 0)
+		return MAPPING_CLASS_THREAD_STACK;
+	return MAPPING_CLASS_ANONYMOUS;
+}
+
+static VALUE mapping_to_hash(mapping_t const* mapping, mapping_class_t klass, size_t ruby_heap_bytes) {
+	VALUE hash = rb_hash_new();
+	rb_hash_aset(hash, sym_start, SIZET2NUM(mapping->start));
+	rb_hash_aset(hash, sym_end, SIZET2NUM(mapping->end));
+	rb_hash_aset(hash, sym_perms, rb_str_new(mapping->perms, 4));
+	rb_hash_aset(hash, sym_path, mapping->path_len ? rb_str_new(mapping->path, (long)mapping->path_len) : Qnil);
+	rb_hash_aset(hash, sym_class, s_class_syms[klass]);
+	rb_hash_aset(hash, sym_size, SIZET2NUM(mapping->size));
+	rb_hash_aset(hash, sym_rss, SIZET2NUM(mapping->rss));
+	rb_hash_aset(hash, sym_pss, SIZET2NUM(mapping->pss));
+	rb_hash_aset(hash, sym_swap, SIZET2NUM(mapping->swap));
+	rb_hash_aset(hash, sym_ruby_heap_bytes, SIZET2NUM(ruby_heap_bytes));
+	return hash;
+}
+
+/*
+ * Ruby heap pages come from malloc, so they share mappings with other
+ * classes; their share of a mapping's RSS and PSS is estimated by size.
+ */
+static void finish_mapping(mapping_t const* mapping, classify_state_t* state, ruby_pages_t const* pages, size_t* page_cursor,
+                           class_total_t* totals, VALUE records) {
+	mapping_class_t const klass = classify(mapping, state);
+	size_t const span = mapping->end - mapping->start;
+	size_t ruby = klass == MAPPING_CLASS_TRACER ? 0 : ruby_page_bytes(pages, page_cursor, mapping->start, mapping->end);
+	size_t ruby_rss = 0, ruby_pss = 0;
+	if (ruby > span)
+		ruby = span;
+	if (ruby > 0) {
+		double const share = (double)ruby / span;
+		ruby_rss = (size_t)(mapping->rss * share);
+		ruby_pss = (size_t)(mapping->pss * share);
+		totals[MAPPING_CLASS_RUBY_HEAP].count += 1;
+		totals[MAPPING_CLASS_RUBY_HEAP].size += ruby;
+		totals[MAPPING_CLASS_RUBY_HEAP].rss += ruby_rss;
+		totals[MAPPING_CLASS_RUBY_HEAP].pss += ruby_pss;
+	}
+	totals[klass].count += 1;
+	totals[klass].size += mapping->size - ruby;
+	totals[klass].rss += mapping->rss - ruby_rss;
+	totals[klass].pss += mapping->pss - ruby_pss;
+	rb_ary_push(records, mapping_to_hash(mapping, klass, ruby));
+	state->previous = *mapping;
+}
+
+/* { mappings: [{start:, end:, perms:, path:, class:, size:, rss:, pss:, swap:, ruby_heap_bytes:}], classes: {class => {count:, size:, rss:, pss:}} } */
+VALUE mappings_to_hash(void) {
+	procfs_reader_t reader;
+	class_total_t totals[MAPPING_CLASS_COUNT];
+	classify_state_t state;
+	ruby_pages_t pages;
+	mapping_t current;
+	int has_current = 0;
+	size_t page_cursor = 0;
+	char const* line;
+	size_t len;
+	VALUE records, classes, result;
+	int i;
+
+	if (!procfs_open(&reader, "/proc/self/smaps"))
+		return Qnil;
+	collect_ruby_pages(&pages);
+	memset(totals, 0, sizeof(totals));
+	memset(&state, 0, sizeof(state));
+	records = rb_ary_new();
+	while (procfs_next_line(&reader, &line, &len)) {
+		if (is_header(line, len)) {
+			mapping_t next;
+			if (!parse_header(line, len, &next))
+				continue;
+			if (has_current)
+				finish_mapping(&current, &state, &pages, &page_cursor, totals, records);
+			current = next;
+			has_current = 1;
+		} else if (has_current) {
+			if (procfs_parse_kb(line, len, "Size", &current.size))
+				continue;
+			else if (procfs_parse_kb(line, len, "Rss", &current.rss))
+				continue;
+			else if (procfs_parse_kb(line, len, "Pss", &current.pss))
+				continue;
+			else if (procfs_parse_kb(line, len, "Swap", &current.swap))
+				continue;
+		}
+	}
+	if (has_current)
+		finish_mapping(&current, &state, &pages, &page_cursor, totals, records);
+	procfs_close(&reader);
+	free(pages.ranges);
+
+	classes = rb_hash_new();
+	for (i = 0; i < MAPPING_CLASS_COUNT; ++i) {
+		VALUE total = rb_hash_new();
+		rb_hash_aset(total, sym_count, SIZET2NUM(totals[i].count));
+		rb_hash_aset(total, sym_size, SIZET2NUM(totals[i].size));
+		rb_hash_aset(total, sym_rss, SIZET2NUM(totals[i].rss));
+		rb_hash_aset(total, sym_pss, SIZET2NUM(totals[i].pss));
+		rb_hash_aset(classes, s_class_syms[i], total);
+	}
+	result = rb_hash_new();
+	rb_hash_aset(result, sym_mappings, records);
+	rb_hash_aset(result, sym_classes, classes);
+	return result;
+}
+
+void init_mappings(void) {
+	int i;
+#define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
+	DEF_SYM(mappings);
+	DEF_SYM(classes);
+	DEF_SYM(start);
+	DEF_SYM(end);
+	DEF_SYM(perms);
+	DEF_SYM(path);
+	DEF_SYM(class);
+	DEF_SYM(size);
+	DEF_SYM(rss);
+	DEF_SYM(pss);
+	DEF_SYM(swap);
+	DEF_SYM(ruby_heap_bytes);
+	DEF_SYM(count);
+#undef DEF_SYM
+	for (i = 0; i < MAPPING_CLASS_COUNT; ++i)
+		s_class_syms[i] = ID2SYM(rb_intern(s_class_names[i]));
+}
@@ -0,0 +1,13 @@
+#ifndef __MAPPINGS_H
+#define __MAPPINGS_H
+#include <ruby/ruby.h>
+
+/*
+ * /proc/self/smaps parsed into one record per mapping, each classified
+ * (heap, malloc arena, stack, shared library, tracer buffer, ...) with
+ * RSS and PSS totals per class. All functions need the GVL.
+ */
+extern void init_mappings(void);
+extern VALUE mappings_to_hash(void);
+
+#endif
@@ -1,7 +1,23 @@
 #include "memtuner.h"
 #include "getrss.h"
+#include "procfs.h"
+#include "mallinfo.h"
 #include "thread_tracer.h"
 #include "malloc_tracer.h"
+#include "stack_table.h"
+#include "allocation_profile.h"
+#include "live_heap.h"
+#include "heap_snapshot.h"
+#include "mmap_tracer.h"
+#include "mappings.h"
+#include "malloc_arenas.h"
+#include "malloc_control.h"
+#include "gc_hook.h"
+#include "sampler.h"
+#include "metrics.h"
+#include "request_stats.h"
+#include "trace_writer.h"
+#include "trace_analyzer.h"
 #include <stdlib.h>
 #include <stdio.h>
 #if HAVE_MALLOC_INFO
@@ -12,6 +28,17 @@ VALUE rb_mMemtuner;
 
 static VALUE sym_current;
 static VALUE sym_peak;
+static VALUE sym_source;
+static VALUE sym_smaps_rollup;
+static VALUE sym_smaps;
+
+/* indexed by memory_field_t */
+static char const* const memory_field_names[MEMORY_FIELD_COUNT] = {
+    "rss", "pss", "pss_anon", "pss_file", "pss_shmem",
+    "shared_clean", "shared_dirty", "private_clean", "private_dirty",
+    "anonymous", "swap", "swap_pss", "rss_anon", "rss_file", "rss_shmem",
+};
+static VALUE memory_field_syms[MEMORY_FIELD_COUNT];
 
 /* struct mallinfo members */
 static VALUE sym_arena;     /* Non-mmapped space allocated (bytes) */
@@ -27,23 +54,22 @@ static VALUE sym_keepcost;  /* Top-most, releasable space (bytes) */
 
 VALUE rb_memtuner_mallinfo(VALUE self)
 {
-#if HAVE_MALLOC_INFO
-    struct mallinfo mi = mallinfo();
-    VALUE hash = rb_hash_new();
-    rb_hash_aset(hash, sym_arena, INT2NUM(mi.arena));
-    rb_hash_aset(hash, sym_ordblks, INT2NUM(mi.ordblks));
-    rb_hash_aset(hash, sym_smblks, INT2NUM(mi.smblks));
-    rb_hash_aset(hash, sym_hblks, INT2NUM(mi.hblks));
-    rb_hash_aset(hash, sym_hblkhd, INT2NUM(mi.hblkhd));
-    rb_hash_aset(hash, sym_usmblks, INT2NUM(mi.usmblks));
-    rb_hash_aset(hash, sym_fsmblks, INT2NUM(mi.fsmblks));
-    rb_hash_aset(hash, sym_uordblks, INT2NUM(mi.uordblks));
-    rb_hash_aset(hash, sym_fordblks, INT2NUM(mi.fordblks));
-    rb_hash_aset(hash, sym_keepcost, INT2NUM(mi.keepcost));
+    memtuner_mallinfo_t mi;
+    VALUE hash;
+    if (!get_mallinfo(&mi))
+        return Qnil;
+    hash = rb_hash_new();
+    rb_hash_aset(hash, sym_arena, SIZET2NUM(mi.arena));
+    rb_hash_aset(hash, sym_ordblks, SIZET2NUM(mi.ordblks));
+    rb_hash_aset(hash, sym_smblks, SIZET2NUM(mi.smblks));
+    rb_hash_aset(hash, sym_hblks, SIZET2NUM(mi.hblks));
+    rb_hash_aset(hash, sym_hblkhd, SIZET2NUM(mi.hblkhd));
+    rb_hash_aset(hash, sym_usmblks, SIZET2NUM(mi.usmblks));
+    rb_hash_aset(hash, sym_fsmblks, SIZET2NUM(mi.fsmblks));
+    rb_hash_aset(hash, sym_uordblks, SIZET2NUM(mi.uordblks));
+    rb_hash_aset(hash, sym_fordblks, SIZET2NUM(mi.fordblks));
+    rb_hash_aset(hash, sym_keepcost, SIZET2NUM(mi.keepcost));
     return hash;
-#else
-    return Qnil;
-#endif
 }
 
 VALUE
@@ -64,23 +90,348 @@ rb_memtuner_malloc_info(VALUE self)
 #endif
 }
 
+VALUE
+rb_memtuner_malloc_arenas(VALUE self)
+{
+    return malloc_arenas_to_hash();
+}
+
+VALUE
+rb_memtuner_fragmentation_report(VALUE self)
+{
+    return fragmentation_report();
+}
+
+VALUE
+rb_memtuner_mallopt(VALUE self, VALUE param, VALUE value)
+{
+    return malloc_control_mallopt(param, value);
+}
+
+/* Memtuner.malloc_trim(pad = 0) */
+VALUE
+rb_memtuner_malloc_trim(int argc, VALUE *argv, VALUE self)
+{
+    VALUE pad;
+    rb_scan_args(argc, argv, "01", &pad);
+    return malloc_control_trim(NIL_P(pad) ? 0 : NUM2SIZET(pad));
+}
+
+/* Memtuner.start_trim_scheduler(fragmentation: 0.3, min_interval: 10, max_interval: 300, pad: 0) */
+VALUE
+rb_memtuner_start_trim_scheduler(int argc, VALUE *argv, VALUE self)
+{
+    static ID keyword_ids[4];
+    VALUE opts, values[4] = { Qundef, Qundef, Qundef, Qundef };
+
+    if (!keyword_ids[0]) {
+        keyword_ids[0] = rb_intern("fragmentation");
+        keyword_ids[1] = rb_intern("min_interval");
+        keyword_ids[2] = rb_intern("max_interval");
+        keyword_ids[3] = rb_intern("pad");
+    }
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, keyword_ids, 0, 4, values);
+    return start_trim_scheduler(values[0] == Qundef ? 0.3 : NUM2DBL(values[0]),
+                                values[1] == Qundef ? 10.0 : NUM2DBL(values[1]),
+                                values[2] == Qundef ? 300.0 : NUM2DBL(values[2]),
+                                values[3] == Qundef ? 0 : NUM2SIZET(values[3]));
+}
+
+VALUE
+rb_memtuner_stop_trim_scheduler(VALUE self)
+{
+    return stop_trim_scheduler();
+}
+
+VALUE
+rb_memtuner_trim_scheduler_stats(VALUE self)
+{
+    return trim_scheduler_stats();
+}
+
+/* Memtuner.start_sampler(interval_ms: 1000, capacity: 3600) */
+VALUE
+rb_memtuner_start_sampler(int argc, VALUE *argv, VALUE self)
+{
+    static ID keyword_ids[2];
+    VALUE opts, values[2] = { Qundef, Qundef };
+
+    if (!keyword_ids[0]) {
+        keyword_ids[0] = rb_intern("interval_ms");
+        keyword_ids[1] = rb_intern("capacity");
+    }
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, keyword_ids, 0, 2, values);
+    return start_sampler(values[0] == Qundef ? 1000 : NUM2UINT(values[0]),
+                         values[1] == Qundef ? 3600 : NUM2SIZET(values[1]));
+}
+
+VALUE
+rb_memtuner_stop_sampler(VALUE self)
+{
+    return stop_sampler();
+}
+
+/* Memtuner.history(since: nil), since is a Time or epoch seconds */
+VALUE
+rb_memtuner_history(int argc, VALUE *argv, VALUE self)
+{
+    static ID keyword_ids[1];
+    VALUE opts, since = Qundef;
+
+    if (!keyword_ids[0])
+        keyword_ids[0] = rb_intern("since");
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, keyword_ids, 0, 1, &since);
+    if (since == Qundef || NIL_P(since))
+        return sampler_history(0.0);
+    return sampler_history(NUM2DBL(rb_funcall(since, rb_intern("to_f"), 0)));
+}
+
+VALUE
+rb_memtuner_metrics_text(VALUE self)
+{
+    return metrics_text();
+}
+
+VALUE
+rb_memtuner_request_begin(VALUE self)
+{
+    request_begin();
+    return Qnil;
+}
+
+VALUE
+rb_memtuner_request_route(VALUE self, VALUE endpoint)
+{
+    StringValue(endpoint);
+    request_route(RSTRING_PTR(endpoint), RSTRING_LEN(endpoint));
+    return Qnil;
+}
+
+VALUE
+rb_memtuner_request_end(VALUE self, VALUE endpoint)
+{
+    StringValue(endpoint);
+    request_end(RSTRING_PTR(endpoint), RSTRING_LEN(endpoint));
+    return Qnil;
+}
+
+VALUE
+rb_memtuner_request_stats(int argc, VALUE *argv, VALUE self)
+{
+    VALUE limit;
+    rb_scan_args(argc, argv, "01", &limit);
+    return request_stats_to_a(NIL_P(limit) ? 20 : NUM2SIZET(limit));
+}
+
+/* Memtuner.reset_request_stats(capacity = 100) */
+VALUE
+rb_memtuner_reset_request_stats(int argc, VALUE *argv, VALUE self)
+{
+    VALUE capacity;
+    size_t n;
+    rb_scan_args(argc, argv, "01", &capacity);
+    n = NIL_P(capacity) ? 100 : NUM2SIZET(capacity);
+    if (n == 0)
+        rb_raise(rb_eArgError, "capacity must be positive");
+    reset_request_stats(n);
+    return Qnil;
+}
+
+/* Memtuner.set_request_budget('users#index', bytes), '*' for any route; nil bytes removes */
+VALUE
+rb_memtuner_set_request_budget(VALUE self, VALUE endpoint, VALUE bytes)
+{
+    StringValue(endpoint);
+    if (!set_request_budget(RSTRING_PTR(endpoint), RSTRING_LEN(endpoint), NIL_P(bytes) ? 0 : NUM2SIZET(bytes)))
+        rb_raise(rb_eArgError, "too many request budgets");
+    return bytes;
+}
+
+VALUE
+rb_memtuner_request_incidents(VALUE self)
+{
+    return request_incidents_to_a();
+}
+
 VALUE
 rb_memtuner_rss_usage(VALUE self)
 {
     size_t current = getCurrentRSS();
     size_t peak = getPeakRSS();
     VALUE hash = rb_hash_new();
-    rb_hash_aset(hash, sym_current, UINT2NUM(current));
-    rb_hash_aset(hash, sym_peak, UINT2NUM(peak));
+    rb_hash_aset(hash, sym_current, SIZET2NUM(current));
+    rb_hash_aset(hash, sym_peak, SIZET2NUM(peak));
     return hash;
 }
 
+/* fields the kernel doesn't report are nil */
+VALUE
+rb_memtuner_memory_breakdown(VALUE self)
+{
+    memory_breakdown_t breakdown;
+    VALUE hash;
+    int i;
+    if (!get_memory_breakdown(&breakdown))
+        return Qnil;
+    hash = rb_hash_new();
+    rb_hash_aset(hash, sym_source, breakdown.from_rollup ? sym_smaps_rollup : sym_smaps);
+    for (i = 0; i < MEMORY_FIELD_COUNT; ++i)
+        rb_hash_aset(hash, memory_field_syms[i], (breakdown.found & (1u << i)) ? SIZET2NUM(breakdown.bytes[i]) : Qnil);
+    return hash;
+}
+
+VALUE
+rb_memtuner_mappings(VALUE self)
+{
+    return mappings_to_hash();
+}
+
+static int
+start_malloc_tracer(void)
+{
+    static int started = 0;
+    if (started)
+        return 0;
+    started = 1;
+    init_malloc_tracer();
+    init_mmap_tracer();
+    init_thread_tracer();
+    return 1;
+}
+
+VALUE
+rb_memtuner_start_malloc_tracer(VALUE self)
+{
+    set_malloc_sampling_interval(0);
+    return start_malloc_tracer() ? Qtrue : Qfalse;
+}
+
+/* Memtuner.start_sampling(bytes_interval: 512 * 1024) */
+VALUE
+rb_memtuner_start_sampling(int argc, VALUE *argv, VALUE self)
+{
+    static ID keyword_ids[1];
+    VALUE opts, bytes_interval = Qundef;
+    size_t interval = 512 * 1024;
+
+    if (!keyword_ids[0])
+        keyword_ids[0] = rb_intern("bytes_interval");
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, keyword_ids, 0, 1, &bytes_interval);
+    if (bytes_interval != Qundef)
+        interval = NUM2SIZET(bytes_interval);
+    if (interval == 0)
+        rb_raise(rb_eArgError, "bytes_interval must be positive");
+
+    set_malloc_sampling_interval(interval);
+    return start_malloc_tracer() ? Qtrue : Qfalse;
+}
+
+/* Memtuner.start_trace(path); traced calls are appended to path until stop_trace */
+VALUE
+rb_memtuner_start_trace(VALUE self, VALUE path)
+{
+    FilePathValue(path);
+    if (!start_trace(StringValueCStr(path)))
+        return Qfalse;
+    start_malloc_tracer();
+    return Qtrue;
+}
+
+VALUE
+rb_memtuner_stop_trace(VALUE self)
+{
+    return stop_trace() ? Qtrue : Qfalse;
+}
+
+VALUE
+rb_memtuner_trace_stats(VALUE self)
+{
+    return trace_stats();
+}
+
+/* Memtuner.analyze_trace(path, top: 20, points: 500, folded: nil | :allocated | :retained) */
+VALUE
+rb_memtuner_analyze_trace(int argc, VALUE *argv, VALUE self)
+{
+    static ID keyword_ids[3];
+    VALUE path, opts, values[3] = { Qundef, Qundef, Qundef };
+    trace_folded_t folded = TRACE_FOLDED_NONE;
+
+    if (!keyword_ids[0]) {
+        keyword_ids[0] = rb_intern("top");
+        keyword_ids[1] = rb_intern("points");
+        keyword_ids[2] = rb_intern("folded");
+    }
+    rb_scan_args(argc, argv, "1:", &path, &opts);
+    FilePathValue(path);
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, keyword_ids, 0, 3, values);
+    if (values[2] != Qundef && !NIL_P(values[2])) {
+        if (values[2] == ID2SYM(rb_intern("allocated")))
+            folded = TRACE_FOLDED_ALLOCATED;
+        else if (values[2] == ID2SYM(rb_intern("retained")))
+            folded = TRACE_FOLDED_RETAINED;
+        else
+            rb_raise(rb_eArgError, "folded must be :allocated or :retained");
+    }
+    path = rb_str_new_frozen(path);
+    return analyze_trace(StringValueCStr(path),
+                         values[0] == Qundef ? 20 : NUM2SIZET(values[0]),
+                         values[1] == Qundef ? 500 : NUM2SIZET(values[1]),
+                         folded);
+}
+
+VALUE
+rb_memtuner_allocation_profile(int argc, VALUE *argv, VALUE self)
+{
+    VALUE limit;
+    rb_scan_args(argc, argv, "01", &limit);
+    return allocation_profile_to_a(NIL_P(limit) ? 20 : NUM2SIZET(limit));
+}
+
+VALUE
+rb_memtuner_live_heap_snapshot(int argc, VALUE *argv, VALUE self)
+{
+    VALUE limit;
+    rb_scan_args(argc, argv, "01", &limit);
+    return live_heap_snapshot_to_a(NIL_P(limit) ? 20 : NUM2SIZET(limit));
+}
+
+VALUE
+rb_memtuner_snapshot(VALUE self)
+{
+    return heap_snapshot_new();
+}
+
+VALUE
+rb_memtuner_mapping_report(VALUE self)
+{
+    return mapping_report();
+}
+
+VALUE
+rb_memtuner_thread_allocation_stats(VALUE self)
+{
+    return thread_allocation_stats_to_a();
+}
+
 void
 Init_memtuner(void)
 {
 #define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
     DEF_SYM(current);
     DEF_SYM(peak);
+    DEF_SYM(source);
+    DEF_SYM(smaps_rollup);
+    DEF_SYM(smaps);
     DEF_SYM(arena);
     DEF_SYM(ordblks);
     DEF_SYM(smblks);
@@ -92,11 +443,62 @@ Init_memtuner(void)
     DEF_SYM(fordblks);
     DEF_SYM(keepcost);
 #undef DEF_SYM
+    {
+        int i;
+        for (i = 0; i < MEMORY_FIELD_COUNT; ++i)
+            memory_field_syms[i] = ID2SYM(rb_intern(memory_field_names[i]));
+    }
 
     rb_mMemtuner = rb_define_module("Memtuner");
     rb_define_module_function(rb_mMemtuner, "glibc_mallinfo", rb_memtuner_mallinfo, 0);
     rb_define_module_function(rb_mMemtuner, "glibc_malloc_info", rb_memtuner_malloc_info, 0);
+    rb_define_module_function(rb_mMemtuner, "malloc_arenas", rb_memtuner_malloc_arenas, 0);
+    rb_define_module_function(rb_mMemtuner, "fragmentation_report", rb_memtuner_fragmentation_report, 0);
+    rb_define_module_function(rb_mMemtuner, "mallopt", rb_memtuner_mallopt, 2);
+    rb_define_module_function(rb_mMemtuner, "malloc_trim", rb_memtuner_malloc_trim, -1);
+    rb_define_module_function(rb_mMemtuner, "start_trim_scheduler", rb_memtuner_start_trim_scheduler, -1);
+    rb_define_module_function(rb_mMemtuner, "stop_trim_scheduler", rb_memtuner_stop_trim_scheduler, 0);
+    rb_define_module_function(rb_mMemtuner, "trim_scheduler_stats", rb_memtuner_trim_scheduler_stats, 0);
+    rb_define_module_function(rb_mMemtuner, "start_sampler", rb_memtuner_start_sampler, -1);
+    rb_define_module_function(rb_mMemtuner, "stop_sampler", rb_memtuner_stop_sampler, 0);
+    rb_define_module_function(rb_mMemtuner, "history", rb_memtuner_history, -1);
+    rb_define_module_function(rb_mMemtuner, "metrics_text", rb_memtuner_metrics_text, 0);
+    rb_define_module_function(rb_mMemtuner, "request_begin", rb_memtuner_request_begin, 0);
+    rb_define_module_function(rb_mMemtuner, "request_route", rb_memtuner_request_route, 1);
+    rb_define_module_function(rb_mMemtuner, "request_end", rb_memtuner_request_end, 1);
+    rb_define_module_function(rb_mMemtuner, "request_stats", rb_memtuner_request_stats, -1);
+    rb_define_module_function(rb_mMemtuner, "reset_request_stats", rb_memtuner_reset_request_stats, -1);
+    rb_define_module_function(rb_mMemtuner, "set_request_budget", rb_memtuner_set_request_budget, 2);
+    rb_define_module_function(rb_mMemtuner, "request_incidents", rb_memtuner_request_incidents, 0);
     rb_define_module_function(rb_mMemtuner, "rss_usage", rb_memtuner_rss_usage, 0);
+    rb_define_module_function(rb_mMemtuner, "memory_breakdown", rb_memtuner_memory_breakdown, 0);
+    rb_define_module_function(rb_mMemtuner, "mappings", rb_memtuner_mappings, 0);
+    rb_define_module_function(rb_mMemtuner, "start_malloc_tracer", rb_memtuner_start_malloc_tracer, 0);
+    rb_define_module_function(rb_mMemtuner, "start_sampling", rb_memtuner_start_sampling, -1);
+    rb_define_module_function(rb_mMemtuner, "start_trace", rb_memtuner_start_trace, 1);
+    rb_define_module_function(rb_mMemtuner, "stop_trace", rb_memtuner_stop_trace, 0);
+    rb_define_module_function(rb_mMemtuner, "trace_stats", rb_memtuner_trace_stats, 0);
+    rb_define_module_function(rb_mMemtuner, "analyze_trace", rb_memtuner_analyze_trace, -1);
+    rb_define_module_function(rb_mMemtuner, "allocation_profile", rb_memtuner_allocation_profile, -1);
+    rb_define_module_function(rb_mMemtuner, "live_heap_snapshot", rb_memtuner_live_heap_snapshot, -1);
+    rb_define_module_function(rb_mMemtuner, "snapshot", rb_memtuner_snapshot, 0);
+    rb_define_module_function(rb_mMemtuner, "mapping_report", rb_memtuner_mapping_report, 0);
+    rb_define_module_function(rb_mMemtuner, "thread_allocation_stats", rb_memtuner_thread_allocation_stats, 0);
+
+    init_stack_table();
+    init_allocation_profile();
+    init_live_heap_snapshot();
+    init_heap_snapshot(rb_mMemtuner);
+    init_mapping_report();
+    init_thread_allocation_stats();
+    init_mappings();
+    init_malloc_arenas();
+    init_gc_hook();
+    init_malloc_control();
+    init_sampler();
+    init_request_stats();
+    init_trace_writer();
+    init_trace_analyzer();
 
     // init_thread_tracer();
     // init_malloc_tracer();
@@ -0,0 +1,95 @@
+#include "metrics.h"
+#include "sampler.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+	sample_field_t field;
+	char const* name;
+	char const* type;
+	char const* help;
+} metric_t;
+
+static metric_t const s_metrics[] = {
+	{ SAMPLE_RSS, "memtuner_rss_bytes", "gauge", "Resident set size." },
+	{ SAMPLE_MALLOC_ARENA, "memtuner_malloc_arena_bytes", "gauge", "Bytes malloc holds in its arenas (mallinfo arena)." },
+	{ SAMPLE_MALLOC_MMAP, "memtuner_malloc_mmap_bytes", "gauge", "Bytes in chunks malloc mapped directly (mallinfo hblkhd)." },
+	{ SAMPLE_MALLOC_IN_USE, "memtuner_malloc_in_use_bytes", "gauge", "Bytes of allocated chunks (mallinfo uordblks)." },
+	{ SAMPLE_MALLOC_FREE, "memtuner_malloc_free_bytes", "gauge", "Bytes of free chunks (mallinfo fordblks)." },
+	{ SAMPLE_HEAP_AVAILABLE_SLOTS, "memtuner_ruby_heap_available_slots", "gauge", "Ruby heap slots as of the latest GC." },
+	{ SAMPLE_HEAP_LIVE_SLOTS, "memtuner_ruby_heap_live_slots", "gauge", "Live Ruby heap slots as of the latest GC." },
+	{ SAMPLE_HEAP_FREE_SLOTS, "memtuner_ruby_heap_free_slots", "gauge", "Free Ruby heap slots as of the latest GC." },
+	{ SAMPLE_GC_COUNT, "memtuner_gc_total", "counter", "GC runs." },
+	{ SAMPLE_MAJOR_GC_COUNT, "memtuner_major_gc_total", "counter", "Major GC runs." },
+};
+
+/* guarded by the GVL */
+static char* s_buffer = NULL;
+static size_t s_capacity = 0;
+static size_t s_length = 0;
+
+static void append(char const* format, ...) __attribute__((format(printf, 1, 2)));
+
+static void append(char const* format, ...) {
+	for (;;) {
+		va_list args;
+		int n;
+		va_start(args, format);
+		n = vsnprintf(s_buffer + s_length, s_capacity - s_length, format, args);
+		va_end(args);
+		if (n < 0)
+			return;
+		if (s_length + (size_t)n < s_capacity) {
+			s_length += (size_t)n;
+			return;
+		}
+		s_capacity = (s_length + (size_t)n) * 2;
+		REALLOC_N(s_buffer, char, s_capacity);
+	}
+}
+
+/* The pid label tells the workers behind one endpoint apart. */
+VALUE metrics_text(void) {
+	sample_t sample;
+	sample_arena_t arenas[SAMPLER_ARENA_MAX];
+	size_t arena_count, arena_total, i;
+	int const pid = (int)getpid();
+
+	if (!sampler_latest(&sample))
+		sample_now(&sample);
+	arena_count = sampler_arenas(arenas, SAMPLER_ARENA_MAX, &arena_total);
+	if (s_buffer == NULL) {
+		s_capacity = 4096;
+		s_buffer = ALLOC_N(char, s_capacity);
+	}
+	s_length = 0;
+
+	for (i = 0; i < sizeof(s_metrics) / sizeof(s_metrics[0]); ++i) {
+		metric_t const* const metric = &s_metrics[i];
+		append("# HELP %s %s\n# TYPE %s %s\n%s{pid=\"%d\"} %zu\n",
+		       metric->name, metric->help, metric->name, metric->type,
+		       metric->name, pid, sample.values[metric->field]);
+	}
+	if (arena_total > 0) {
+		/* per-arena series stop at SAMPLER_ARENA_MAX; this tells when some are missing */
+		append("# HELP memtuner_malloc_arenas glibc arenas, including any without per-arena series.\n"
+		       "# TYPE memtuner_malloc_arenas gauge\n"
+		       "memtuner_malloc_arenas{pid=\"%d\"} %zu\n", pid, arena_total);
+	}
+	if (arena_count > 0) {
+		append("# HELP memtuner_malloc_arena_system_bytes Bytes each glibc arena got from the system.\n"
+		       "# TYPE memtuner_malloc_arena_system_bytes gauge\n");
+		for (i = 0; i < arena_count; ++i)
+			append("memtuner_malloc_arena_system_bytes{pid=\"%d\",arena=\"%d\"} %zu\n", pid, arenas[i].nr, arenas[i].system_bytes);
+		append("# HELP memtuner_malloc_arena_free_bytes Bytes of free chunks in each glibc arena.\n"
+		       "# TYPE memtuner_malloc_arena_free_bytes gauge\n");
+		for (i = 0; i < arena_count; ++i)
+			append("memtuner_malloc_arena_free_bytes{pid=\"%d\",arena=\"%d\"} %zu\n", pid, arenas[i].nr, arenas[i].free_bytes);
+	}
+	append("# HELP memtuner_sample_timestamp_seconds When these values were sampled.\n"
+	       "# TYPE memtuner_sample_timestamp_seconds gauge\n"
+	       "memtuner_sample_timestamp_seconds{pid=\"%d\"} %.3f\n", pid, sample.time);
+	return rb_str_new(s_buffer, (long)s_length);
+}
@@ -0,0 +1,12 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+#include <ruby/ruby.h>
+
+/*
+ * Prometheus text exposition of the sampler's latest values. Rendered
+ * into a buffer kept across calls, so a scrape allocates only the
+ * returned string. Needs the GVL.
+ */
+extern VALUE metrics_text(void);
+
+#endif
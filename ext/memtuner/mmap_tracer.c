@@ -0,0 +1,404 @@
+#include "mmap_tracer.h"
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h> /* brk, sbrk */
+#include <sys/mman.h>
+#include "function_hook.h"
+#include "debug.h"
+#include "call_info.h"
+#include "malloc_tracer.h"
+#include "mallinfo.h"
+#include "procfs.h"
+
+typedef void *(*mmap_func_t)(void *, size_t, int, int, int, off_t);
+typedef int (*munmap_func_t)(void *, size_t);
+typedef void *(*mremap_func_t)(void *, size_t, size_t, int, ...);
+typedef int (*brk_func_t)(void *);
+typedef void *(*sbrk_func_t)(intptr_t);
+
+static mmap_func_t original_mmap;
+static munmap_func_t original_munmap;
+static mremap_func_t original_mremap;
+static brk_func_t original_brk;
+static sbrk_func_t original_sbrk;
+
+/* sbrk calls brk internally; only the outer call is recorded */
+static __thread int s_in_sbrk __attribute__((tls_model("initial-exec"))) = 0;
+
+typedef enum {
+	MAPPING_ANONYMOUS,
+	MAPPING_FILE,
+	MAPPING_MALLOC, /* mapped from inside a malloc family call */
+} mapping_source_t;
+
+typedef struct {
+	uintptr_t start;
+	uintptr_t end;
+	uint8_t source;
+	uint8_t reserved; /* PROT_NONE: address space only */
+} mapped_region_t;
+
+/* sorted by start, non-overlapping */
+#define REGION_TABLE_CAPACITY ((size_t)1 << 16)
+
+static mapped_region_t* s_regions = NULL;
+static size_t s_region_count = 0;
+static size_t s_region_overflow_count = 0;
+static pthread_mutex_t s_region_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uintptr_t s_brk_base = 0;
+
+typedef struct {
+	uintptr_t start;
+	uintptr_t end;
+} tracer_mapping_t;
+
+#define TRACER_MAPPING_MAX 4096
+/* append-only; entries are published by bumping the count */
+static tracer_mapping_t s_tracer_mappings[TRACER_MAPPING_MAX];
+static size_t s_tracer_mapping_count = 0;
+
+static VALUE sym_mapping_count;
+static VALUE sym_mapped_bytes;
+static VALUE sym_mmap_anonymous_bytes;
+static VALUE sym_mmap_file_bytes;
+static VALUE sym_malloc_mmap_bytes;
+static VALUE sym_reserved_bytes;
+static VALUE sym_brk_bytes;
+static VALUE sym_mallinfo_arena;
+static VALUE sym_mallinfo_hblkhd;
+static VALUE sym_malloc_difference;
+static VALUE sym_overflow_count;
+
+void add_tracer_mapping(void const* start, size_t len) {
+	size_t const i = __atomic_fetch_add(&s_tracer_mapping_count, 1, __ATOMIC_ACQ_REL);
+	if (i >= TRACER_MAPPING_MAX)
+		return;
+	s_tracer_mappings[i].start = (uintptr_t)start;
+	__atomic_store_n(&s_tracer_mappings[i].end, (uintptr_t)start + len, __ATOMIC_RELEASE);
+}
+
+int is_tracer_mapping(uintptr_t start, uintptr_t end) {
+	size_t count = __atomic_load_n(&s_tracer_mapping_count, __ATOMIC_ACQUIRE);
+	size_t i;
+	if (count > TRACER_MAPPING_MAX)
+		count = TRACER_MAPPING_MAX;
+	for (i = 0; i < count; ++i) {
+		uintptr_t const mapping_end = __atomic_load_n(&s_tracer_mappings[i].end, __ATOMIC_ACQUIRE);
+		if (mapping_end != 0 && s_tracer_mappings[i].start < end && start < mapping_end)
+			return 1;
+	}
+	return 0;
+}
+
+/* index of the first region ending after addr */
+static size_t find_region(uintptr_t addr) {
+	size_t lo = 0, hi = s_region_count;
+	while (lo < hi) {
+		size_t const mid = (lo + hi) / 2;
+		if (s_regions[mid].end <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void remove_regions(uintptr_t start, uintptr_t end) {
+	size_t i = find_region(start);
+	while (i < s_region_count && s_regions[i].start < end) {
+		mapped_region_t* const r = &s_regions[i];
+		if (r->start < start && r->end > end) {
+			/* unmapping the middle splits the region */
+			if (s_region_count == REGION_TABLE_CAPACITY) {
+				++s_region_overflow_count;
+				r->end = start;
+				return;
+			}
+			memmove(r + 1, r, (s_region_count - i) * sizeof(*r));
+			++s_region_count;
+			r->end = start;
+			r[1].start = end;
+			return;
+		}
+		if (r->start < start) {
+			r->end = start;
+			++i;
+		} else if (r->end > end) {
+			r->start = end;
+			return;
+		} else {
+			memmove(r, r + 1, (s_region_count - i - 1) * sizeof(*r));
+			--s_region_count;
+		}
+	}
+}
+
+static void insert_region(uintptr_t start, uintptr_t end, int source, int reserved) {
+	size_t i;
+	/* MAP_FIXED and mremap replace whatever was mapped there */
+	remove_regions(start, end);
+	if (s_region_count == REGION_TABLE_CAPACITY) {
+		++s_region_overflow_count;
+		return;
+	}
+	i = find_region(start);
+	memmove(&s_regions[i + 1], &s_regions[i], (s_region_count - i) * sizeof(s_regions[0]));
+	s_regions[i].start = start;
+	s_regions[i].end = end;
+	s_regions[i].source = (uint8_t)source;
+	s_regions[i].reserved = (uint8_t)reserved;
+	++s_region_count;
+}
+
+static size_t page_round(size_t size) {
+	size_t const page_size = (size_t)getpagesize();
+	return (size + page_size - 1) / page_size * page_size;
+}
+
+static void *mmap_hook(void *addr, size_t size, int prot, int flags, int fd, off_t offset) {
+	void* p = original_mmap(addr, size, prot, flags, fd, offset);
+	call_info_t info;
+	if (p == MAP_FAILED)
+		return p;
+
+	pthread_mutex_lock(&s_region_mutex);
+	insert_region((uintptr_t)p, (uintptr_t)p + page_round(size),
+	              malloc_tracer_in_allocator() ? MAPPING_MALLOC : (flags & MAP_ANONYMOUS) ? MAPPING_ANONYMOUS : MAPPING_FILE,
+	              prot == PROT_NONE);
+	pthread_mutex_unlock(&s_region_mutex);
+
+	info.type = CALL_FUNC_MMAP;
+	info.mmap.size = size;
+	info.mmap.prot = prot;
+	info.mmap.flags = flags;
+	info.mmap.allocated = p;
+	add_call_info(&info);
+	return p;
+}
+
+static int munmap_hook(void *p, size_t size) {
+	int const ret = original_munmap(p, size);
+	call_info_t info;
+	if (ret != 0)
+		return ret;
+
+	pthread_mutex_lock(&s_region_mutex);
+	remove_regions((uintptr_t)p, (uintptr_t)p + page_round(size));
+	pthread_mutex_unlock(&s_region_mutex);
+
+	info.type = CALL_FUNC_MUNMAP;
+	info.munmap.ptr = p;
+	info.munmap.size = size;
+	add_call_info(&info);
+	return ret;
+}
+
+static void *mremap_hook(void *p, size_t old_size, size_t size, int flags, ...) {
+	void* new_address = NULL;
+	void* new_p;
+	call_info_t info;
+	if (flags & MREMAP_FIXED) {
+		va_list ap;
+		va_start(ap, flags);
+		new_address = va_arg(ap, void *);
+		va_end(ap);
+	}
+	new_p = original_mremap(p, old_size, size, flags, new_address);
+	if (new_p == MAP_FAILED)
+		return new_p;
+
+	pthread_mutex_lock(&s_region_mutex);
+	{
+		size_t const i = find_region((uintptr_t)p);
+		int source = MAPPING_ANONYMOUS, reserved = 0;
+		if (i < s_region_count && s_regions[i].start <= (uintptr_t)p) {
+			source = s_regions[i].source;
+			reserved = s_regions[i].reserved;
+		} else if (malloc_tracer_in_allocator()) {
+			source = MAPPING_MALLOC;
+		}
+		remove_regions((uintptr_t)p, (uintptr_t)p + page_round(old_size));
+		insert_region((uintptr_t)new_p, (uintptr_t)new_p + page_round(size), source, reserved);
+	}
+	pthread_mutex_unlock(&s_region_mutex);
+
+	info.type = CALL_FUNC_MREMAP;
+	info.mremap.ptr = p;
+	info.mremap.old_size = old_size;
+	info.mremap.size = size;
+	info.mremap.allocated = new_p;
+	add_call_info(&info);
+	return new_p;
+}
+
+static int brk_hook(void *addr) {
+	void* const old_break = s_in_sbrk ? NULL : original_sbrk(0);
+	int const ret = original_brk(addr);
+	call_info_t info;
+	if (ret != 0 || old_break == NULL)
+		return ret;
+	info.type = CALL_FUNC_SBRK;
+	info.sbrk.increment = (intptr_t)((uintptr_t)addr - (uintptr_t)old_break);
+	info.sbrk.allocated = old_break;
+	add_call_info(&info);
+	return ret;
+}
+
+static void *sbrk_hook(intptr_t increment) {
+	void* old_break;
+	call_info_t info;
+	++s_in_sbrk;
+	old_break = original_sbrk(increment);
+	--s_in_sbrk;
+	if (increment == 0 || old_break == (void *)-1)
+		return old_break;
+	info.type = CALL_FUNC_SBRK;
+	info.sbrk.increment = increment;
+	info.sbrk.allocated = old_break;
+	add_call_info(&info);
+	return old_break;
+}
+
+/* start of the [heap] mapping, so brk_bytes covers growth from before tracing too */
+static uintptr_t find_brk_base(void) {
+	static char const heap[] = "[heap]";
+	size_t const heap_len = sizeof(heap) - 1;
+	uintptr_t start = (uintptr_t)sbrk(0);
+	procfs_reader_t reader;
+	char const* line;
+	size_t len;
+	if (!procfs_open(&reader, "/proc/self/maps"))
+		return start;
+	while (procfs_next_line(&reader, &line, &len)) {
+		/* the path is the last field; the start address runs up to the '-' */
+		if (len > heap_len && memcmp(line + len - heap_len, heap, heap_len) == 0) {
+			start = (uintptr_t)strtoull(line, NULL, 16);
+			break;
+		}
+	}
+	procfs_close(&reader);
+	return start;
+}
+
+/*
+ * From the collector's fork handlers, inside its own locks: the region
+ * table's mutex is taken last since nothing is locked while it's held.
+ */
+void mmap_tracer_lock_before_fork(void) {
+	pthread_mutex_lock(&s_region_mutex);
+}
+
+void mmap_tracer_unlock_after_fork(void) {
+	pthread_mutex_unlock(&s_region_mutex);
+}
+
+/* the child's only thread is the forking one, so the table is consistent */
+void mmap_tracer_reset_in_child(void) {
+	pthread_mutex_init(&s_region_mutex, NULL);
+}
+
+static void hook_functions(void) {
+#define DUMP_HOOK_RESULT(name) if (original_ ## name) { memtuner_debug_print("memtuner: " #name ": hook succeeded.\n"); } else { memtuner_debug_print("memtuner: "#name ": hook faild.\n"); }
+	original_mmap = hook_function(mmap, mmap_hook);
+	DUMP_HOOK_RESULT(mmap);
+	original_munmap = hook_function(munmap, munmap_hook);
+	DUMP_HOOK_RESULT(munmap);
+	original_mremap = hook_function(mremap, mremap_hook);
+	DUMP_HOOK_RESULT(mremap);
+	/* sbrk is hooked first: brk_hook reads the break through original_sbrk */
+	original_sbrk = hook_function(sbrk, sbrk_hook);
+	DUMP_HOOK_RESULT(sbrk);
+	if (original_sbrk) {
+		original_brk = hook_function(brk, brk_hook);
+		DUMP_HOOK_RESULT(brk);
+	}
+#undef DUMP_HOOK_RESULT
+}
+
+int init_mmap_tracer(void) {
+	void* p;
+	memtuner_debug_print("init_mmap_tracer\n");
+	if (s_regions != NULL)
+		return 1;
+	p = mmap(NULL, sizeof(mapped_region_t) * REGION_TABLE_CAPACITY, PROT_READ | PROT_WRITE,
+	         MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		memtuner_debug_print("init_mmap_tracer failed\n");
+		return 0;
+	}
+	add_tracer_mapping(p, sizeof(mapped_region_t) * REGION_TABLE_CAPACITY);
+	s_brk_base = find_brk_base();
+	s_regions = p;
+	hook_functions();
+	return 1;
+}
+
+void init_mapping_report(void) {
+#define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
+	DEF_SYM(mapping_count);
+	DEF_SYM(mapped_bytes);
+	DEF_SYM(mmap_anonymous_bytes);
+	DEF_SYM(mmap_file_bytes);
+	DEF_SYM(malloc_mmap_bytes);
+	DEF_SYM(reserved_bytes);
+	DEF_SYM(brk_bytes);
+	DEF_SYM(mallinfo_arena);
+	DEF_SYM(mallinfo_hblkhd);
+	DEF_SYM(malloc_difference);
+	DEF_SYM(overflow_count);
+#undef DEF_SYM
+}
+
+/*
+ * Mapped bytes by origin, reconciled against mallinfo. Only mmaps made
+ * since tracing began are known; brk_bytes is the whole [heap]. Non-main
+ * malloc arenas are carved out of PROT_NONE reservations (counted in
+ * reserved_bytes), so a positive malloc_difference is expected once
+ * several arenas exist.
+ */
+VALUE mapping_report(void) {
+	size_t bytes[MAPPING_MALLOC + 1] = {0};
+	size_t reserved = 0, count, overflow, i, brk_bytes, mapped;
+	VALUE hash;
+
+	if (s_regions == NULL)
+		return Qnil;
+
+	pthread_mutex_lock(&s_region_mutex);
+	count = s_region_count;
+	overflow = s_region_overflow_count;
+	for (i = 0; i < count; ++i) {
+		size_t const size = s_regions[i].end - s_regions[i].start;
+		if (s_regions[i].reserved)
+			reserved += size;
+		else
+			bytes[s_regions[i].source] += size;
+	}
+	pthread_mutex_unlock(&s_region_mutex);
+
+	brk_bytes = (size_t)((uintptr_t)sbrk(0) - s_brk_base);
+	mapped = bytes[MAPPING_ANONYMOUS] + bytes[MAPPING_FILE] + bytes[MAPPING_MALLOC] + brk_bytes;
+
+	hash = rb_hash_new();
+	rb_hash_aset(hash, sym_mapping_count, SIZET2NUM(count));
+	rb_hash_aset(hash, sym_mapped_bytes, SIZET2NUM(mapped));
+	rb_hash_aset(hash, sym_mmap_anonymous_bytes, SIZET2NUM(bytes[MAPPING_ANONYMOUS]));
+	rb_hash_aset(hash, sym_mmap_file_bytes, SIZET2NUM(bytes[MAPPING_FILE]));
+	rb_hash_aset(hash, sym_malloc_mmap_bytes, SIZET2NUM(bytes[MAPPING_MALLOC]));
+	rb_hash_aset(hash, sym_reserved_bytes, SIZET2NUM(reserved));
+	rb_hash_aset(hash, sym_brk_bytes, SIZET2NUM(brk_bytes));
+	{
+		memtuner_mallinfo_t mi;
+		if (get_mallinfo(&mi)) {
+			rb_hash_aset(hash, sym_mallinfo_arena, SIZET2NUM(mi.arena));
+			rb_hash_aset(hash, sym_mallinfo_hblkhd, SIZET2NUM(mi.hblkhd));
+			rb_hash_aset(hash, sym_malloc_difference,
+			             SSIZET2NUM((ssize_t)(mi.arena + mi.hblkhd) - (ssize_t)(brk_bytes + bytes[MAPPING_MALLOC])));
+		}
+	}
+	rb_hash_aset(hash, sym_overflow_count, SIZET2NUM(overflow));
+	return hash;
+}
@@ -0,0 +1,28 @@
+#ifndef __MMAP_TRACER_H
+#define __MMAP_TRACER_H
+#include <ruby/ruby.h> /* first: its config.h sets _GNU_SOURCE for mremap */
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Traces mmap, munmap, mremap, brk and sbrk. Calls are recorded as call
+ * info events like malloc calls, and the mapped regions created since
+ * tracing began are kept in a table for mapping_report.
+ */
+extern int init_mmap_tracer(void);
+
+/* The tracer's own mappings (ring buffers, tables), so reports can set them apart. */
+extern void add_tracer_mapping(void const* start, size_t len);
+extern int is_tracer_mapping(uintptr_t start, uintptr_t end);
+
+/* From the collector's fork handlers, inside its own locks. */
+extern void mmap_tracer_lock_before_fork(void);
+extern void mmap_tracer_unlock_after_fork(void);
+extern void mmap_tracer_reset_in_child(void);
+
+/* with the GVL held */
+extern void init_mapping_report(void);
+/* Returns nil until the tracer has been started. */
+extern VALUE mapping_report(void);
+
+#endif
@@ -0,0 +1,133 @@
+#include "procfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+int procfs_open(procfs_reader_t* reader, char const* path) {
+	reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+	reader->start = 0;
+	reader->end = 0;
+	reader->skipping = 0;
+	return reader->fd >= 0;
+}
+
+void procfs_close(procfs_reader_t* reader) {
+	if (reader->fd >= 0)
+		close(reader->fd);
+	reader->fd = -1;
+}
+
+/* Moves the partial line to the front and reads more; 0 at end of file. */
+static int fill(procfs_reader_t* reader) {
+	ssize_t n;
+	if (reader->start > 0) {
+		memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+	if (reader->end == PROCFS_CHUNK_SIZE)
+		return 1;
+	do {
+		n = read(reader->fd, reader->buf + reader->end, PROCFS_CHUNK_SIZE - reader->end);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return 0;
+	reader->end += (size_t)n;
+	return 1;
+}
+
+int procfs_next_line(procfs_reader_t* reader, char const** line, size_t* len) {
+	for (;;) {
+		char* const begin = reader->buf + reader->start;
+		char* const newline = memchr(begin, '\n', reader->end - reader->start);
+		if (reader->skipping) {
+			/* the rest of an overlong line */
+			if (newline != NULL) {
+				reader->start = (size_t)(newline - reader->buf) + 1;
+				reader->skipping = 0;
+			} else {
+				reader->start = reader->end;
+				if (!fill(reader))
+					return 0;
+			}
+			continue;
+		}
+		if (newline != NULL) {
+			*line = begin;
+			*len = (size_t)(newline - begin);
+			reader->start += *len + 1;
+			return 1;
+		}
+		if (reader->start == 0 && reader->end == PROCFS_CHUNK_SIZE) {
+			*line = begin;
+			*len = PROCFS_CHUNK_SIZE;
+			reader->start = reader->end;
+			reader->skipping = 1;
+			return 1;
+		}
+		if (!fill(reader)) {
+			if (reader->start == reader->end)
+				return 0;
+			/* last line without a newline */
+			*line = begin;
+			*len = reader->end - reader->start;
+			reader->start = reader->end;
+			return 1;
+		}
+	}
+}
+
+int procfs_parse_kb(char const* line, size_t len, char const* name, size_t* bytes) {
+	size_t const name_len = strlen(name);
+	size_t i = name_len, kb = 0;
+	if (len <= name_len || memcmp(line, name, name_len) != 0 || line[name_len] != ':')
+		return 0;
+	for (++i; i < len && (line[i] == ' ' || line[i] == '\t'); ++i)
+		;
+	if (i == len || line[i] < '0' || line[i] > '9')
+		return 0;
+	for (; i < len && line[i] >= '0' && line[i] <= '9'; ++i)
+		kb = kb * 10 + (size_t)(line[i] - '0');
+	*bytes = kb * 1024;
+	return 1;
+}
+
+static char const* const s_smaps_fields[] = {
+	"Rss", "Pss", "Pss_Anon", "Pss_File", "Pss_Shmem",
+	"Shared_Clean", "Shared_Dirty", "Private_Clean", "Private_Dirty",
+	"Anonymous", "Swap", "SwapPss",
+};
+static char const* const s_status_fields[] = { "RssAnon", "RssFile", "RssShmem" };
+
+static int scan_fields(char const* path, char const* const* names, size_t count, memory_field_t first, memory_breakdown_t* breakdown) {
+	procfs_reader_t reader;
+	char const* line;
+	size_t len, i;
+	if (!procfs_open(&reader, path))
+		return 0;
+	while (procfs_next_line(&reader, &line, &len)) {
+		for (i = 0; i < count; ++i) {
+			size_t bytes;
+			if (procfs_parse_kb(line, len, names[i], &bytes)) {
+				/* smaps has one block per mapping; rollup has one block in total */
+				breakdown->bytes[first + i] += bytes;
+				breakdown->found |= 1u << (first + i);
+				break;
+			}
+		}
+	}
+	procfs_close(&reader);
+	return 1;
+}
+
+int get_memory_breakdown(memory_breakdown_t* breakdown) {
+	memset(breakdown, 0, sizeof(*breakdown));
+	breakdown->from_rollup = scan_fields("/proc/self/smaps_rollup", s_smaps_fields,
+	                                     sizeof(s_smaps_fields) / sizeof(s_smaps_fields[0]), MEMORY_RSS, breakdown);
+	if (!breakdown->from_rollup &&
+		!scan_fields("/proc/self/smaps", s_smaps_fields, sizeof(s_smaps_fields) / sizeof(s_smaps_fields[0]), MEMORY_RSS, breakdown))
+		return 0;
+	scan_fields("/proc/self/status", s_status_fields, sizeof(s_status_fields) / sizeof(s_status_fields[0]), MEMORY_RSS_ANON, breakdown);
+	return 1;
+}
@@ -0,0 +1,56 @@
+#ifndef __PROCFS_H
+#define __PROCFS_H
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Line reader over /proc files. The file is read in fixed-size chunks
+ * into the reader itself, so scanning never allocates and never holds
+ * more than one chunk of a large file such as smaps.
+ */
+#define PROCFS_CHUNK_SIZE 4096
+
+typedef struct {
+	int fd;
+	size_t start;
+	size_t end;
+	int skipping;
+	char buf[PROCFS_CHUNK_SIZE];
+} procfs_reader_t;
+
+extern int procfs_open(procfs_reader_t* reader, char const* path);
+extern void procfs_close(procfs_reader_t* reader);
+/* Returns 0 at end of file. Lines longer than a chunk are truncated. */
+extern int procfs_next_line(procfs_reader_t* reader, char const** line, size_t* len);
+/* Parses "Name:   123 kB" lines: returns 1 and the value in bytes when line starts with name. */
+extern int procfs_parse_kb(char const* line, size_t len, char const* name, size_t* bytes);
+
+typedef enum {
+	MEMORY_RSS,
+	MEMORY_PSS,
+	MEMORY_PSS_ANON,
+	MEMORY_PSS_FILE,
+	MEMORY_PSS_SHMEM,
+	MEMORY_SHARED_CLEAN,
+	MEMORY_SHARED_DIRTY,
+	MEMORY_PRIVATE_CLEAN,
+	MEMORY_PRIVATE_DIRTY,
+	MEMORY_ANONYMOUS,
+	MEMORY_SWAP,
+	MEMORY_SWAP_PSS,
+	MEMORY_RSS_ANON,
+	MEMORY_RSS_FILE,
+	MEMORY_RSS_SHMEM,
+	MEMORY_FIELD_COUNT
+} memory_field_t;
+
+typedef struct {
+	size_t bytes[MEMORY_FIELD_COUNT];
+	unsigned int found; /* bit per memory_field_t the kernel reported */
+	int from_rollup; /* 0 when smaps had to be summed */
+} memory_breakdown_t;
+
+/* /proc/self/smaps_rollup (or summed smaps) and /proc/self/status; 0 on failure. */
+extern int get_memory_breakdown(memory_breakdown_t* breakdown);
+
+#endif
@@ -0,0 +1,447 @@
+#include "request_stats.h"
+#include "stack_table.h"
+#include "getrss.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* longer endpoint names are truncated */
+#define ENDPOINT_NAME_MAX 128
+#define REQUEST_STATS_CAPACITY_DEFAULT 100
+#define REQUEST_BUDGET_MAX 256
+/* heaviest stacks kept per incident, and incidents kept */
+#define INCIDENT_STACKS_MAX 16
+#define INCIDENT_LOG_MAX 32
+
+typedef struct {
+	char endpoint[ENDPOINT_NAME_MAX];
+	size_t endpoint_len;
+	uint64_t hash;
+	size_t retained_bytes; /* the space-saving count; may overestimate by up to error */
+	size_t error;
+	size_t requests;
+	size_t allocated_bytes;
+	size_t freed_bytes;
+	ssize_t rss_delta;
+	size_t allocated_objects;
+	ssize_t live_slots_delta;
+	size_t heap_index;
+} endpoint_entry_t;
+
+typedef struct {
+	char endpoint[ENDPOINT_NAME_MAX];
+	size_t endpoint_len;
+	size_t bytes;
+} request_budget_t;
+
+typedef struct {
+	uint32_t stack_id;
+	size_t bytes;
+	size_t count;
+} incident_stack_t;
+
+typedef struct {
+	char endpoint[ENDPOINT_NAME_MAX];
+	size_t endpoint_len;
+	double time; /* seconds since the epoch, at the end of the request */
+	size_t budget;
+	size_t allocated_bytes;
+	incident_stack_t stacks[INCIDENT_STACKS_MAX];
+	size_t stack_count;
+} incident_t;
+
+typedef struct {
+	int active;
+	size_t budget; /* 0 unless request_route armed one */
+	int has_thread_stats;
+	thread_allocation_stats_t thread_stats;
+	size_t rss;
+	size_t allocated_objects;
+	size_t live_slots;
+} request_mark_t;
+
+static VALUE sym_endpoint;
+static VALUE sym_retained_bytes;
+static VALUE sym_error;
+static VALUE sym_requests;
+static VALUE sym_allocated_bytes;
+static VALUE sym_freed_bytes;
+static VALUE sym_rss_delta;
+static VALUE sym_allocated_objects;
+static VALUE sym_live_slots_delta;
+static VALUE sym_total_allocated_objects;
+static VALUE sym_heap_live_slots;
+static VALUE sym_time;
+static VALUE sym_budget;
+static VALUE sym_stacks;
+static VALUE sym_frames;
+static VALUE sym_bytes;
+static VALUE sym_count;
+
+/* guarded by the GVL */
+static endpoint_entry_t* s_entries = NULL;
+static size_t* s_heap = NULL; /* entry indices, min-heap on retained_bytes */
+static size_t s_capacity = 0;
+static size_t s_count = 0;
+/* open addressing from hash to entry index + 1 (0 is empty), at most half full */
+static size_t* s_index = NULL;
+static size_t s_index_mask = 0;
+
+static request_budget_t s_budgets[REQUEST_BUDGET_MAX];
+static size_t s_budget_count = 0;
+
+/* a ring of the latest incidents */
+static incident_t s_incidents[INCIDENT_LOG_MAX];
+static size_t s_incidents_written = 0;
+
+/* Ruby threads are native threads, so the mark can live in TLS */
+static __thread request_mark_t s_mark;
+/* stacks of the current request since it escalated */
+static __thread incident_stack_t s_incident_stacks[INCIDENT_STACKS_MAX];
+static __thread size_t s_incident_stack_count;
+
+static uint64_t hash_name(char const* name, size_t len) {
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
+	return h;
+}
+
+static size_t retained_of(size_t heap_index) {
+	return s_entries[s_heap[heap_index]].retained_bytes;
+}
+
+static void swap_heap(size_t a, size_t b) {
+	size_t const t = s_heap[a];
+	s_heap[a] = s_heap[b];
+	s_heap[b] = t;
+	s_entries[s_heap[a]].heap_index = a;
+	s_entries[s_heap[b]].heap_index = b;
+}
+
+static void sift_up(size_t i) {
+	while (i > 0 && retained_of((i - 1) / 2) > retained_of(i)) {
+		swap_heap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void sift_down(size_t i) {
+	for (;;) {
+		size_t const left = i * 2 + 1, right = left + 1;
+		size_t smallest = i;
+		if (left < s_count && retained_of(left) < retained_of(smallest))
+			smallest = left;
+		if (right < s_count && retained_of(right) < retained_of(smallest))
+			smallest = right;
+		if (smallest == i)
+			return;
+		swap_heap(i, smallest);
+		i = smallest;
+	}
+}
+
+/* Returns the index slot of name, or the empty slot where it would go. */
+static size_t index_slot(char const* name, size_t len, uint64_t hash) {
+	size_t i;
+	for (i = (size_t)hash & s_index_mask; s_index[i] != 0; i = (i + 1) & s_index_mask) {
+		endpoint_entry_t const* const entry = &s_entries[s_index[i] - 1];
+		if (entry->hash == hash && entry->endpoint_len == len && memcmp(entry->endpoint, name, len) == 0)
+			break;
+	}
+	return i;
+}
+
+/* Deletes by shifting later entries of the probe sequence back, so lookups need no tombstones. */
+static void index_remove(size_t i) {
+	size_t j = i;
+	for (;;) {
+		size_t home;
+		j = (j + 1) & s_index_mask;
+		if (s_index[j] == 0)
+			break;
+		home = (size_t)s_entries[s_index[j] - 1].hash & s_index_mask;
+		/* move j back to i unless its home lies cyclically in (i, j] */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		s_index[i] = s_index[j];
+		i = j;
+	}
+	s_index[i] = 0;
+}
+
+/* A new endpoint takes over the smallest slot once all are in use, inheriting its count as error. */
+static endpoint_entry_t* find_endpoint(char const* name, size_t len) {
+	uint64_t const hash = hash_name(name, len);
+	endpoint_entry_t* entry;
+	size_t slot = index_slot(name, len, hash);
+
+	if (s_index[slot] != 0)
+		return &s_entries[s_index[slot] - 1];
+	if (s_count < s_capacity) {
+		entry = &s_entries[s_count];
+		memset(entry, 0, sizeof(*entry));
+		entry->heap_index = s_count;
+		s_heap[s_count] = s_count;
+		s_count += 1;
+		sift_up(entry->heap_index);
+	} else {
+		size_t const error = retained_of(0);
+		entry = &s_entries[s_heap[0]];
+		index_remove(index_slot(entry->endpoint, entry->endpoint_len, entry->hash));
+		/* the removal may have shifted the empty slot found above */
+		slot = index_slot(name, len, hash);
+		memset(entry, 0, sizeof(*entry));
+		entry->retained_bytes = error;
+		entry->error = error;
+		entry->heap_index = 0;
+	}
+	memcpy(entry->endpoint, name, len);
+	entry->endpoint_len = len;
+	entry->hash = hash;
+	s_index[slot] = (size_t)(entry - s_entries) + 1;
+	return entry;
+}
+
+static request_budget_t* find_budget(char const* name, size_t len) {
+	size_t i;
+	for (i = 0; i < s_budget_count; ++i) {
+		if (s_budgets[i].endpoint_len == len && memcmp(s_budgets[i].endpoint, name, len) == 0)
+			return &s_budgets[i];
+	}
+	return NULL;
+}
+
+int set_request_budget(char const* endpoint, size_t len, size_t bytes) {
+	request_budget_t* budget;
+	if (len > ENDPOINT_NAME_MAX)
+		len = ENDPOINT_NAME_MAX;
+	budget = find_budget(endpoint, len);
+	if (bytes == 0) {
+		if (budget != NULL)
+			*budget = s_budgets[--s_budget_count];
+		return 1;
+	}
+	if (budget == NULL) {
+		if (s_budget_count == REQUEST_BUDGET_MAX)
+			return 0;
+		budget = &s_budgets[s_budget_count++];
+		memcpy(budget->endpoint, endpoint, len);
+		budget->endpoint_len = len;
+	}
+	budget->bytes = bytes;
+	return 1;
+}
+
+void request_begin(void) {
+	s_mark.active = 1;
+	s_mark.budget = 0;
+	s_incident_stack_count = 0;
+	s_mark.has_thread_stats = current_thread_allocation_stats(&s_mark.thread_stats);
+	s_mark.rss = getCurrentRSS();
+	s_mark.allocated_objects = rb_gc_stat(sym_total_allocated_objects);
+	s_mark.live_slots = rb_gc_stat(sym_heap_live_slots);
+}
+
+void request_route(char const* endpoint, size_t len) {
+	request_budget_t const* budget;
+	if (!s_mark.active || !s_mark.has_thread_stats || s_budget_count == 0)
+		return;
+	if (len > ENDPOINT_NAME_MAX)
+		len = ENDPOINT_NAME_MAX;
+	budget = find_budget(endpoint, len);
+	if (budget == NULL)
+		budget = find_budget("*", 1);
+	if (budget != NULL && arm_thread_allocation_budget(s_mark.thread_stats.allocated_bytes + budget->bytes))
+		s_mark.budget = budget->bytes;
+}
+
+/* Space-saving again: a new stack takes over the lightest once all slots are in use. */
+void add_incident_stack(uint32_t stack_id, call_summary_t const* summary) {
+	size_t const bytes = summary->alloc_size + summary->realloc_size;
+	size_t const count = summary->alloc_count + summary->realloc_count;
+	size_t i, lightest = 0;
+	for (i = 0; i < s_incident_stack_count; ++i) {
+		if (s_incident_stacks[i].stack_id == stack_id) {
+			s_incident_stacks[i].bytes += bytes;
+			s_incident_stacks[i].count += count;
+			return;
+		}
+		if (s_incident_stacks[i].bytes < s_incident_stacks[lightest].bytes)
+			lightest = i;
+	}
+	if (s_incident_stack_count < INCIDENT_STACKS_MAX) {
+		i = s_incident_stack_count++;
+		s_incident_stacks[i].bytes = 0;
+		s_incident_stacks[i].count = 0;
+	} else {
+		i = lightest;
+	}
+	s_incident_stacks[i].stack_id = stack_id;
+	s_incident_stacks[i].bytes += bytes;
+	s_incident_stacks[i].count += count;
+}
+
+static int compare_incident_bytes_desc(void const* a, void const* b) {
+	size_t const x = ((incident_stack_t const*)a)->bytes;
+	size_t const y = ((incident_stack_t const*)b)->bytes;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void log_incident(char const* endpoint, size_t len, size_t allocated_bytes) {
+	incident_t* const incident = &s_incidents[s_incidents_written++ % INCIDENT_LOG_MAX];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memcpy(incident->endpoint, endpoint, len);
+	incident->endpoint_len = len;
+	incident->time = (double)ts.tv_sec + ts.tv_nsec / 1e9;
+	incident->budget = s_mark.budget;
+	incident->allocated_bytes = allocated_bytes;
+	memcpy(incident->stacks, s_incident_stacks, sizeof(incident_stack_t) * s_incident_stack_count);
+	incident->stack_count = s_incident_stack_count;
+	qsort(incident->stacks, incident->stack_count, sizeof(incident_stack_t), compare_incident_bytes_desc);
+	s_incident_stack_count = 0;
+}
+
+/*
+ * Retained bytes are what the thread malloc'd but didn't free while the
+ * malloc tracer counts, and the RSS growth otherwise.
+ */
+void request_end(char const* endpoint, size_t len) {
+	thread_allocation_stats_t stats;
+	endpoint_entry_t* entry;
+	size_t allocated = 0, freed = 0, retained;
+	ssize_t rss_delta;
+	int has_thread_stats, escalated;
+
+	if (!s_mark.active)
+		return;
+	s_mark.active = 0;
+	/* allocations since the last job run would be lost to the incident once disarmed */
+	if (s_mark.budget != 0)
+		record_thread_sample();
+	escalated = s_mark.budget != 0 && disarm_thread_allocation_budget();
+	rss_delta = (ssize_t)getCurrentRSS() - (ssize_t)s_mark.rss;
+	has_thread_stats = s_mark.has_thread_stats && current_thread_allocation_stats(&stats);
+	if (s_entries == NULL)
+		reset_request_stats(REQUEST_STATS_CAPACITY_DEFAULT);
+	if (has_thread_stats) {
+		allocated = stats.allocated_bytes - s_mark.thread_stats.allocated_bytes;
+		freed = stats.freed_bytes - s_mark.thread_stats.freed_bytes;
+		retained = allocated > freed ? allocated - freed : 0;
+	} else {
+		retained = rss_delta > 0 ? (size_t)rss_delta : 0;
+	}
+	if (len > ENDPOINT_NAME_MAX)
+		len = ENDPOINT_NAME_MAX;
+	if (escalated)
+		log_incident(endpoint, len, allocated);
+
+	entry = find_endpoint(endpoint, len);
+	entry->retained_bytes += retained;
+	entry->requests += 1;
+	entry->allocated_bytes += allocated;
+	entry->freed_bytes += freed;
+	entry->rss_delta += rss_delta;
+	entry->allocated_objects += rb_gc_stat(sym_total_allocated_objects) - s_mark.allocated_objects;
+	entry->live_slots_delta += (ssize_t)rb_gc_stat(sym_heap_live_slots) - (ssize_t)s_mark.live_slots;
+	sift_down(entry->heap_index);
+}
+
+static int compare_retained_desc(void const* a, void const* b) {
+	size_t const x = s_entries[*(size_t const*)a].retained_bytes;
+	size_t const y = s_entries[*(size_t const*)b].retained_bytes;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+VALUE request_stats_to_a(size_t limit) {
+	size_t* order;
+	size_t i;
+	VALUE result;
+
+	if (limit > s_count)
+		limit = s_count;
+	order = ALLOC_N(size_t, s_count > 0 ? s_count : 1);
+	for (i = 0; i < s_count; ++i)
+		order[i] = i;
+	qsort(order, s_count, sizeof(size_t), compare_retained_desc);
+	result = rb_ary_new_capa((long)limit);
+	for (i = 0; i < limit; ++i) {
+		endpoint_entry_t const* const entry = &s_entries[order[i]];
+		VALUE hash = rb_hash_new();
+		rb_hash_aset(hash, sym_endpoint, rb_str_new(entry->endpoint, (long)entry->endpoint_len));
+		rb_hash_aset(hash, sym_retained_bytes, SIZET2NUM(entry->retained_bytes));
+		rb_hash_aset(hash, sym_error, SIZET2NUM(entry->error));
+		rb_hash_aset(hash, sym_requests, SIZET2NUM(entry->requests));
+		rb_hash_aset(hash, sym_allocated_bytes, SIZET2NUM(entry->allocated_bytes));
+		rb_hash_aset(hash, sym_freed_bytes, SIZET2NUM(entry->freed_bytes));
+		rb_hash_aset(hash, sym_rss_delta, SSIZET2NUM(entry->rss_delta));
+		rb_hash_aset(hash, sym_allocated_objects, SIZET2NUM(entry->allocated_objects));
+		rb_hash_aset(hash, sym_live_slots_delta, SSIZET2NUM(entry->live_slots_delta));
+		rb_ary_push(result, hash);
+	}
+	xfree(order);
+	return result;
+}
+
+VALUE request_incidents_to_a(void) {
+	size_t const count = s_incidents_written < INCIDENT_LOG_MAX ? s_incidents_written : INCIDENT_LOG_MAX;
+	VALUE result = rb_ary_new_capa((long)count);
+	size_t i, j;
+	for (i = 0; i < count; ++i) {
+		incident_t const* const incident = &s_incidents[(s_incidents_written - 1 - i) % INCIDENT_LOG_MAX];
+		VALUE hash = rb_hash_new();
+		VALUE stacks = rb_ary_new_capa((long)incident->stack_count);
+		for (j = 0; j < incident->stack_count; ++j) {
+			VALUE stack = rb_hash_new();
+			rb_hash_aset(stack, sym_frames, stack_table_frames_to_a(incident->stacks[j].stack_id));
+			rb_hash_aset(stack, sym_bytes, SIZET2NUM(incident->stacks[j].bytes));
+			rb_hash_aset(stack, sym_count, SIZET2NUM(incident->stacks[j].count));
+			rb_ary_push(stacks, stack);
+		}
+		rb_hash_aset(hash, sym_endpoint, rb_str_new(incident->endpoint, (long)incident->endpoint_len));
+		rb_hash_aset(hash, sym_time, rb_time_new((time_t)incident->time, (long)((incident->time - (time_t)incident->time) * 1e6)));
+		rb_hash_aset(hash, sym_budget, SIZET2NUM(incident->budget));
+		rb_hash_aset(hash, sym_allocated_bytes, SIZET2NUM(incident->allocated_bytes));
+		rb_hash_aset(hash, sym_stacks, stacks);
+		rb_ary_push(result, hash);
+	}
+	return result;
+}
+
+void reset_request_stats(size_t capacity) {
+	size_t index_size = 4;
+	while (index_size < capacity * 2)
+		index_size *= 2;
+	REALLOC_N(s_entries, endpoint_entry_t, capacity);
+	REALLOC_N(s_heap, size_t, capacity);
+	REALLOC_N(s_index, size_t, index_size);
+	memset(s_index, 0, sizeof(size_t) * index_size);
+	s_index_mask = index_size - 1;
+	s_capacity = capacity;
+	s_count = 0;
+}
+
+void init_request_stats(void) {
+#define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
+	DEF_SYM(endpoint);
+	DEF_SYM(retained_bytes);
+	DEF_SYM(error);
+	DEF_SYM(requests);
+	DEF_SYM(allocated_bytes);
+	DEF_SYM(freed_bytes);
+	DEF_SYM(rss_delta);
+	DEF_SYM(allocated_objects);
+	DEF_SYM(live_slots_delta);
+	DEF_SYM(total_allocated_objects);
+	DEF_SYM(heap_live_slots);
+	DEF_SYM(time);
+	DEF_SYM(budget);
+	DEF_SYM(stacks);
+	DEF_SYM(frames);
+	DEF_SYM(bytes);
+	DEF_SYM(count);
+#undef DEF_SYM
+}
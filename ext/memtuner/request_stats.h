@@ -0,0 +1,37 @@
+#ifndef __REQUEST_STATS_H
+#define __REQUEST_STATS_H
+#include <ruby/ruby.h>
+#include "call_info.h"
+
+/*
+ * Memory deltas of requests, aggregated per endpoint. The endpoints with
+ * the most retained bytes are kept with the space-saving algorithm in a
+ * fixed number of slots ordered by a min-heap, so memory stays bounded
+ * however many distinct endpoints there are.
+ *
+ * A request that allocates past its route's budget escalates its thread
+ * to record every allocation with its stack; the heaviest stacks go to a
+ * bounded incident log. Budgets need the malloc tracer's thread counters.
+ * All functions need the GVL.
+ */
+extern void init_request_stats(void);
+
+/* Marks the start of a request on the calling thread. */
+extern void request_begin(void);
+/* Arms the budget of endpoint, once routing has named it. */
+extern void request_route(char const* endpoint, size_t len);
+/* Charges the deltas since request_begin to endpoint; a no-op without one. */
+extern void request_end(char const* endpoint, size_t len);
+/* endpoints by retained bytes, at most limit */
+extern VALUE request_stats_to_a(size_t limit);
+/* drops all endpoints and keeps capacity slots from now on */
+extern void reset_request_stats(size_t capacity);
+
+/* "*" sets the default budget; 0 bytes removes it. Returns 0 when the table is full. */
+extern int set_request_budget(char const* endpoint, size_t len, size_t bytes);
+/* from the allocation job, while the calling thread is escalated */
+extern void add_incident_stack(uint32_t stack_id, call_summary_t const* summary);
+/* newest first */
+extern VALUE request_incidents_to_a(void);
+
+#endif
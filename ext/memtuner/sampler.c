@@ -0,0 +1,237 @@
+#include "sampler.h"
+#include "getrss.h"
+#include "mallinfo.h"
+#include "malloc_info_parser.h"
+#include "background_thread.h"
+#include "gc_hook.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+char const* const sample_field_names[SAMPLE_FIELD_COUNT] = {
+	"rss", "malloc_arena", "malloc_mmap", "malloc_in_use", "malloc_free",
+	"heap_available_slots", "heap_live_slots", "heap_free_slots", "gc_count", "major_gc_count",
+};
+static VALUE sample_field_syms[SAMPLE_FIELD_COUNT];
+static VALUE sym_time;
+
+/* the fields from SAMPLE_HEAP_AVAILABLE_SLOTS are the GC hook's counters, in gc_hook_stat_t order */
+#define GC_FIELD_FIRST SAMPLE_HEAP_AVAILABLE_SLOTS
+#define GC_FIELD_COUNT (SAMPLE_FIELD_COUNT - GC_FIELD_FIRST)
+
+/* the ring and counters are guarded by s_sampler.mutex */
+static background_thread_t s_sampler = BACKGROUND_THREAD_INITIALIZER;
+static unsigned s_interval_ms;
+/* allocated and freed only by start_sampler, with the GVL */
+static sample_t* s_ring = NULL;
+static size_t s_capacity = 0;
+static size_t s_written = 0; /* total samples; the newest is at (s_written - 1) % s_capacity */
+static sample_arena_t s_arenas[SAMPLER_ARENA_MAX];
+static size_t s_arena_count = 0;
+static size_t s_arena_total = 0; /* including arenas past SAMPLER_ARENA_MAX */
+static uint64_t s_arenas_read_ms = 0; /* CLOCK_MONOTONIC; 0 before the first read */
+
+static uint64_t monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void take_sample(sample_t* sample) {
+	struct timespec ts;
+	memtuner_mallinfo_t mi;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	sample->time = (double)ts.tv_sec + ts.tv_nsec / 1e9;
+	sample->values[SAMPLE_RSS] = getCurrentRSS();
+	if (!get_mallinfo(&mi))
+		memset(&mi, 0, sizeof(mi));
+	sample->values[SAMPLE_MALLOC_ARENA] = mi.arena;
+	sample->values[SAMPLE_MALLOC_MMAP] = mi.hblkhd;
+	sample->values[SAMPLE_MALLOC_IN_USE] = mi.uordblks;
+	sample->values[SAMPLE_MALLOC_FREE] = mi.fordblks;
+	for (i = 0; i < GC_FIELD_COUNT; ++i)
+		sample->values[GC_FIELD_FIRST + i] = gc_hook_stat((gc_hook_stat_t)i);
+}
+
+/* Stores the arena count in *total and returns how many fit in arenas. */
+static size_t read_arenas(sample_arena_t* arenas, size_t max, size_t* total) {
+#if HAVE_MALLOC_INFO
+	malloc_info_t info;
+	size_t i, count;
+	*total = 0;
+	if (!read_malloc_info(&info))
+		return 0;
+	*total = info.arena_count;
+	count = info.arena_count < max ? info.arena_count : max;
+	for (i = 0; i < count; ++i) {
+		arenas[i].nr = info.arenas[i].nr;
+		arenas[i].system_bytes = info.arenas[i].system_current;
+		arenas[i].free_bytes = info.arenas[i].fast_size + info.arenas[i].rest_size;
+	}
+	free_malloc_info(&info);
+	return count;
+#else
+	*total = 0;
+	return 0;
+#endif
+}
+
+/* Rereads the arenas when the last read is older than SAMPLER_ARENA_INTERVAL_MS. */
+static void refresh_arenas_if_due(void) {
+	uint64_t const now = monotonic_ms();
+	sample_arena_t arenas[SAMPLER_ARENA_MAX];
+	size_t count, total;
+	int due;
+
+	pthread_mutex_lock(&s_sampler.mutex);
+	due = s_arenas_read_ms == 0 || now - s_arenas_read_ms >= SAMPLER_ARENA_INTERVAL_MS;
+	pthread_mutex_unlock(&s_sampler.mutex);
+	if (!due)
+		return;
+	count = read_arenas(arenas, SAMPLER_ARENA_MAX, &total);
+	pthread_mutex_lock(&s_sampler.mutex);
+	memcpy(s_arenas, arenas, sizeof(sample_arena_t) * count);
+	s_arena_count = count;
+	s_arena_total = total;
+	s_arenas_read_ms = now;
+	pthread_mutex_unlock(&s_sampler.mutex);
+}
+
+static void* sampler(void* arg) {
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	pthread_mutex_lock(&s_sampler.mutex);
+	while (!s_sampler.stopping) {
+		sample_t sample;
+		pthread_mutex_unlock(&s_sampler.mutex);
+		take_sample(&sample);
+		refresh_arenas_if_due();
+		pthread_mutex_lock(&s_sampler.mutex);
+		s_ring[s_written % s_capacity] = sample;
+		s_written += 1;
+
+		/* a fixed schedule, so slow samples don't drift the series */
+		timespec_add_ns(&deadline, (uint64_t)s_interval_ms * 1000000);
+		background_thread_sleep_until(&s_sampler, &deadline);
+	}
+	pthread_mutex_unlock(&s_sampler.mutex);
+	return NULL;
+}
+
+VALUE start_sampler(unsigned interval_ms, size_t capacity) {
+	sample_t* ring;
+	int error;
+
+	if (interval_ms == 0 || capacity == 0)
+		rb_raise(rb_eArgError, "interval_ms and capacity must be positive");
+	if (s_sampler.running)
+		return Qfalse;
+	ring = malloc(sizeof(sample_t) * capacity);
+	if (ring == NULL)
+		rb_raise(rb_eNoMemError, "failed to allocate %zu samples", capacity);
+
+	add_gc_end_listener(NULL);
+	pthread_mutex_lock(&s_sampler.mutex);
+	free(s_ring);
+	s_ring = ring;
+	s_capacity = capacity;
+	s_written = 0;
+	s_interval_ms = interval_ms;
+	pthread_mutex_unlock(&s_sampler.mutex);
+	error = background_thread_start(&s_sampler, sampler);
+	if (error != 0) {
+		remove_gc_end_listener(NULL);
+		rb_syserr_fail(error, "start_sampler");
+	}
+	return Qtrue;
+}
+
+/* The ring is kept, so the history stays readable. */
+VALUE stop_sampler(void) {
+	if (!background_thread_stop(&s_sampler))
+		return Qfalse;
+	remove_gc_end_listener(NULL);
+	return Qtrue;
+}
+
+VALUE sampler_history(double since) {
+	sample_t* samples;
+	size_t count, first, i, j;
+	VALUE columns[SAMPLE_FIELD_COUNT];
+	VALUE times, hash, buffer;
+
+	hash = rb_hash_new();
+	if (s_ring == NULL) {
+		rb_hash_aset(hash, sym_time, rb_ary_new());
+		for (j = 0; j < SAMPLE_FIELD_COUNT; ++j)
+			rb_hash_aset(hash, sample_field_syms[j], rb_ary_new());
+		return hash;
+	}
+	/*
+	 * Copy out first so the sampler isn't held up by Ruby allocations. The
+	 * copy is owned by the GC, so a raising allocation below doesn't leak it.
+	 */
+	samples = ALLOCV_N(sample_t, buffer, s_capacity);
+	pthread_mutex_lock(&s_sampler.mutex);
+	count = s_written < s_capacity ? s_written : s_capacity;
+	first = s_written - count;
+	for (i = 0; i < count; ++i)
+		samples[i] = s_ring[(first + i) % s_capacity];
+	pthread_mutex_unlock(&s_sampler.mutex);
+
+	/* samples are in time order */
+	for (first = 0; first < count && samples[first].time <= since; ++first)
+		;
+	times = rb_ary_new_capa((long)(count - first));
+	for (j = 0; j < SAMPLE_FIELD_COUNT; ++j)
+		columns[j] = rb_ary_new_capa((long)(count - first));
+	for (i = first; i < count; ++i) {
+		rb_ary_push(times, DBL2NUM(samples[i].time));
+		for (j = 0; j < SAMPLE_FIELD_COUNT; ++j)
+			rb_ary_push(columns[j], SIZET2NUM(samples[i].values[j]));
+	}
+	ALLOCV_END(buffer);
+
+	rb_hash_aset(hash, sym_time, times);
+	for (j = 0; j < SAMPLE_FIELD_COUNT; ++j)
+		rb_hash_aset(hash, sample_field_syms[j], columns[j]);
+	return hash;
+}
+
+int sampler_latest(sample_t* sample) {
+	int found;
+	pthread_mutex_lock(&s_sampler.mutex);
+	found = s_sampler.running && s_written > 0;
+	if (found)
+		*sample = s_ring[(s_written - 1) % s_capacity];
+	pthread_mutex_unlock(&s_sampler.mutex);
+	return found;
+}
+
+size_t sampler_arenas(sample_arena_t* arenas, size_t max, size_t* total) {
+	size_t count;
+	if (!s_sampler.running)
+		refresh_arenas_if_due();
+	pthread_mutex_lock(&s_sampler.mutex);
+	count = s_arena_count < max ? s_arena_count : max;
+	memcpy(arenas, s_arenas, sizeof(sample_arena_t) * count);
+	*total = s_arena_total;
+	pthread_mutex_unlock(&s_sampler.mutex);
+	return count;
+}
+
+void sample_now(sample_t* sample) {
+	if (!s_sampler.running)
+		gc_hook_refresh();
+	take_sample(sample);
+}
+
+void init_sampler(void) {
+	int i;
+	sym_time = ID2SYM(rb_intern("time"));
+	for (i = 0; i < SAMPLE_FIELD_COUNT; ++i)
+		sample_field_syms[i] = ID2SYM(rb_intern(sample_field_names[i]));
+}
@@ -0,0 +1,66 @@
+#ifndef __SAMPLER_H
+#define __SAMPLER_H
+#include <ruby/ruby.h>
+#include <stddef.h>
+
+/*
+ * A native thread that samples memory usage every interval into a fixed
+ * ring. Sampling never allocates Ruby objects and never takes the GVL:
+ * the GC counters are copied out by a GC hook, so they are as of the
+ * latest GC.
+ */
+typedef enum {
+	SAMPLE_RSS,
+	SAMPLE_MALLOC_ARENA,    /* mallinfo arena */
+	SAMPLE_MALLOC_MMAP,     /* mallinfo hblkhd */
+	SAMPLE_MALLOC_IN_USE,   /* mallinfo uordblks */
+	SAMPLE_MALLOC_FREE,     /* mallinfo fordblks */
+	SAMPLE_HEAP_AVAILABLE_SLOTS,
+	SAMPLE_HEAP_LIVE_SLOTS,
+	SAMPLE_HEAP_FREE_SLOTS,
+	SAMPLE_GC_COUNT,
+	SAMPLE_MAJOR_GC_COUNT,
+	SAMPLE_FIELD_COUNT
+} sample_field_t;
+
+/* indexed by sample_field_t */
+extern char const* const sample_field_names[SAMPLE_FIELD_COUNT];
+
+typedef struct {
+	double time; /* seconds since the epoch */
+	size_t values[SAMPLE_FIELD_COUNT];
+} sample_t;
+
+/*
+ * The latest per-arena totals are kept alongside, not in the history.
+ * malloc_info locks every arena in turn, so they are read at most every
+ * SAMPLER_ARENA_INTERVAL_MS rather than on every sample.
+ */
+#define SAMPLER_ARENA_MAX 64
+#define SAMPLER_ARENA_INTERVAL_MS 10000
+
+typedef struct {
+	int nr;
+	size_t system_bytes;
+	size_t free_bytes;
+} sample_arena_t;
+
+/* All of these need the GVL. */
+extern void init_sampler(void);
+/* Returns Qfalse when it's already running. */
+extern VALUE start_sampler(unsigned interval_ms, size_t capacity);
+extern VALUE stop_sampler(void);
+/* { time: [...], rss: [...], ... } for samples taken after since (epoch seconds) */
+extern VALUE sampler_history(double since);
+/* Returns 0 when the sampler isn't running or hasn't sampled yet. */
+extern int sampler_latest(sample_t* sample);
+/* Samples on the calling thread, for when the sampler isn't running. */
+extern void sample_now(sample_t* sample);
+/*
+ * Copies the latest arena totals, reading them on the calling thread when
+ * the sampler isn't running and they are due. Returns how many were copied
+ * and stores the number of arenas, which may be more, in *total.
+ */
+extern size_t sampler_arenas(sample_arena_t* arenas, size_t max, size_t* total);
+
+#endif
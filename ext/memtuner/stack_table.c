@@ -0,0 +1,217 @@
+#include "stack_table.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ruby/debug.h>
+
+typedef struct {
+	VALUE frame;
+	int line;
+	VALUE label; /* Qnil until a report resolves it */
+} frame_entry_t;
+
+typedef struct {
+	uint64_t hash;
+	size_t frame_offset; /* index into s_stack_frames */
+	int depth;
+} stack_entry_t;
+
+/* open addressing index: id + 1, 0 for empty */
+typedef struct {
+	uint32_t* slots;
+	size_t capacity;
+} id_index_t;
+
+static frame_entry_t* s_frames = NULL;
+static size_t s_frame_count = 0;
+static size_t s_frame_capacity = 0;
+static id_index_t s_frame_index;
+
+static stack_entry_t* s_stacks = NULL;
+static size_t s_stack_count = 0;
+static size_t s_stack_capacity = 0;
+static id_index_t s_stack_index;
+
+/* frame ids of all stacks, back to back */
+static uint32_t* s_stack_frames = NULL;
+static size_t s_stack_frame_count = 0;
+static size_t s_stack_frame_capacity = 0;
+
+static VALUE s_holder;
+
+static void stack_table_mark(void* ptr) {
+	size_t i;
+	for (i = 0; i < s_frame_count; ++i) {
+		rb_gc_mark(s_frames[i].frame);
+		rb_gc_mark(s_frames[i].label);
+	}
+}
+
+static rb_data_type_t const s_holder_type = {
+	"memtuner_stack_table",
+	{ stack_table_mark, NULL, NULL, },
+	0, 0, 0,
+};
+
+static uint64_t hash_mix(uint64_t h, uint64_t n) {
+	return (h ^ n) * 1099511628211ULL;
+}
+
+static uint64_t hash_frame(VALUE frame, int line) {
+	return hash_mix(hash_mix(14695981039346656037ULL, (uint64_t)frame), (uint32_t)line);
+}
+
+static uint64_t hash_stack(uint32_t const* frame_ids, int depth) {
+	uint64_t h = 14695981039346656037ULL;
+	int i;
+	for (i = 0; i < depth; ++i)
+		h = hash_mix(h, frame_ids[i]);
+	return h;
+}
+
+static uint64_t frame_hash_of(uint32_t id) {
+	return hash_frame(s_frames[id].frame, s_frames[id].line);
+}
+
+static uint64_t stack_hash_of(uint32_t id) {
+	return s_stacks[id].hash;
+}
+
+/* keeps the load factor at or below 1/2 */
+static int reserve_index(id_index_t* index, size_t count, uint64_t (*hash_of)(uint32_t)) {
+	size_t capacity = index->capacity ? index->capacity * 2 : 1024;
+	uint32_t* slots;
+	size_t i;
+	if ((count + 1) * 2 <= index->capacity)
+		return 1;
+	slots = calloc(capacity, sizeof(uint32_t));
+	if (slots == NULL)
+		return 0;
+	for (i = 0; i < count; ++i) {
+		size_t j = (size_t)hash_of((uint32_t)i) & (capacity - 1);
+		while (slots[j] != 0)
+			j = (j + 1) & (capacity - 1);
+		slots[j] = (uint32_t)(i + 1);
+	}
+	free(index->slots);
+	index->slots = slots;
+	index->capacity = capacity;
+	return 1;
+}
+
+static int reserve(void** ptr, size_t* capacity, size_t count, size_t element_size, size_t initial) {
+	size_t new_capacity = *capacity ? *capacity : initial;
+	void* p;
+	if (count <= *capacity)
+		return 1;
+	while (new_capacity < count)
+		new_capacity *= 2;
+	p = realloc(*ptr, element_size * new_capacity);
+	if (p == NULL)
+		return 0;
+	*ptr = p;
+	*capacity = new_capacity;
+	return 1;
+}
+
+static uint32_t intern_frame(VALUE frame, int line) {
+	uint64_t const hash = hash_frame(frame, line);
+	size_t i;
+
+	if (!reserve_index(&s_frame_index, s_frame_count, frame_hash_of))
+		return STACK_ID_INVALID;
+	for (i = (size_t)hash & (s_frame_index.capacity - 1); s_frame_index.slots[i] != 0; i = (i + 1) & (s_frame_index.capacity - 1)) {
+		frame_entry_t const* entry = &s_frames[s_frame_index.slots[i] - 1];
+		if (entry->frame == frame && entry->line == line)
+			return s_frame_index.slots[i] - 1;
+	}
+	if (!reserve((void**)&s_frames, &s_frame_capacity, s_frame_count + 1, sizeof(frame_entry_t), 1024))
+		return STACK_ID_INVALID;
+	s_frames[s_frame_count].frame = frame;
+	s_frames[s_frame_count].line = line;
+	s_frames[s_frame_count].label = Qnil;
+	s_frame_index.slots[i] = (uint32_t)(s_frame_count + 1);
+	return (uint32_t)s_frame_count++;
+}
+
+#define INTERN_STACK_DEPTH_MAX 2048
+
+uint32_t intern_stack(VALUE const* frames, int const* lines, int depth) {
+	uint32_t frame_ids[INTERN_STACK_DEPTH_MAX];
+	uint64_t hash;
+	size_t i;
+	int d;
+
+	if (depth > INTERN_STACK_DEPTH_MAX)
+		depth = INTERN_STACK_DEPTH_MAX;
+	for (d = 0; d < depth; ++d) {
+		frame_ids[d] = intern_frame(frames[d], lines[d]);
+		if (frame_ids[d] == STACK_ID_INVALID)
+			return STACK_ID_INVALID;
+	}
+	hash = hash_stack(frame_ids, depth);
+
+	if (!reserve_index(&s_stack_index, s_stack_count, stack_hash_of))
+		return STACK_ID_INVALID;
+	for (i = (size_t)hash & (s_stack_index.capacity - 1); s_stack_index.slots[i] != 0; i = (i + 1) & (s_stack_index.capacity - 1)) {
+		stack_entry_t const* entry = &s_stacks[s_stack_index.slots[i] - 1];
+		if (entry->hash == hash && entry->depth == depth &&
+			memcmp(s_stack_frames + entry->frame_offset, frame_ids, sizeof(uint32_t) * depth) == 0)
+			return s_stack_index.slots[i] - 1;
+	}
+
+	if (!reserve((void**)&s_stacks, &s_stack_capacity, s_stack_count + 1, sizeof(stack_entry_t), 512) ||
+		!reserve((void**)&s_stack_frames, &s_stack_frame_capacity, s_stack_frame_count + depth, sizeof(uint32_t), 4096))
+		return STACK_ID_INVALID;
+	s_stacks[s_stack_count].hash = hash;
+	s_stacks[s_stack_count].frame_offset = s_stack_frame_count;
+	s_stacks[s_stack_count].depth = depth;
+	memcpy(s_stack_frames + s_stack_frame_count, frame_ids, sizeof(uint32_t) * depth);
+	s_stack_frame_count += depth;
+	s_stack_index.slots[i] = (uint32_t)(s_stack_count + 1);
+	return (uint32_t)s_stack_count++;
+}
+
+size_t stack_table_count(void) {
+	return s_stack_count;
+}
+
+int stack_table_depth(uint32_t stack_id) {
+	return s_stacks[stack_id].depth;
+}
+
+uint32_t const* stack_table_frame_ids(uint32_t stack_id) {
+	return s_stack_frames + s_stacks[stack_id].frame_offset;
+}
+
+VALUE stack_table_frame_label(uint32_t frame_id) {
+	frame_entry_t* const entry = &s_frames[frame_id];
+	if (NIL_P(entry->label)) {
+		VALUE file = rb_profile_frame_absolute_path(entry->frame);
+		VALUE label;
+		if (NIL_P(file))
+			file = rb_profile_frame_path(entry->frame);
+		label = NIL_P(file) ? rb_str_new_cstr("(unknown)") : rb_str_dup(file);
+		if (entry->line > 0)
+			rb_str_catf(label, ":%d", entry->line);
+		rb_str_cat_cstr(label, " ");
+		rb_str_append(label, rb_profile_frame_full_label(entry->frame));
+		entry->label = rb_obj_freeze(label);
+	}
+	return entry->label;
+}
+
+VALUE stack_table_frames_to_a(uint32_t stack_id) {
+	int const depth = stack_table_depth(stack_id);
+	uint32_t const* const frame_ids = stack_table_frame_ids(stack_id);
+	VALUE frames = rb_ary_new_capa(depth);
+	int i;
+	for (i = 0; i < depth; ++i)
+		rb_ary_push(frames, stack_table_frame_label(frame_ids[i]));
+	return frames;
+}
+
+void init_stack_table(void) {
+	/* T_DATA with a NULL pointer is never marked */
+	s_holder = TypedData_Wrap_Struct(0, &s_holder_type, &s_frames);
+	rb_gc_register_mark_object(s_holder);
+}
@@ -0,0 +1,22 @@
+#ifndef __STACK_TABLE_H
+#define __STACK_TABLE_H
+#include <stdint.h>
+#include <ruby/ruby.h>
+
+/*
+ * Interns rb_profile_frames results. A frame (VALUE + line) becomes a
+ * small integer id and a stack becomes an array of frame ids, so stacks
+ * are cheap to hash and compare. Labels are resolved only when a report
+ * asks for them. All functions must be called with the GVL held.
+ */
+#define STACK_ID_INVALID UINT32_MAX
+
+extern void init_stack_table(void);
+extern uint32_t intern_stack(VALUE const* frames, int const* lines, int depth);
+extern size_t stack_table_count(void);
+extern int stack_table_depth(uint32_t stack_id);
+extern uint32_t const* stack_table_frame_ids(uint32_t stack_id);
+extern VALUE stack_table_frame_label(uint32_t frame_id);
+extern VALUE stack_table_frames_to_a(uint32_t stack_id);
+
+#endif
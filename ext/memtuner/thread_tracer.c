@@ -1,12 +1,27 @@
 #include "function_hook.h"
 #include "debug.h"
+#include "call_info.h"
+#include <stdlib.h>
 #include <pthread.h>
+#include <ruby/ruby.h>
 
 typedef int (*pthread_create_t)(pthread_t* thread, pthread_attr_t* attr, void* (*start_routine)(void*), void* arg);
-typedef void (*pthread_exit_t)(void* retval);
 
 static pthread_create_t original_pthread_create;
-static pthread_exit_t original_pthread_exit;
+
+static VALUE sym_thread;
+static VALUE sym_native_thread_id;
+static VALUE sym_allocated_bytes;
+static VALUE sym_freed_bytes;
+static VALUE sym_alloc_count;
+static VALUE sym_free_count;
+static VALUE sym_live_bytes;
+static VALUE sym_peak_live_bytes;
+
+typedef struct {
+    void* (*start_routine)(void*);
+    void* arg;
+} thread_start_t;
 
 static void* dummy_thread_func(void* arg){
     pthread_exit(NULL);
@@ -18,17 +33,29 @@ static void resolve_function_pointers() {
     pthread_join(thread, NULL);
 }
 
-static int pthread_create_hook(pthread_t* thread, pthread_attr_t* attr, void* (*start_routine)(void*), void* arg) {
-    memtuner_debug_print("pthread_create: ");
-    memtuner_debug_print_hex("start_routine=", (uintptr_t)start_routine);
-    memtuner_debug_println_hex(", arg=", (uintptr_t)arg);
-    return original_pthread_create(thread, attr, start_routine, arg);
+/*
+ * Registers the tracing buffer before the thread's first allocation. The
+ * buffer is released by its pthread key destructor, which runs both when
+ * the thread returns and when it calls pthread_exit.
+ */
+static void* thread_start_hook(void* p) {
+    thread_start_t const start = *(thread_start_t*)p;
+    find_call_info_buffer();
+    free(p);
+    return start.start_routine(start.arg);
 }
 
-static void pthread_exit_hook(void* retval) {
-    memtuner_debug_print("pthread_exit: ");
-    memtuner_debug_println_hex("retval=", (uintptr_t)retval);
-    original_pthread_exit(retval);
+static int pthread_create_hook(pthread_t* thread, pthread_attr_t* attr, void* (*start_routine)(void*), void* arg) {
+    thread_start_t* start = malloc(sizeof(thread_start_t));
+    int ret;
+    if (start == NULL)
+        return original_pthread_create(thread, attr, start_routine, arg);
+    start->start_routine = start_routine;
+    start->arg = arg;
+    ret = original_pthread_create(thread, attr, thread_start_hook, start);
+    if (ret != 0)
+        free(start);
+    return ret;
 }
 
 #define DUMP_HOOK_RESULT(name) if (original_ ## name) { memtuner_debug_print("memtuner: " #name ": hook succeeded.\n"); } else { memtuner_debug_print("memtuner: "#name ": hook faild.\n"); }
@@ -38,6 +65,52 @@ void init_thread_tracer(void) {
     resolve_function_pointers();
     original_pthread_create = hook_function(pthread_create, pthread_create_hook);
     DUMP_HOOK_RESULT(pthread_create);
-    original_pthread_exit = hook_function(pthread_exit, pthread_exit_hook);
-    DUMP_HOOK_RESULT(pthread_exit);
+}
+
+void init_thread_allocation_stats(void) {
+#define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
+    DEF_SYM(thread);
+    DEF_SYM(native_thread_id);
+    DEF_SYM(allocated_bytes);
+    DEF_SYM(freed_bytes);
+    DEF_SYM(alloc_count);
+    DEF_SYM(free_count);
+    DEF_SYM(live_bytes);
+    DEF_SYM(peak_live_bytes);
+#undef DEF_SYM
+}
+
+/*
+ * A native thread is mapped to the Thread that last ran a sample on it;
+ * threads that never did (or are not Ruby threads) report thread: nil.
+ */
+VALUE thread_allocation_stats_to_a(void) {
+    thread_allocation_entry_t* entries;
+    size_t const count = collect_thread_allocation_stats(&entries);
+    VALUE threads, ary;
+    size_t i;
+
+    if (entries == NULL)
+        rb_raise(rb_eNoMemError, "failed to allocate thread allocation stats");
+    threads = rb_funcall(rb_cThread, rb_intern("list"), 0);
+    ary = rb_ary_new_capa(count);
+    for (i = 0; i < count; ++i) {
+        thread_allocation_stats_t const* stats = &entries[i].stats;
+        VALUE hash = rb_hash_new();
+        VALUE thread = entries[i].ruby_thread;
+        /* the recorded Thread may have finished on a reused native thread; only hand out live ones */
+        if (NIL_P(thread) || !RTEST(rb_ary_includes(threads, thread)))
+            thread = Qnil;
+        rb_hash_aset(hash, sym_thread, thread);
+        rb_hash_aset(hash, sym_native_thread_id, INT2NUM(entries[i].tid));
+        rb_hash_aset(hash, sym_allocated_bytes, SIZET2NUM(stats->allocated_bytes));
+        rb_hash_aset(hash, sym_freed_bytes, SIZET2NUM(stats->freed_bytes));
+        rb_hash_aset(hash, sym_alloc_count, SIZET2NUM(stats->alloc_count));
+        rb_hash_aset(hash, sym_free_count, SIZET2NUM(stats->free_count));
+        rb_hash_aset(hash, sym_live_bytes, SSIZET2NUM((ssize_t)(stats->allocated_bytes - stats->freed_bytes)));
+        rb_hash_aset(hash, sym_peak_live_bytes, SIZET2NUM(stats->peak_live_bytes));
+        rb_ary_push(ary, hash);
+    }
+    free(entries);
+    return ary;
 }
@@ -1 +1,8 @@
+#include <ruby/ruby.h>
+
 extern void init_thread_tracer(void);
+
+/* with the GVL held */
+extern void init_thread_allocation_stats(void);
+/* Cumulative allocation counters of each live native thread. */
+extern VALUE thread_allocation_stats_to_a(void);
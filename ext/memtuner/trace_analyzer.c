@@ -0,0 +1,1054 @@
+#include "trace_analyzer.h"
+#include "trace_format.h"
+#include "call_info_encoding.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ruby/thread.h>
+
+/* how much of the file is mapped at once; a larger chunk gets a larger window */
+#define ANALYZER_WINDOW ((size_t)64 << 20)
+/* unresolved allocations kept per owner; later ones go to the unknown stack */
+#define ANALYZER_PENDING_MAX 65536
+#define ANALYZER_LIVE_MIN ((size_t)1 << 16)
+/* bucket b holds lifetimes in [2^(b-1), 2^b) microseconds */
+#define LIFETIME_BUCKETS 48
+#define TIMELINE_FIRST_WIDTH_NS 1000000ULL
+
+#define INDEX_EMPTY UINT32_MAX
+#define UNKNOWN_STACK 0
+#define PENDING_STACK UINT32_MAX
+#define LIVE_KEY_EMPTY ((uintptr_t)0)
+#define LIVE_KEY_DELETED ((uintptr_t)1)
+
+typedef struct {
+	uint8_t* data;
+	size_t len; /* in bytes */
+	size_t capacity;
+} vec_t;
+
+typedef struct {
+	uint32_t index;
+	uint32_t hash;
+} index_slot_t;
+
+/* indices into a vec_t, found by hash and an equality callback */
+typedef struct {
+	index_slot_t* slots;
+	size_t capacity;
+	size_t count;
+} index_table_t;
+
+typedef struct {
+	size_t offset; /* in the label arena */
+	size_t len;
+} trace_frame_t;
+
+typedef struct {
+	size_t offset; /* in the frame id arena */
+	uint32_t depth;
+	uint64_t allocated_bytes;
+	uint64_t allocations;
+	uint64_t retained_bytes;
+	uint64_t peak_retained_bytes;
+} trace_stack_t;
+
+typedef struct {
+	uint32_t owner;
+	uint64_t pending_bytes;
+	uint64_t pending_allocations;
+	vec_t pending_ptrs; /* uintptr_t */
+} trace_owner_t;
+
+typedef struct {
+	uintptr_t key;
+	size_t size;
+	uint64_t time;
+	uint32_t stack; /* PENDING_STACK until the owner's next STACK record */
+	uint32_t owner;
+} trace_live_t;
+
+typedef struct {
+	int set;
+	uint64_t peak_live;
+	uint64_t last_live;
+	int64_t peak_mapped;
+	int64_t last_mapped;
+} timeline_bucket_t;
+
+typedef struct {
+	uint8_t const* data;
+	size_t len;
+	size_t pos;
+	int bad;
+} cursor_t;
+
+typedef struct {
+	/* input */
+	char const* path;
+	size_t points;
+	int interrupted;
+	int error; /* errno */
+	char const* message; /* a malformed file */
+	int truncated;
+
+	int fd;
+	off_t size;
+	uint8_t* window;
+	off_t window_offset;
+	size_t window_len;
+
+	/* global dictionaries; stack 0 is the unknown stack */
+	vec_t labels;
+	vec_t frames; /* trace_frame_t */
+	index_table_t frame_index;
+	vec_t frame_ids; /* uint32_t */
+	vec_t stacks; /* trace_stack_t */
+	index_table_t stack_index;
+	/* ids of the current session to global ids */
+	vec_t session_frames; /* uint32_t */
+	vec_t session_stacks; /* uint32_t */
+
+	vec_t owners; /* trace_owner_t */
+	index_table_t owner_index;
+	uint32_t current_owner; /* index in owners */
+
+	trace_live_t* live;
+	size_t live_capacity;
+	size_t live_count;
+	size_t live_used; /* live and deleted */
+
+	uint64_t sessions;
+	uint64_t events;
+	uint64_t pid;
+	uint64_t session_start;
+	uint64_t origin;
+	uint64_t now;
+	uint64_t live_bytes;
+	int64_t mapped_bytes;
+	uint64_t lifetime_count[LIFETIME_BUCKETS];
+	uint64_t lifetime_bytes[LIFETIME_BUCKETS];
+
+	timeline_bucket_t* timeline;
+	size_t timeline_len;
+	uint64_t timeline_width;
+} analyzer_t;
+
+static VALUE sym_sessions;
+static VALUE sym_events;
+static VALUE sym_duration;
+static VALUE sym_truncated;
+static VALUE sym_timeline;
+static VALUE sym_time;
+static VALUE sym_live_bytes;
+static VALUE sym_mapped_bytes;
+static VALUE sym_top_allocating;
+static VALUE sym_top_retaining;
+static VALUE sym_frames;
+static VALUE sym_allocated_bytes;
+static VALUE sym_allocations;
+static VALUE sym_retained_bytes;
+static VALUE sym_peak_retained_bytes;
+static VALUE sym_lifetimes;
+static VALUE sym_max_us;
+static VALUE sym_count;
+static VALUE sym_bytes;
+static VALUE sym_live_at_end;
+static VALUE sym_folded;
+
+static void* vec_push(analyzer_t* a, vec_t* vec, size_t bytes) {
+	if (vec->len + bytes > vec->capacity) {
+		size_t capacity = vec->capacity ? vec->capacity * 2 : 4096;
+		uint8_t* data;
+		while (capacity < vec->len + bytes)
+			capacity *= 2;
+		data = realloc(vec->data, capacity);
+		if (data == NULL) {
+			a->error = ENOMEM;
+			return NULL;
+		}
+		vec->data = data;
+		vec->capacity = capacity;
+	}
+	vec->len += bytes;
+	return vec->data + vec->len - bytes;
+}
+
+#define VEC_AT(vec, type, i) (((type*)(vec).data)[i])
+#define VEC_COUNT(vec, type) ((vec).len / sizeof(type))
+
+static uint32_t hash_bytes(void const* p, size_t len) {
+	uint8_t const* bytes = p;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+	for (i = 0; i < len; ++i)
+		h = (h ^ bytes[i]) * 0x100000001b3ULL;
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+typedef int (*index_equal_t)(analyzer_t* a, uint32_t index, void const* key);
+
+/* Returns the index equal to key, or adds new_index for it. INDEX_EMPTY when out of memory. */
+static uint32_t index_find_or_add(analyzer_t* a, index_table_t* table, uint32_t hash, index_equal_t equal, void const* key, uint32_t new_index) {
+	size_t i;
+	if ((table->count + 1) * 2 > table->capacity) {
+		size_t const capacity = table->capacity ? table->capacity * 2 : 1024;
+		index_slot_t* slots = malloc(capacity * sizeof(index_slot_t));
+		size_t j;
+		if (slots == NULL) {
+			a->error = ENOMEM;
+			return INDEX_EMPTY;
+		}
+		for (j = 0; j < capacity; ++j)
+			slots[j].index = INDEX_EMPTY;
+		for (j = 0; j < table->capacity; ++j) {
+			if (table->slots[j].index == INDEX_EMPTY)
+				continue;
+			for (i = table->slots[j].hash & (capacity - 1); slots[i].index != INDEX_EMPTY; i = (i + 1) & (capacity - 1))
+				;
+			slots[i] = table->slots[j];
+		}
+		free(table->slots);
+		table->slots = slots;
+		table->capacity = capacity;
+	}
+	for (i = hash & (table->capacity - 1); table->slots[i].index != INDEX_EMPTY; i = (i + 1) & (table->capacity - 1)) {
+		if (table->slots[i].hash == hash && equal(a, table->slots[i].index, key))
+			return table->slots[i].index;
+	}
+	table->slots[i].index = new_index;
+	table->slots[i].hash = hash;
+	++table->count;
+	return new_index;
+}
+
+typedef struct {
+	uint8_t const* bytes;
+	size_t len;
+} label_key_t;
+
+static int frame_equal(analyzer_t* a, uint32_t index, void const* key) {
+	label_key_t const* const label = key;
+	trace_frame_t const* const frame = &VEC_AT(a->frames, trace_frame_t, index);
+	return frame->len == label->len && memcmp(a->labels.data + frame->offset, label->bytes, label->len) == 0;
+}
+
+typedef struct {
+	uint32_t const* ids;
+	uint32_t depth;
+} stack_key_t;
+
+static int stack_equal(analyzer_t* a, uint32_t index, void const* key) {
+	stack_key_t const* const ids = key;
+	trace_stack_t const* const stack = &VEC_AT(a->stacks, trace_stack_t, index);
+	return index != UNKNOWN_STACK && stack->depth == ids->depth &&
+		memcmp(a->frame_ids.data + stack->offset, ids->ids, ids->depth * sizeof(uint32_t)) == 0;
+}
+
+static int owner_equal(analyzer_t* a, uint32_t index, void const* key) {
+	return VEC_AT(a->owners, trace_owner_t, index).owner == *(uint32_t const*)key;
+}
+
+/* Maps id to value in a session map, growing it with INDEX_EMPTY. */
+static void session_map_set(analyzer_t* a, vec_t* map, uint64_t id, uint32_t value) {
+	if (id >= UINT32_MAX)
+		return;
+	while (VEC_COUNT(*map, uint32_t) <= id) {
+		uint32_t* const p = vec_push(a, map, sizeof(uint32_t));
+		if (p == NULL)
+			return;
+		*p = INDEX_EMPTY;
+	}
+	VEC_AT(*map, uint32_t, id) = value;
+}
+
+static uint32_t session_map_get(vec_t const* map, uint64_t id) {
+	return id < VEC_COUNT(*map, uint32_t) ? VEC_AT(*map, uint32_t, id) : INDEX_EMPTY;
+}
+
+static uint64_t next_varint(cursor_t* cursor) {
+	uint64_t n = 0;
+	int shift = 0;
+	for (;;) {
+		uint8_t byte;
+		if (cursor->pos >= cursor->len) {
+			cursor->bad = 1;
+			return 0;
+		}
+		byte = cursor->data[cursor->pos++];
+		n |= (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0 || shift >= 63)
+			return n;
+		shift += 7;
+	}
+}
+
+static uint32_t get_u32(uint8_t const* in) {
+	return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+/* timeline */
+
+static void note_timeline(analyzer_t* a) {
+	uint64_t const t = a->now - a->origin;
+	timeline_bucket_t* bucket;
+	size_t i = (size_t)(t / a->timeline_width);
+
+	/* halve the resolution instead of growing; with odd points the last bucket has no pair */
+	while (i >= a->points) {
+		size_t const half = (a->points + 1) / 2;
+		size_t j;
+		for (j = 0; j < half; ++j) {
+			timeline_bucket_t const* const l = &a->timeline[2 * j];
+			timeline_bucket_t const* const r = 2 * j + 1 < a->points ? &a->timeline[2 * j + 1] : NULL;
+			timeline_bucket_t merged = *l;
+			if (r != NULL && r->set) {
+				if (!merged.set || r->peak_live > merged.peak_live)
+					merged.peak_live = r->peak_live;
+				if (!merged.set || r->peak_mapped > merged.peak_mapped)
+					merged.peak_mapped = r->peak_mapped;
+				merged.last_live = r->last_live;
+				merged.last_mapped = r->last_mapped;
+				merged.set = 1;
+			}
+			a->timeline[j] = merged;
+		}
+		memset(&a->timeline[half], 0, (a->points - half) * sizeof(timeline_bucket_t));
+		a->timeline_len = (a->timeline_len + 1) / 2;
+		a->timeline_width *= 2;
+		i = (size_t)(t / a->timeline_width);
+	}
+	bucket = &a->timeline[i];
+	if (!bucket->set || a->live_bytes > bucket->peak_live)
+		bucket->peak_live = a->live_bytes;
+	if (!bucket->set || a->mapped_bytes > bucket->peak_mapped)
+		bucket->peak_mapped = a->mapped_bytes;
+	bucket->last_live = a->live_bytes;
+	bucket->last_mapped = a->mapped_bytes;
+	bucket->set = 1;
+	if (i + 1 > a->timeline_len)
+		a->timeline_len = i + 1;
+}
+
+/* live allocations */
+
+static size_t live_home(size_t capacity, uintptr_t key) {
+	return (size_t)(((uint64_t)(key >> 4) * 0x9E3779B97F4A7C15ULL) >> 20) & (capacity - 1);
+}
+
+static int rebuild_live(analyzer_t* a) {
+	size_t capacity = a->live_capacity ? a->live_capacity : ANALYZER_LIVE_MIN;
+	trace_live_t* entries;
+	size_t i;
+	while (a->live_count * 4 >= capacity)
+		capacity *= 2;
+	entries = calloc(capacity, sizeof(trace_live_t));
+	if (entries == NULL) {
+		a->error = ENOMEM;
+		return 0;
+	}
+	for (i = 0; i < a->live_capacity; ++i) {
+		size_t j;
+		if (a->live[i].key <= LIVE_KEY_DELETED)
+			continue;
+		for (j = live_home(capacity, a->live[i].key); entries[j].key != LIVE_KEY_EMPTY; j = (j + 1) & (capacity - 1))
+			;
+		entries[j] = a->live[i];
+	}
+	free(a->live);
+	a->live = entries;
+	a->live_capacity = capacity;
+	a->live_used = a->live_count;
+	return 1;
+}
+
+static trace_live_t* find_live(analyzer_t* a, uintptr_t key) {
+	size_t i;
+	if (a->live_capacity == 0 || key <= LIVE_KEY_DELETED)
+		return NULL;
+	for (i = live_home(a->live_capacity, key); a->live[i].key != LIVE_KEY_EMPTY; i = (i + 1) & (a->live_capacity - 1)) {
+		if (a->live[i].key == key)
+			return &a->live[i];
+	}
+	return NULL;
+}
+
+static void add_retained(analyzer_t* a, uint32_t stack_id, size_t size) {
+	trace_stack_t* const stack = &VEC_AT(a->stacks, trace_stack_t, stack_id);
+	stack->retained_bytes += size;
+	if (stack->retained_bytes > stack->peak_retained_bytes)
+		stack->peak_retained_bytes = stack->retained_bytes;
+}
+
+static void note_lifetime(analyzer_t* a, uint64_t ns, size_t size) {
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+	while (us > 0 && bucket < LIFETIME_BUCKETS - 1) {
+		us >>= 1;
+		++bucket;
+	}
+	++a->lifetime_count[bucket];
+	a->lifetime_bytes[bucket] += size;
+}
+
+static void remove_live(analyzer_t* a, trace_live_t* entry, int freed) {
+	if (entry->stack != PENDING_STACK)
+		VEC_AT(a->stacks, trace_stack_t, entry->stack).retained_bytes -= entry->size;
+	if (freed)
+		note_lifetime(a, a->now - entry->time, entry->size);
+	a->live_bytes -= entry->size;
+	entry->key = LIVE_KEY_DELETED;
+	--a->live_count;
+}
+
+static void add_live(analyzer_t* a, uintptr_t key, size_t size, uint64_t time) {
+	trace_owner_t* const owner = a->current_owner == INDEX_EMPTY ? NULL : &VEC_AT(a->owners, trace_owner_t, a->current_owner);
+	trace_live_t* deleted = NULL;
+	trace_live_t* entry = NULL;
+	size_t i;
+
+	if (key <= LIVE_KEY_DELETED)
+		return;
+	if ((a->live_used + 1) * 4 >= a->live_capacity * 3 && !rebuild_live(a))
+		return;
+	for (i = live_home(a->live_capacity, key); a->live[i].key != LIVE_KEY_EMPTY; i = (i + 1) & (a->live_capacity - 1)) {
+		if (a->live[i].key == key) {
+			/* the address was reused; its free wasn't traced */
+			remove_live(a, &a->live[i], 0);
+			entry = &a->live[i];
+			break;
+		}
+		if (a->live[i].key == LIVE_KEY_DELETED && deleted == NULL)
+			deleted = &a->live[i];
+	}
+	if (entry == NULL && deleted != NULL)
+		entry = deleted;
+	if (entry == NULL) {
+		entry = &a->live[i];
+		++a->live_used;
+	}
+	entry->key = key;
+	entry->size = size;
+	entry->time = time;
+	++a->live_count;
+	a->live_bytes += size;
+
+	if (owner != NULL && VEC_COUNT(owner->pending_ptrs, uintptr_t) < ANALYZER_PENDING_MAX) {
+		uintptr_t* const p = vec_push(a, &owner->pending_ptrs, sizeof(uintptr_t));
+		if (p != NULL) {
+			*p = key;
+			entry->stack = PENDING_STACK;
+			entry->owner = owner->owner;
+			owner->pending_bytes += size;
+			++owner->pending_allocations;
+			return;
+		}
+	}
+	entry->stack = UNKNOWN_STACK;
+	entry->owner = 0;
+	VEC_AT(a->stacks, trace_stack_t, UNKNOWN_STACK).allocated_bytes += size;
+	++VEC_AT(a->stacks, trace_stack_t, UNKNOWN_STACK).allocations;
+	add_retained(a, UNKNOWN_STACK, size);
+}
+
+/* The owner's allocations since its previous STACK record were made at stack_id. */
+static void resolve_owner(analyzer_t* a, trace_owner_t* owner, uint32_t stack_id) {
+	trace_stack_t* const stack = &VEC_AT(a->stacks, trace_stack_t, stack_id);
+	size_t const count = VEC_COUNT(owner->pending_ptrs, uintptr_t);
+	size_t i;
+
+	stack->allocated_bytes += owner->pending_bytes;
+	stack->allocations += owner->pending_allocations;
+	for (i = 0; i < count; ++i) {
+		trace_live_t* const entry = find_live(a, VEC_AT(owner->pending_ptrs, uintptr_t, i));
+		if (entry != NULL && entry->stack == PENDING_STACK && entry->owner == owner->owner) {
+			entry->stack = stack_id;
+			add_retained(a, stack_id, entry->size);
+		}
+	}
+	owner->pending_bytes = 0;
+	owner->pending_allocations = 0;
+	owner->pending_ptrs.len = 0;
+}
+
+/* Returns the index of owner id in owners, INDEX_EMPTY when out of memory. */
+static uint32_t find_owner(analyzer_t* a, uint32_t id) {
+	uint32_t const count = (uint32_t)VEC_COUNT(a->owners, trace_owner_t);
+	uint32_t const index = index_find_or_add(a, &a->owner_index, hash_bytes(&id, sizeof(id)), owner_equal, &id, count);
+	trace_owner_t* owner;
+	if (index != count)
+		return index;
+	owner = vec_push(a, &a->owners, sizeof(trace_owner_t));
+	if (owner == NULL)
+		return INDEX_EMPTY;
+	memset(owner, 0, sizeof(*owner));
+	owner->owner = id;
+	return index;
+}
+
+/* A new process forgets everything live in the previous one. */
+static void reset_process(analyzer_t* a) {
+	size_t const owners = VEC_COUNT(a->owners, trace_owner_t);
+	size_t const stacks = VEC_COUNT(a->stacks, trace_stack_t);
+	size_t i;
+	for (i = 0; i < owners; ++i) {
+		resolve_owner(a, &VEC_AT(a->owners, trace_owner_t, i), UNKNOWN_STACK);
+		free(VEC_AT(a->owners, trace_owner_t, i).pending_ptrs.data);
+	}
+	a->owners.len = 0;
+	free(a->owner_index.slots);
+	memset(&a->owner_index, 0, sizeof(a->owner_index));
+	a->current_owner = INDEX_EMPTY;
+	for (i = 0; i < stacks; ++i)
+		VEC_AT(a->stacks, trace_stack_t, i).retained_bytes = 0;
+	free(a->live);
+	a->live = NULL;
+	a->live_capacity = a->live_count = a->live_used = 0;
+	a->live_bytes = 0;
+	a->mapped_bytes = 0;
+}
+
+/* chunks */
+
+static void read_header(analyzer_t* a, cursor_t* cursor) {
+	uint64_t const version = next_varint(cursor);
+	uint64_t const pid = next_varint(cursor);
+	uint64_t const start = next_varint(cursor);
+	if (cursor->bad || version != TRACE_VERSION) {
+		a->message = "unsupported trace version";
+		return;
+	}
+	if (a->sessions == 0)
+		a->origin = a->now = start;
+	else if (pid != a->pid)
+		reset_process(a);
+	++a->sessions;
+	a->pid = pid;
+	a->session_start = start;
+	if (start > a->now)
+		a->now = start;
+	a->session_frames.len = 0;
+	a->session_stacks.len = 0;
+	a->current_owner = INDEX_EMPTY;
+}
+
+static void read_frames(analyzer_t* a, cursor_t* cursor) {
+	while (cursor->pos < cursor->len && !a->error) {
+		uint64_t const id = next_varint(cursor);
+		uint64_t const len = next_varint(cursor);
+		label_key_t key;
+		uint32_t const count = (uint32_t)VEC_COUNT(a->frames, trace_frame_t);
+		uint32_t index;
+		if (cursor->bad || len > cursor->len - cursor->pos)
+			break;
+		key.bytes = cursor->data + cursor->pos;
+		key.len = (size_t)len;
+		cursor->pos += (size_t)len;
+		index = index_find_or_add(a, &a->frame_index, hash_bytes(key.bytes, key.len), frame_equal, &key, count);
+		if (index == count) {
+			trace_frame_t* const frame = vec_push(a, &a->frames, sizeof(trace_frame_t));
+			uint8_t* const label = vec_push(a, &a->labels, key.len);
+			if (frame == NULL || label == NULL)
+				return;
+			frame->offset = a->labels.len - key.len;
+			frame->len = key.len;
+			memcpy(label, key.bytes, key.len);
+		}
+		session_map_set(a, &a->session_frames, id, index);
+	}
+}
+
+static void read_stacks(analyzer_t* a, cursor_t* cursor) {
+	while (cursor->pos < cursor->len && !a->error) {
+		uint64_t const id = next_varint(cursor);
+		uint64_t const depth = next_varint(cursor);
+		uint32_t const count = (uint32_t)VEC_COUNT(a->stacks, trace_stack_t);
+		size_t const offset = a->frame_ids.len;
+		uint32_t* ids;
+		stack_key_t key;
+		uint32_t index;
+		uint64_t i;
+		if (cursor->bad || depth > cursor->len - cursor->pos)
+			break;
+		/* translated in place at the end of the arena; dropped again if the stack is known */
+		ids = vec_push(a, &a->frame_ids, (size_t)depth * sizeof(uint32_t));
+		if (ids == NULL && depth > 0)
+			return;
+		for (i = 0; i < depth; ++i) {
+			uint32_t const frame = session_map_get(&a->session_frames, next_varint(cursor));
+			((uint32_t*)(a->frame_ids.data + offset))[i] = frame;
+		}
+		if (cursor->bad)
+			break;
+		key.ids = (uint32_t const*)(a->frame_ids.data + offset);
+		key.depth = (uint32_t)depth;
+		index = index_find_or_add(a, &a->stack_index, hash_bytes(key.ids, (size_t)depth * sizeof(uint32_t)), stack_equal, &key, count);
+		if (index == count) {
+			trace_stack_t* const stack = vec_push(a, &a->stacks, sizeof(trace_stack_t));
+			if (stack == NULL)
+				return;
+			memset(stack, 0, sizeof(*stack));
+			stack->offset = offset;
+			stack->depth = (uint32_t)depth;
+		} else {
+			a->frame_ids.len = offset;
+		}
+		session_map_set(a, &a->session_stacks, id, index);
+	}
+}
+
+static void apply_event(analyzer_t* a, call_info_t const* info) {
+	trace_live_t* entry;
+	++a->events;
+	switch (info->type) {
+	case CALL_FUNC_MALLOC:
+		add_live(a, (uintptr_t)info->malloc.allocated, info->malloc.size, a->now);
+		break;
+	case CALL_FUNC_CALLOC:
+		add_live(a, (uintptr_t)info->calloc.allocated, info->calloc.size * info->calloc.count, a->now);
+		break;
+	case CALL_FUNC_MEMALIGN:
+		add_live(a, (uintptr_t)info->memalign.allocated, info->memalign.size, a->now);
+		break;
+	case CALL_FUNC_POSIX_MEMALIGN:
+		if (info->posix_memalign.return_value == 0)
+			add_live(a, (uintptr_t)info->posix_memalign.allocated, info->posix_memalign.size, a->now);
+		break;
+	case CALL_FUNC_ALIGNED_ALLOC:
+		add_live(a, (uintptr_t)info->aligned_alloc.allocated, info->aligned_alloc.size, a->now);
+		break;
+	case CALL_FUNC_VALLOC:
+	case CALL_FUNC_PVALLOC:
+		add_live(a, (uintptr_t)info->valloc.allocated, info->valloc.size, a->now);
+		break;
+	case CALL_FUNC_FREE:
+		entry = find_live(a, (uintptr_t)info->free.ptr);
+		if (entry != NULL)
+			remove_live(a, entry, 1);
+		break;
+	case CALL_FUNC_REALLOC:
+		/* a move keeps the allocation's age; realloc(p, 0) frees */
+		entry = find_live(a, (uintptr_t)info->realloc.ptr);
+		if (entry != NULL) {
+			uint64_t const time = entry->time;
+			remove_live(a, entry, info->realloc.allocated == NULL);
+			if (info->realloc.allocated != NULL)
+				add_live(a, (uintptr_t)info->realloc.allocated, info->realloc.size, time);
+		} else {
+			add_live(a, (uintptr_t)info->realloc.allocated, info->realloc.size, a->now);
+		}
+		break;
+	case CALL_FUNC_MMAP:
+		a->mapped_bytes += (int64_t)info->mmap.size;
+		break;
+	case CALL_FUNC_MUNMAP:
+		a->mapped_bytes -= (int64_t)info->munmap.size;
+		break;
+	case CALL_FUNC_MREMAP:
+		a->mapped_bytes += (int64_t)info->mremap.size - (int64_t)info->mremap.old_size;
+		break;
+	case CALL_FUNC_SBRK:
+		a->mapped_bytes += info->sbrk.increment;
+		break;
+	default:
+		return;
+	}
+	note_timeline(a);
+}
+
+static void read_events(analyzer_t* a, cursor_t* cursor) {
+	call_info_decoder_t decoder;
+	decoder.mask = SIZE_MAX;
+	decoder.last_ptr = 0;
+	a->current_owner = INDEX_EMPTY;
+	while (cursor->pos < cursor->len && !cursor->bad && !a->error) {
+		uint8_t const tag = cursor->data[cursor->pos];
+		if (tag == TRACE_RECORD_TIME) {
+			uint64_t time;
+			++cursor->pos;
+			time = a->session_start + next_varint(cursor);
+			/* sessions of different processes may overlap */
+			if (time > a->now)
+				a->now = time;
+		} else if (tag == TRACE_RECORD_OWNER) {
+			++cursor->pos;
+			a->current_owner = find_owner(a, (uint32_t)next_varint(cursor));
+		} else if (tag == TRACE_RECORD_STACK) {
+			uint64_t owner_id, stack_id;
+			uint32_t owner, index;
+			++cursor->pos;
+			owner_id = next_varint(cursor);
+			stack_id = next_varint(cursor);
+			owner = find_owner(a, (uint32_t)owner_id);
+			index = stack_id == 0 ? INDEX_EMPTY : session_map_get(&a->session_stacks, stack_id - 1);
+			if (owner != INDEX_EMPTY && !cursor->bad)
+				resolve_owner(a, &VEC_AT(a->owners, trace_owner_t, owner), index == INDEX_EMPTY ? UNKNOWN_STACK : index);
+		} else {
+			call_info_t info;
+			/* decode_call_info doesn't bound reads; the last events are decoded from a padded copy */
+			if (cursor->len - cursor->pos >= CALL_INFO_ENCODED_MAX) {
+				decoder.data = cursor->data;
+				decoder.pos = cursor->pos;
+				decode_call_info(&decoder, &info);
+				cursor->pos = decoder.pos;
+			} else {
+				uint8_t tail[CALL_INFO_ENCODED_MAX * 2];
+				memset(tail, 0, sizeof(tail));
+				memcpy(tail, cursor->data + cursor->pos, cursor->len - cursor->pos);
+				decoder.data = tail;
+				decoder.pos = 0;
+				decode_call_info(&decoder, &info);
+				cursor->pos += decoder.pos;
+				if (cursor->pos > cursor->len)
+					break;
+			}
+			apply_event(a, &info);
+		}
+	}
+}
+
+/* Returns the bytes at [offset, offset + len), moving the window if needed. */
+static uint8_t const* map_range(analyzer_t* a, off_t offset, size_t len) {
+	long const page = sysconf(_SC_PAGESIZE);
+	off_t start;
+	size_t window_len;
+	void* p;
+
+	if (a->window != NULL && offset >= a->window_offset && offset + (off_t)len <= a->window_offset + (off_t)a->window_len)
+		return a->window + (offset - a->window_offset);
+	if (a->window != NULL)
+		munmap(a->window, a->window_len);
+	a->window = NULL;
+	start = offset - offset % page;
+	window_len = (size_t)(offset - start) + len;
+	if (window_len < ANALYZER_WINDOW)
+		window_len = ANALYZER_WINDOW;
+	if (start + (off_t)window_len > a->size)
+		window_len = (size_t)(a->size - start);
+	p = mmap(NULL, window_len, PROT_READ, MAP_PRIVATE, a->fd, start);
+	if (p == MAP_FAILED) {
+		a->error = errno;
+		return NULL;
+	}
+	madvise(p, window_len, MADV_SEQUENTIAL);
+	a->window = p;
+	a->window_offset = start;
+	a->window_len = window_len;
+	return a->window + (offset - start);
+}
+
+static void* analyze_without_gvl(void* arg) {
+	analyzer_t* const a = arg;
+	struct stat st;
+	uint8_t const* p;
+	off_t offset = TRACE_MAGIC_LEN;
+	trace_stack_t* unknown;
+
+	a->fd = open(a->path, O_RDONLY | O_CLOEXEC);
+	if (a->fd < 0 || fstat(a->fd, &st) != 0) {
+		a->error = errno;
+		return NULL;
+	}
+	a->size = st.st_size;
+	unknown = vec_push(a, &a->stacks, sizeof(trace_stack_t));
+	a->timeline = calloc(a->points, sizeof(timeline_bucket_t));
+	if (unknown == NULL || a->timeline == NULL) {
+		a->error = ENOMEM;
+		return NULL;
+	}
+	memset(unknown, 0, sizeof(*unknown));
+	a->timeline_width = TIMELINE_FIRST_WIDTH_NS;
+	if (a->size < TRACE_MAGIC_LEN || (p = map_range(a, 0, TRACE_MAGIC_LEN)) == NULL || memcmp(p, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+		if (!a->error)
+			a->message = "not a memtuner trace";
+		return NULL;
+	}
+	while (offset < a->size && !a->error && a->message == NULL && !__atomic_load_n(&a->interrupted, __ATOMIC_RELAXED)) {
+		cursor_t cursor;
+		uint32_t type;
+		if (a->size - offset < TRACE_CHUNK_HEADER_LEN) {
+			a->truncated = 1;
+			break;
+		}
+		if ((p = map_range(a, offset, TRACE_CHUNK_HEADER_LEN)) == NULL)
+			break;
+		type = get_u32(p);
+		cursor.len = get_u32(p + 4);
+		/* a writer died mid-chunk */
+		if (a->size - offset - TRACE_CHUNK_HEADER_LEN < (off_t)cursor.len) {
+			a->truncated = 1;
+			break;
+		}
+		if ((p = map_range(a, offset, TRACE_CHUNK_HEADER_LEN + cursor.len)) == NULL)
+			break;
+		cursor.data = p + TRACE_CHUNK_HEADER_LEN;
+		cursor.pos = 0;
+		cursor.bad = 0;
+		if (type == TRACE_CHUNK_HEADER)
+			read_header(a, &cursor);
+		else if (a->sessions == 0)
+			a->message = "trace has no session header";
+		else if (type == TRACE_CHUNK_FRAMES)
+			read_frames(a, &cursor);
+		else if (type == TRACE_CHUNK_STACKS)
+			read_stacks(a, &cursor);
+		else if (type == TRACE_CHUNK_EVENTS)
+			read_events(a, &cursor);
+		offset += TRACE_CHUNK_HEADER_LEN + cursor.len;
+	}
+	return NULL;
+}
+
+static void interrupt_analyzer(void* arg) {
+	analyzer_t* const a = arg;
+	__atomic_store_n(&a->interrupted, 1, __ATOMIC_RELAXED);
+}
+
+static void free_analyzer(analyzer_t* a) {
+	size_t const owners = VEC_COUNT(a->owners, trace_owner_t);
+	size_t i;
+	for (i = 0; i < owners; ++i)
+		free(VEC_AT(a->owners, trace_owner_t, i).pending_ptrs.data);
+	if (a->window != NULL)
+		munmap(a->window, a->window_len);
+	if (a->fd >= 0)
+		close(a->fd);
+	free(a->labels.data);
+	free(a->frames.data);
+	free(a->frame_index.slots);
+	free(a->frame_ids.data);
+	free(a->stacks.data);
+	free(a->stack_index.slots);
+	free(a->session_frames.data);
+	free(a->session_stacks.data);
+	free(a->owners.data);
+	free(a->owner_index.slots);
+	free(a->live);
+	free(a->timeline);
+}
+
+/* reports */
+
+static analyzer_t const* s_sorting;
+static int s_sort_retained;
+
+static int compare_stacks(void const* l, void const* r) {
+	trace_stack_t const* const ls = &VEC_AT(s_sorting->stacks, trace_stack_t, *(uint32_t const*)l);
+	trace_stack_t const* const rs = &VEC_AT(s_sorting->stacks, trace_stack_t, *(uint32_t const*)r);
+	uint64_t const lv = s_sort_retained ? ls->retained_bytes : ls->allocated_bytes;
+	uint64_t const rv = s_sort_retained ? rs->retained_bytes : rs->allocated_bytes;
+	return lv < rv ? 1 : lv > rv ? -1 : 0;
+}
+
+static VALUE frame_label(analyzer_t const* a, uint32_t frame_id) {
+	trace_frame_t const* frame;
+	if (frame_id == INDEX_EMPTY)
+		return rb_str_new_cstr("(unknown)");
+	frame = &VEC_AT(a->frames, trace_frame_t, frame_id);
+	return rb_str_new((char const*)a->labels.data + frame->offset, (long)frame->len);
+}
+
+/* innermost frame first, as in allocation_profile */
+static VALUE stack_frames_to_a(analyzer_t const* a, uint32_t stack_id) {
+	trace_stack_t const* const stack = &VEC_AT(a->stacks, trace_stack_t, stack_id);
+	uint32_t const* const ids = (uint32_t const*)(a->frame_ids.data + stack->offset);
+	VALUE frames = rb_ary_new_capa(stack->depth);
+	uint32_t i;
+	for (i = 0; i < stack->depth; ++i)
+		rb_ary_push(frames, frame_label(a, ids[i]));
+	return frames;
+}
+
+static VALUE top_stacks_to_a(analyzer_t const* a, uint32_t* order, size_t count, size_t top, int retained) {
+	VALUE result = rb_ary_new();
+	size_t i;
+	s_sorting = a;
+	s_sort_retained = retained;
+	qsort(order, count, sizeof(uint32_t), compare_stacks);
+	for (i = 0; i < count && i < top; ++i) {
+		trace_stack_t const* const stack = &VEC_AT(a->stacks, trace_stack_t, order[i]);
+		VALUE hash;
+		if ((retained ? stack->retained_bytes : stack->allocated_bytes) == 0)
+			break;
+		hash = rb_hash_new();
+		rb_hash_aset(hash, sym_frames, order[i] == UNKNOWN_STACK ? Qnil : stack_frames_to_a(a, order[i]));
+		rb_hash_aset(hash, sym_allocated_bytes, ULL2NUM(stack->allocated_bytes));
+		rb_hash_aset(hash, sym_allocations, ULL2NUM(stack->allocations));
+		rb_hash_aset(hash, sym_retained_bytes, ULL2NUM(stack->retained_bytes));
+		rb_hash_aset(hash, sym_peak_retained_bytes, ULL2NUM(stack->peak_retained_bytes));
+		rb_ary_push(result, hash);
+	}
+	return result;
+}
+
+/* Brendan Gregg's folded format: root frame first, separated by ';', then the value. */
+static VALUE folded_stacks(analyzer_t const* a, trace_folded_t folded) {
+	size_t const count = VEC_COUNT(a->stacks, trace_stack_t);
+	VALUE out = rb_str_buf_new(0);
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		trace_stack_t const* const stack = &VEC_AT(a->stacks, trace_stack_t, i);
+		uint32_t const* const ids = (uint32_t const*)(a->frame_ids.data + stack->offset);
+		uint64_t const value = folded == TRACE_FOLDED_RETAINED ? stack->retained_bytes : stack->allocated_bytes;
+		uint32_t depth;
+		if (value == 0)
+			continue;
+		if (i == UNKNOWN_STACK)
+			rb_str_cat_cstr(out, "(unknown)");
+		else if (stack->depth == 0)
+			rb_str_cat_cstr(out, "(no ruby frames)");
+		for (depth = stack->depth; depth > 0; --depth) {
+			VALUE label = frame_label(a, ids[depth - 1]);
+			char* s = RSTRING_PTR(label);
+			long j;
+			for (j = 0; j < RSTRING_LEN(label); ++j) {
+				if (s[j] == ';' || s[j] == '\n')
+					s[j] = ',';
+			}
+			if (depth != stack->depth)
+				rb_str_cat_cstr(out, ";");
+			rb_str_append(out, label);
+		}
+		rb_str_catf(out, " %llu\n", (unsigned long long)value);
+	}
+	return out;
+}
+
+static VALUE analyzer_to_hash(analyzer_t* a, size_t top, trace_folded_t folded) {
+	size_t const stacks = VEC_COUNT(a->stacks, trace_stack_t);
+	VALUE hash = rb_hash_new();
+	VALUE timeline = rb_hash_new();
+	VALUE times = rb_ary_new_capa((long)a->timeline_len);
+	VALUE live = rb_ary_new_capa((long)a->timeline_len);
+	VALUE mapped = rb_ary_new_capa((long)a->timeline_len);
+	VALUE lifetimes = rb_ary_new();
+	VALUE live_at_end = rb_hash_new();
+	uint32_t* order;
+	uint64_t last_live = 0;
+	int64_t last_mapped = 0;
+	size_t i;
+	int last_bucket = -1;
+
+	rb_hash_aset(hash, sym_sessions, ULL2NUM(a->sessions));
+	rb_hash_aset(hash, sym_events, ULL2NUM(a->events));
+	rb_hash_aset(hash, sym_duration, DBL2NUM((a->now - a->origin) / 1e9));
+	rb_hash_aset(hash, sym_truncated, a->truncated ? Qtrue : Qfalse);
+
+	/* buckets without events carry the level before them */
+	for (i = 0; i < a->timeline_len; ++i) {
+		timeline_bucket_t const* const bucket = &a->timeline[i];
+		rb_ary_push(times, DBL2NUM(i * (double)a->timeline_width / 1e9));
+		rb_ary_push(live, ULL2NUM(bucket->set ? bucket->peak_live : last_live));
+		rb_ary_push(mapped, LL2NUM(bucket->set ? bucket->peak_mapped : last_mapped));
+		if (bucket->set) {
+			last_live = bucket->last_live;
+			last_mapped = bucket->last_mapped;
+		}
+	}
+	rb_hash_aset(timeline, sym_time, times);
+	rb_hash_aset(timeline, sym_live_bytes, live);
+	rb_hash_aset(timeline, sym_mapped_bytes, mapped);
+	rb_hash_aset(hash, sym_timeline, timeline);
+
+	order = malloc(stacks * sizeof(uint32_t));
+	if (order == NULL)
+		rb_memerror();
+	for (i = 0; i < stacks; ++i)
+		order[i] = (uint32_t)i;
+	rb_hash_aset(hash, sym_top_allocating, top_stacks_to_a(a, order, stacks, top, 0));
+	rb_hash_aset(hash, sym_top_retaining, top_stacks_to_a(a, order, stacks, top, 1));
+	free(order);
+
+	for (i = 0; i < LIFETIME_BUCKETS; ++i) {
+		if (a->lifetime_count[i] > 0)
+			last_bucket = (int)i;
+	}
+	for (i = 0; (int)i <= last_bucket; ++i) {
+		VALUE bucket = rb_hash_new();
+		rb_hash_aset(bucket, sym_max_us, ULL2NUM(1ULL << i));
+		rb_hash_aset(bucket, sym_count, ULL2NUM(a->lifetime_count[i]));
+		rb_hash_aset(bucket, sym_bytes, ULL2NUM(a->lifetime_bytes[i]));
+		rb_ary_push(lifetimes, bucket);
+	}
+	rb_hash_aset(hash, sym_lifetimes, lifetimes);
+	rb_hash_aset(live_at_end, sym_count, SIZET2NUM(a->live_count));
+	rb_hash_aset(live_at_end, sym_bytes, ULL2NUM(a->live_bytes));
+	rb_hash_aset(hash, sym_live_at_end, live_at_end);
+	if (folded != TRACE_FOLDED_NONE)
+		rb_hash_aset(hash, sym_folded, folded_stacks(a, folded));
+	return hash;
+}
+
+typedef struct {
+	analyzer_t* analyzer;
+	size_t top;
+	trace_folded_t folded;
+} analyze_args_t;
+
+static VALUE analyze_body(VALUE arg) {
+	analyze_args_t* const args = (analyze_args_t*)arg;
+	analyzer_t* const a = args->analyzer;
+	size_t owners, i;
+
+	rb_thread_call_without_gvl(analyze_without_gvl, a, interrupt_analyzer, a);
+	if (a->interrupted)
+		rb_thread_check_ints();
+	if (a->error)
+		rb_syserr_fail(a->error, a->path);
+	if (a->message)
+		rb_raise(rb_eArgError, "%s: %s", a->path, a->message);
+	/* allocations no STACK record claimed */
+	owners = VEC_COUNT(a->owners, trace_owner_t);
+	for (i = 0; i < owners; ++i)
+		resolve_owner(a, &VEC_AT(a->owners, trace_owner_t, i), UNKNOWN_STACK);
+	return analyzer_to_hash(a, args->top, args->folded);
+}
+
+static VALUE analyze_ensure(VALUE arg) {
+	free_analyzer(((analyze_args_t*)arg)->analyzer);
+	return Qnil;
+}
+
+VALUE analyze_trace(char const* path, size_t top, size_t points, trace_folded_t folded) {
+	analyzer_t a;
+	analyze_args_t args;
+	memset(&a, 0, sizeof(a));
+	a.path = path;
+	a.points = points < 2 ? 2 : points;
+	a.fd = -1;
+	a.current_owner = INDEX_EMPTY;
+	args.analyzer = &a;
+	args.top = top;
+	args.folded = folded;
+	return rb_ensure(analyze_body, (VALUE)&args, analyze_ensure, (VALUE)&args);
+}
+
+void init_trace_analyzer(void) {
+#define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
+	DEF_SYM(sessions);
+	DEF_SYM(events);
+	DEF_SYM(duration);
+	DEF_SYM(truncated);
+	DEF_SYM(timeline);
+	DEF_SYM(time);
+	DEF_SYM(live_bytes);
+	DEF_SYM(mapped_bytes);
+	DEF_SYM(top_allocating);
+	DEF_SYM(top_retaining);
+	DEF_SYM(frames);
+	DEF_SYM(allocated_bytes);
+	DEF_SYM(allocations);
+	DEF_SYM(retained_bytes);
+	DEF_SYM(peak_retained_bytes);
+	DEF_SYM(lifetimes);
+	DEF_SYM(max_us);
+	DEF_SYM(count);
+	DEF_SYM(bytes);
+	DEF_SYM(live_at_end);
+	DEF_SYM(folded);
+#undef DEF_SYM
+}
@@ -0,0 +1,22 @@
+#ifndef __TRACE_ANALYZER_H
+#define __TRACE_ANALYZER_H
+#include <stddef.h>
+#include <ruby/ruby.h>
+
+/*
+ * Aggregates a trace file (see trace_format.h) in one pass. The file is
+ * mapped a window at a time, so traces larger than memory work; what is
+ * kept grows with the number of distinct stacks and the peak live set,
+ * not with the length of the trace. Runs without the GVL.
+ */
+typedef enum {
+	TRACE_FOLDED_NONE,
+	TRACE_FOLDED_ALLOCATED,
+	TRACE_FOLDED_RETAINED,
+} trace_folded_t;
+
+extern void init_trace_analyzer(void);
+/* top stacks by allocated and retained bytes, a timeline of at most points buckets */
+extern VALUE analyze_trace(char const* path, size_t top, size_t points, trace_folded_t folded);
+
+#endif
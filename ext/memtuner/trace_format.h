@@ -0,0 +1,50 @@
+#ifndef __TRACE_FORMAT_H
+#define __TRACE_FORMAT_H
+
+/*
+ * Binary trace files, written by trace_writer and read by trace_analyzer.
+ *
+ *   file  := TRACE_MAGIC chunk*
+ *   chunk := u32 type, u32 payload length (little-endian), payload
+ *
+ * Every process that opens the file starts a session with a HEADER chunk;
+ * dictionaries, owners and times restart there, so files can be appended
+ * to and rotated. Chunk payloads are records of LEB128 varints:
+ *
+ *   HEADER  version, pid, session start (ns since the epoch)
+ *   FRAMES  (frame id, label length, label bytes)*
+ *   STACKS  (stack id, depth, frame id * depth)*, innermost frame first
+ *   EVENTS  records, with pointer deltas restarting from 0 in every chunk:
+ *     TRACE_RECORD_TIME   ns since the session start; stamps the events after it
+ *     TRACE_RECORD_OWNER  owner; the thread of the events after it
+ *     TRACE_RECORD_STACK  owner, stack id + 1 (0 unknown): the owner's events
+ *                         since its previous STACK record were made there
+ *     anything else is an event as packed by encode_call_info
+ *
+ * FREE events carry no size. When every call is recorded, every free is;
+ * when sampling, only frees of recorded allocations are, and a recorded
+ * allocation that an unrecorded realloc frees or moves is traced as a FREE
+ * of the old pointer. Readers ignore FREEs of pointers they don't track.
+ *
+ * A dictionary entry is written to a session before the first STACK record
+ * that needs it. Times are stamped when the collector drains events, so
+ * their resolution is the collector's polling interval.
+ */
+#define TRACE_MAGIC "MTTRACE1"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_HEADER_LEN 8
+
+typedef enum {
+	TRACE_CHUNK_HEADER = 1,
+	TRACE_CHUNK_FRAMES = 2,
+	TRACE_CHUNK_STACKS = 3,
+	TRACE_CHUNK_EVENTS = 4,
+} trace_chunk_type_t;
+
+/* above every call_func_type_t tag */
+#define TRACE_RECORD_TIME 0xf0
+#define TRACE_RECORD_OWNER 0xf1
+#define TRACE_RECORD_STACK 0xf2
+
+#endif
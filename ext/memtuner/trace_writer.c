@@ -0,0 +1,616 @@
+#include "trace_writer.h"
+#include "trace_format.h"
+#include "call_info_encoding.h"
+#include "stack_table.h"
+#include "varint.h"
+#include "debug.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* a batch is written once it is this large or this old */
+#define TRACE_FLUSH_BYTES ((size_t)1 << 20)
+#define TRACE_FLUSH_INTERVAL_NS 200000000ULL
+/* events are dropped rather than buffered past this while writes stall */
+#define TRACE_BUFFER_MAX ((size_t)64 << 20)
+#define TRACE_NO_TIME UINT64_MAX
+
+typedef struct {
+	uint8_t* data;
+	size_t len;
+	size_t capacity;
+} trace_bytes_t;
+
+typedef struct {
+	trace_bytes_t frames;
+	trace_bytes_t stacks;
+	trace_bytes_t events;
+} trace_batch_t;
+
+typedef struct {
+	size_t offset;
+	size_t len;
+} trace_span_t;
+
+static VALUE sym_path;
+static VALUE sym_bytes_written;
+static VALUE sym_dropped_events;
+static VALUE sym_rotations;
+
+static int s_tracing = 0;
+
+/* guards the active batch and the dictionary state */
+static pthread_mutex_t s_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_batch_t s_active;
+static uintptr_t s_last_ptr;
+static uint32_t s_owner;
+static int s_has_owner;
+static int s_dropping; /* the current drain didn't fit */
+static uint64_t s_last_time;
+static uint64_t s_batch_first_time; /* of the active batch */
+static uint64_t s_session_start; /* CLOCK_MONOTONIC ns */
+static uint8_t* s_frames_written = NULL; /* bitsets of ids in the current session */
+static size_t s_frames_written_bits = 0;
+static uint8_t* s_stacks_written = NULL;
+static size_t s_stacks_written_bits = 0;
+/*
+ * Every label and stack written so far, so a new session can repeat
+ * them from the collector thread without the GVL.
+ */
+static uint8_t* s_frames_cached = NULL;
+static size_t s_frames_cached_bits = 0;
+static uint8_t* s_stacks_cached = NULL;
+static size_t s_stacks_cached_bits = 0;
+static trace_bytes_t s_labels; /* label bytes */
+static trace_bytes_t s_frame_spans; /* trace_span_t by frame id, into s_labels */
+static trace_bytes_t s_stack_frames; /* uint32_t frame ids */
+static trace_bytes_t s_stack_spans; /* trace_span_t by stack id, into s_stack_frames */
+static size_t s_dropped_events = 0;
+
+/* guards the file and the batch being written; taken before s_trace_mutex */
+static pthread_mutex_t s_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_batch_t s_writing;
+static int s_fd = -1;
+static char* s_path = NULL;
+static off_t s_file_size; /* what we wrote; less on disk means it was truncated */
+static uint64_t s_last_flush;
+static size_t s_bytes_written = 0;
+static size_t s_rotations = 0;
+
+static uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int reserve_bytes(trace_bytes_t* bytes, size_t n) {
+	size_t capacity = bytes->capacity ? bytes->capacity : 4096;
+	uint8_t* data;
+	if (bytes->len + n <= bytes->capacity)
+		return 1;
+	while (capacity < bytes->len + n)
+		capacity *= 2;
+	if (capacity > TRACE_BUFFER_MAX)
+		return 0;
+	data = realloc(bytes->data, capacity);
+	if (data == NULL)
+		return 0;
+	bytes->data = data;
+	bytes->capacity = capacity;
+	return 1;
+}
+
+/* callers reserve first */
+static void put_varint(trace_bytes_t* bytes, uint64_t n) {
+	bytes->len += encode_varint(n, bytes->data + bytes->len);
+}
+
+static void put_u32(uint8_t* out, uint32_t n) {
+	out[0] = (uint8_t)n;
+	out[1] = (uint8_t)(n >> 8);
+	out[2] = (uint8_t)(n >> 16);
+	out[3] = (uint8_t)(n >> 24);
+}
+
+static int test_bit(uint8_t const* bits, size_t nbits, size_t i) {
+	return i < nbits && (bits[i / 8] & (1 << (i % 8)));
+}
+
+static int set_bit(uint8_t** bits, size_t* nbits, size_t i) {
+	if (i >= *nbits) {
+		size_t n = *nbits ? *nbits : 4096;
+		uint8_t* p;
+		while (n <= i)
+			n *= 2;
+		p = realloc(*bits, n / 8);
+		if (p == NULL)
+			return 0;
+		memset(p + *nbits / 8, 0, (n - *nbits) / 8);
+		*bits = p;
+		*nbits = n;
+	}
+	(*bits)[i / 8] |= (uint8_t)(1 << (i % 8));
+	return 1;
+}
+
+/* The realtime of a CLOCK_MONOTONIC time, for session headers. */
+static uint64_t realtime_of(uint64_t monotonic) {
+	struct timespec ts;
+	uint64_t const now = monotonic_ns();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec - (now - monotonic);
+}
+
+/* Must be called with s_trace_mutex held. */
+static void reset_session_state(void) {
+	s_last_ptr = 0;
+	s_has_owner = 0;
+	s_last_time = TRACE_NO_TIME;
+	s_batch_first_time = TRACE_NO_TIME;
+}
+
+static trace_span_t* span_at(trace_bytes_t* spans, size_t i) {
+	size_t const end = (i + 1) * sizeof(trace_span_t);
+	if (end > spans->len) {
+		if (!reserve_bytes(spans, end - spans->len))
+			return NULL;
+		spans->len = end;
+	}
+	return (trace_span_t*)spans->data + i;
+}
+
+/* Must be called with s_trace_mutex held. */
+static void forget_dictionary(void) {
+	if (s_frames_written)
+		memset(s_frames_written, 0, s_frames_written_bits / 8);
+	if (s_stacks_written)
+		memset(s_stacks_written, 0, s_stacks_written_bits / 8);
+}
+
+static int write_all(int fd, struct iovec* iov, int count) {
+	while (count > 0) {
+		ssize_t n = writev(fd, iov, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		s_bytes_written += (size_t)n;
+		s_file_size += n;
+		while (count > 0 && (size_t)n >= iov->iov_len) {
+			n -= (ssize_t)iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0) {
+			iov->iov_base = (uint8_t*)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+	return 1;
+}
+
+/*
+ * The magic only at the start of the file; appending to an old trace just
+ * starts a session. start is the realtime that TIME records count from.
+ */
+static int write_session_header(int fd, off_t size, uint64_t start) {
+	uint8_t buf[TRACE_MAGIC_LEN + TRACE_CHUNK_HEADER_LEN + VARINT_MAX_BYTES * 3];
+	size_t len = 0, payload;
+	struct iovec iov;
+
+	if (size == 0) {
+		memcpy(buf, TRACE_MAGIC, TRACE_MAGIC_LEN);
+		len = TRACE_MAGIC_LEN;
+	}
+	payload = len + TRACE_CHUNK_HEADER_LEN;
+	payload += encode_varint(TRACE_VERSION, buf + payload);
+	payload += encode_varint((uint64_t)getpid(), buf + payload);
+	payload += encode_varint(start, buf + payload);
+	put_u32(buf + len, TRACE_CHUNK_HEADER);
+	put_u32(buf + len + 4, (uint32_t)(payload - len - TRACE_CHUNK_HEADER_LEN));
+	s_file_size = size;
+	iov.iov_base = buf;
+	iov.iov_len = payload;
+	return write_all(fd, &iov, 1);
+}
+
+static int open_trace_file(char const* path, off_t* size) {
+	struct stat st;
+	int const fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	*size = st.st_size;
+	return fd;
+}
+
+/* Must be called with s_trace_mutex held. Writes a cached stack and its frames to the active batch. */
+static int emit_stack(uint32_t stack_id) {
+	trace_span_t const* const stack = (trace_span_t const*)s_stack_spans.data + stack_id;
+	uint32_t const* const frame_ids = (uint32_t const*)s_stack_frames.data + stack->offset;
+	size_t i;
+
+	if (test_bit(s_stacks_written, s_stacks_written_bits, stack_id))
+		return 1;
+	for (i = 0; i < stack->len; ++i) {
+		trace_span_t const* label;
+		if (test_bit(s_frames_written, s_frames_written_bits, frame_ids[i]))
+			continue;
+		label = (trace_span_t const*)s_frame_spans.data + frame_ids[i];
+		if (!reserve_bytes(&s_active.frames, VARINT_MAX_BYTES * 2 + label->len) ||
+			!set_bit(&s_frames_written, &s_frames_written_bits, frame_ids[i]))
+			return 0;
+		put_varint(&s_active.frames, frame_ids[i]);
+		put_varint(&s_active.frames, label->len);
+		memcpy(s_active.frames.data + s_active.frames.len, s_labels.data + label->offset, label->len);
+		s_active.frames.len += label->len;
+	}
+	if (!reserve_bytes(&s_active.stacks, VARINT_MAX_BYTES * (2 + stack->len)) ||
+		!set_bit(&s_stacks_written, &s_stacks_written_bits, stack_id))
+		return 0;
+	put_varint(&s_active.stacks, stack_id);
+	put_varint(&s_active.stacks, stack->len);
+	for (i = 0; i < stack->len; ++i)
+		put_varint(&s_active.stacks, frame_ids[i]);
+	return 1;
+}
+
+/*
+ * Must be called with both mutexes held. Moves the active batch into a
+ * session that starts at its first TIME record: TIME records are rebased
+ * and the batch's dictionaries are replaced by the entries its STACK
+ * records need. Returns the new session start.
+ */
+static uint64_t start_new_session(void) {
+	uint64_t const shift = s_batch_first_time != TRACE_NO_TIME ? s_batch_first_time : monotonic_ns() - s_session_start;
+	trace_bytes_t* const out = &s_writing.events;
+	uint8_t const* const in = s_active.events.data;
+	size_t len = s_active.events.len;
+	call_info_decoder_t decoder;
+	size_t pos = 0;
+	trace_bytes_t swap;
+
+	forget_dictionary();
+	s_active.frames.len = 0;
+	s_active.stacks.len = 0;
+	out->len = 0;
+	/* varints only get shorter */
+	if (!reserve_bytes(out, len)) {
+		memtuner_debug_print("trace: batch lost at rotation\n");
+		len = 0;
+	}
+	decoder.data = in;
+	decoder.mask = SIZE_MAX;
+	decoder.last_ptr = 0;
+	while (pos < len) {
+		size_t const start = pos;
+		uint64_t n;
+		switch (in[pos]) {
+		case TRACE_RECORD_TIME:
+			pos += 1 + decode_varint(in + pos + 1, &n);
+			out->data[out->len++] = TRACE_RECORD_TIME;
+			put_varint(out, n > shift ? n - shift : 0);
+			continue;
+		case TRACE_RECORD_OWNER:
+			pos += 1 + decode_varint(in + pos + 1, &n);
+			break;
+		case TRACE_RECORD_STACK:
+			pos += 1 + decode_varint(in + pos + 1, &n);
+			pos += decode_varint(in + pos, &n);
+			if (n != 0 && !emit_stack((uint32_t)(n - 1)))
+				memtuner_debug_print("trace: dictionary full\n");
+			break;
+		default: {
+			call_info_t info;
+			decoder.pos = pos;
+			decode_call_info(&decoder, &info);
+			pos = decoder.pos;
+			break;
+		}
+		}
+		memcpy(out->data + out->len, in + start, pos - start);
+		out->len += pos - start;
+	}
+	swap = s_active.events;
+	s_active.events = *out;
+	*out = swap;
+	out->len = 0;
+	s_session_start += shift;
+	return realtime_of(s_session_start);
+}
+
+/* Must be called with s_flush_mutex held. Writes s_writing as one writev. */
+static void write_batch(void) {
+	struct iovec iov[6];
+	uint8_t headers[3][TRACE_CHUNK_HEADER_LEN];
+	trace_bytes_t const* const chunks[3] = { &s_writing.frames, &s_writing.stacks, &s_writing.events };
+	trace_chunk_type_t const types[3] = { TRACE_CHUNK_FRAMES, TRACE_CHUNK_STACKS, TRACE_CHUNK_EVENTS };
+	int i, count = 0;
+
+	/* dictionaries first, so events never refer ahead */
+	for (i = 0; i < 3; ++i) {
+		if (chunks[i]->len == 0)
+			continue;
+		put_u32(headers[i], types[i]);
+		put_u32(headers[i] + 4, (uint32_t)chunks[i]->len);
+		iov[count].iov_base = headers[i];
+		iov[count++].iov_len = TRACE_CHUNK_HEADER_LEN;
+		iov[count].iov_base = chunks[i]->data;
+		iov[count++].iov_len = chunks[i]->len;
+	}
+	if (count > 0 && !write_all(s_fd, iov, count))
+		memtuner_debug_print("trace: write failed\n");
+	s_writing.frames.len = 0;
+	s_writing.stacks.len = 0;
+	s_writing.events.len = 0;
+}
+
+/*
+ * Handles both rotation styles: a renamed file is reopened at the path and
+ * a file truncated in place (copytruncate) is written from its new end.
+ * Either way the batch goes to a new session that repeats the dictionary
+ * entries it needs, so every session decodes on its own.
+ */
+static void flush_trace(int force) {
+	uint64_t const now = monotonic_ns();
+	struct stat fd_stat, path_stat;
+	off_t size = 0;
+	int fd = -1;
+	trace_batch_t swap;
+
+	pthread_mutex_lock(&s_flush_mutex);
+	if (s_fd < 0) {
+		pthread_mutex_unlock(&s_flush_mutex);
+		return;
+	}
+	pthread_mutex_lock(&s_trace_mutex);
+	if (!force && s_active.events.len < TRACE_FLUSH_BYTES && now - s_last_flush < TRACE_FLUSH_INTERVAL_NS) {
+		pthread_mutex_unlock(&s_trace_mutex);
+		pthread_mutex_unlock(&s_flush_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&s_trace_mutex);
+	s_last_flush = now;
+
+	if (fstat(s_fd, &fd_stat) == 0 && fd_stat.st_size < s_file_size) {
+		fd = s_fd;
+		size = fd_stat.st_size;
+	} else if (stat(s_path, &path_stat) != 0 || path_stat.st_ino != fd_stat.st_ino || path_stat.st_dev != fd_stat.st_dev) {
+		/* keep writing to the old file if the path can't be reopened */
+		fd = open_trace_file(s_path, &size);
+	}
+
+	pthread_mutex_lock(&s_trace_mutex);
+	if (fd >= 0) {
+		uint64_t const start = start_new_session();
+		if (fd != s_fd) {
+			close(s_fd);
+			s_fd = fd;
+		}
+		++s_rotations;
+		write_session_header(s_fd, size, start);
+	}
+	swap = s_writing;
+	s_writing = s_active;
+	s_active = swap;
+	/* each events chunk decodes on its own */
+	reset_session_state();
+	pthread_mutex_unlock(&s_trace_mutex);
+
+	write_batch();
+	pthread_mutex_unlock(&s_flush_mutex);
+}
+
+void trace_flush_if_due(void) {
+	flush_trace(0);
+}
+
+/* Must be called with s_flush_mutex and s_trace_mutex held. Starts an empty session in fd. */
+static void begin_session(int fd, off_t size) {
+	s_fd = fd;
+	s_last_flush = monotonic_ns();
+	s_active.frames.len = s_active.stacks.len = s_active.events.len = 0;
+	s_writing.frames.len = s_writing.stacks.len = s_writing.events.len = 0;
+	s_session_start = monotonic_ns();
+	s_dropped_events = 0;
+	reset_session_state();
+	forget_dictionary();
+	write_session_header(fd, size, realtime_of(s_session_start));
+}
+
+int trace_enabled(void) {
+	return __atomic_load_n(&s_tracing, __ATOMIC_ACQUIRE);
+}
+
+int start_trace(char const* path) {
+	off_t size;
+	int fd;
+	pthread_mutex_lock(&s_flush_mutex);
+	if (s_fd >= 0) {
+		pthread_mutex_unlock(&s_flush_mutex);
+		return 0;
+	}
+	s_bytes_written = 0;
+	s_rotations = 0;
+	fd = open_trace_file(path, &size);
+	if (fd < 0) {
+		int const error = errno;
+		pthread_mutex_unlock(&s_flush_mutex);
+		rb_syserr_fail(error, path);
+	}
+	s_path = strdup(path);
+	pthread_mutex_lock(&s_trace_mutex);
+	begin_session(fd, size);
+	pthread_mutex_unlock(&s_trace_mutex);
+	pthread_mutex_unlock(&s_flush_mutex);
+	__atomic_store_n(&s_tracing, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+int stop_trace(void) {
+	if (!trace_enabled())
+		return 0;
+	__atomic_store_n(&s_tracing, 0, __ATOMIC_RELEASE);
+	flush_trace(1);
+	pthread_mutex_lock(&s_flush_mutex);
+	close(s_fd);
+	s_fd = -1;
+	free(s_path);
+	s_path = NULL;
+	pthread_mutex_unlock(&s_flush_mutex);
+	return 1;
+}
+
+void trace_begin_events(uint32_t owner) {
+	uint64_t time;
+	pthread_mutex_lock(&s_trace_mutex);
+	time = monotonic_ns() - s_session_start;
+	s_dropping = !reserve_bytes(&s_active.events, 2 + VARINT_MAX_BYTES * 2);
+	if (s_dropping)
+		return;
+	if (time != s_last_time) {
+		s_active.events.data[s_active.events.len++] = TRACE_RECORD_TIME;
+		put_varint(&s_active.events, time);
+		s_last_time = time;
+		if (s_batch_first_time == TRACE_NO_TIME)
+			s_batch_first_time = time;
+	}
+	if (!s_has_owner || s_owner != owner) {
+		s_active.events.data[s_active.events.len++] = TRACE_RECORD_OWNER;
+		put_varint(&s_active.events, owner);
+		s_owner = owner;
+		s_has_owner = 1;
+	}
+}
+
+void trace_add_event(call_info_t const* info) {
+	if (!s_dropping && !reserve_bytes(&s_active.events, CALL_INFO_ENCODED_MAX))
+		s_dropping = 1;
+	if (s_dropping) {
+		++s_dropped_events;
+		return;
+	}
+	s_active.events.len += encode_call_info(info, &s_last_ptr, s_active.events.data + s_active.events.len);
+}
+
+void trace_end_events(void) {
+	pthread_mutex_unlock(&s_trace_mutex);
+}
+
+/* Must be called with s_trace_mutex and the GVL held. Copies a stack and its labels for emit_stack. */
+static int cache_stack(uint32_t stack_id) {
+	int const depth = stack_table_depth(stack_id);
+	uint32_t const* const frame_ids = stack_table_frame_ids(stack_id);
+	trace_span_t* span;
+	int i;
+
+	if (test_bit(s_stacks_cached, s_stacks_cached_bits, stack_id))
+		return 1;
+	for (i = 0; i < depth; ++i) {
+		VALUE label;
+		if (test_bit(s_frames_cached, s_frames_cached_bits, frame_ids[i]))
+			continue;
+		label = stack_table_frame_label(frame_ids[i]);
+		if ((span = span_at(&s_frame_spans, frame_ids[i])) == NULL ||
+			!reserve_bytes(&s_labels, RSTRING_LEN(label)) ||
+			!set_bit(&s_frames_cached, &s_frames_cached_bits, frame_ids[i]))
+			return 0;
+		span->offset = s_labels.len;
+		span->len = RSTRING_LEN(label);
+		memcpy(s_labels.data + s_labels.len, RSTRING_PTR(label), RSTRING_LEN(label));
+		s_labels.len += RSTRING_LEN(label);
+	}
+	if ((span = span_at(&s_stack_spans, stack_id)) == NULL ||
+		!reserve_bytes(&s_stack_frames, depth * sizeof(uint32_t)) ||
+		!set_bit(&s_stacks_cached, &s_stacks_cached_bits, stack_id))
+		return 0;
+	span->offset = s_stack_frames.len / sizeof(uint32_t);
+	span->len = (size_t)depth;
+	memcpy(s_stack_frames.data + s_stack_frames.len, frame_ids, depth * sizeof(uint32_t));
+	s_stack_frames.len += depth * sizeof(uint32_t);
+	return 1;
+}
+
+void trace_attribute(uint32_t owner, uint32_t stack_id) {
+	pthread_mutex_lock(&s_trace_mutex);
+	if (stack_id != STACK_ID_INVALID && (!cache_stack(stack_id) || !emit_stack(stack_id)))
+		stack_id = STACK_ID_INVALID;
+	if (reserve_bytes(&s_active.events, 1 + VARINT_MAX_BYTES * 2)) {
+		s_active.events.data[s_active.events.len++] = TRACE_RECORD_STACK;
+		put_varint(&s_active.events, owner);
+		put_varint(&s_active.events, stack_id == STACK_ID_INVALID ? 0 : (uint64_t)stack_id + 1);
+	}
+	pthread_mutex_unlock(&s_trace_mutex);
+}
+
+void trace_lock_before_fork(void) {
+	pthread_mutex_lock(&s_flush_mutex);
+	pthread_mutex_lock(&s_trace_mutex);
+}
+
+void trace_unlock_after_fork(void) {
+	pthread_mutex_unlock(&s_trace_mutex);
+	pthread_mutex_unlock(&s_flush_mutex);
+}
+
+/*
+ * The parent still writes its own batches and session, so the child
+ * leaves the file to it and traces to <path>.<pid> in a session of its own.
+ */
+void trace_reset_in_child(void) {
+	char* path;
+	off_t size;
+	int fd;
+
+	pthread_mutex_init(&s_flush_mutex, NULL);
+	pthread_mutex_init(&s_trace_mutex, NULL);
+	if (s_fd < 0)
+		return;
+	close(s_fd);
+	s_fd = -1;
+	s_bytes_written = 0;
+	s_rotations = 0;
+	path = malloc(strlen(s_path) + 24);
+	if (path != NULL)
+		sprintf(path, "%s.%ld", s_path, (long)getpid());
+	free(s_path);
+	s_path = path;
+	if (path == NULL || (fd = open_trace_file(path, &size)) < 0) {
+		memtuner_debug_print("trace_reset_in_child: can't open the child's trace\n");
+		__atomic_store_n(&s_tracing, 0, __ATOMIC_RELEASE);
+		free(s_path);
+		s_path = NULL;
+		return;
+	}
+	begin_session(fd, size);
+}
+
+VALUE trace_stats(void) {
+	VALUE hash = rb_hash_new();
+	pthread_mutex_lock(&s_flush_mutex);
+	rb_hash_aset(hash, sym_path, s_fd >= 0 ? rb_str_new_cstr(s_path) : Qnil);
+	rb_hash_aset(hash, sym_bytes_written, SIZET2NUM(s_bytes_written));
+	rb_hash_aset(hash, sym_rotations, SIZET2NUM(s_rotations));
+	pthread_mutex_unlock(&s_flush_mutex);
+	rb_hash_aset(hash, sym_dropped_events, SIZET2NUM(s_dropped_events));
+	return hash;
+}
+
+void init_trace_writer(void) {
+#define DEF_SYM(name) sym_ ## name = ID2SYM(rb_intern(#name))
+	DEF_SYM(path);
+	DEF_SYM(bytes_written);
+	DEF_SYM(dropped_events);
+	DEF_SYM(rotations);
+#undef DEF_SYM
+}
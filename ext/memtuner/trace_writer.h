@@ -0,0 +1,34 @@
+#ifndef __TRACE_WRITER_H
+#define __TRACE_WRITER_H
+#include <ruby/ruby.h>
+#include <stdint.h>
+#include "call_info.h"
+
+/*
+ * Writes traced calls to a binary trace file (see trace_format.h). Callers
+ * only append to memory buffers; the collector thread writes them out in
+ * large batches and reopens the path when it has been rotated.
+ */
+
+extern void init_trace_writer(void);
+
+/* with the GVL held; return 0 when already started or stopped */
+extern int start_trace(char const* path);
+extern int stop_trace(void);
+extern VALUE trace_stats(void);
+
+extern int trace_enabled(void);
+/* From the collector, around the events of one buffer. */
+extern void trace_begin_events(uint32_t owner);
+extern void trace_add_event(call_info_t const* info);
+extern void trace_end_events(void);
+/* From the allocation job: the owner's events so far were made at stack_id. */
+extern void trace_attribute(uint32_t owner, uint32_t stack_id);
+/* From the collector; writes the buffers out when they are large or old enough. */
+extern void trace_flush_if_due(void);
+/* From the collector's fork handlers, inside its own locks. */
+extern void trace_lock_before_fork(void);
+extern void trace_unlock_after_fork(void);
+extern void trace_reset_in_child(void);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef __VARINT_H
+#define __VARINT_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* LEB128 and zigzag helpers shared by the packed formats. */
+
+#define VARINT_MAX_BYTES 10
+
+static inline size_t encode_varint(uint64_t n, uint8_t* out) {
+    size_t len = 0;
+    while (n >= 0x80) {
+        out[len++] = (uint8_t)(n | 0x80);
+        n >>= 7;
+    }
+    out[len++] = (uint8_t)n;
+    return len;
+}
+
+/* reads from a flat buffer; returns the number of bytes consumed */
+static inline size_t decode_varint(uint8_t const* in, uint64_t* n) {
+    size_t len = 0;
+    int shift = 0;
+    *n = 0;
+    for (;;) {
+        uint8_t const byte = in[len++];
+        *n |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0 || shift >= 63)
+            break;
+        shift += 7;
+    }
+    return len;
+}
+
+static inline uint64_t zigzag_encode(int64_t n) {
+    return ((uint64_t)n << 1) ^ (uint64_t)(n >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t n) {
+    return (int64_t)(n >> 1) ^ -(int64_t)(n & 1);
+}
+
+#endif
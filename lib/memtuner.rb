@@ -4,6 +4,7 @@ require "memtuner/memory_statistics"
 
 module Memtuner
   @@rss_usage_on_load = Memtuner.rss_usage
+  @@memory_breakdown_on_load = Memtuner.memory_breakdown
   @@glibc_mallinfo_on_load = Memtuner.glibc_mallinfo
   @@glibc_malloc_info_on_load = Memtuner.glibc_malloc_info
   @@gc_stat_on_load = GC.stat
@@ -12,6 +13,10 @@ module Memtuner
     @@rss_usage_on_load
   end
 
+  def self.memory_breakdown_on_load
+    @@memory_breakdown_on_load
+  end
+
   def self.glibc_mallinfo_on_load
     @@glibc_mallinfo_on_load
   end
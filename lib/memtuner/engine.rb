@@ -1,5 +1,18 @@
+require 'memtuner/request_middleware'
+
 module Memtuner
   class Engine < ::Rails::Engine
     isolate_namespace Memtuner
+
+    initializer 'memtuner.request_middleware' do |app|
+      unless ENV['MEMTUNER_REQUEST_STATS'] == '0'
+        app.middleware.use Memtuner::RequestMiddleware
+        # arms the route's budget (Memtuner.set_request_budget) before the action runs
+        ActiveSupport::Notifications.subscribe('start_processing.action_controller') do |*, payload|
+          params = payload[:params]
+          Memtuner.request_route("#{params['controller']}##{params['action']}")
+        end
+      end
+    end
   end
 end
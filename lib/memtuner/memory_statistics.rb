@@ -1,12 +1,17 @@
 module Memtuner
   class MemoryStatistics
-    attr_reader :rss_usage, :glibc_mallinfo, :glibc_malloc_info, :gc_stat
+    attr_reader :rss_usage, :memory_breakdown, :glibc_mallinfo, :glibc_malloc_info, :malloc_arenas, :gc_stat, :history, :request_stats, :request_incidents
   
     def initialize
       @rss_usage = Memtuner.rss_usage
+      @memory_breakdown = Memtuner.memory_breakdown
       @glibc_mallinfo = Memtuner.glibc_mallinfo
       @glibc_malloc_info = Memtuner.glibc_malloc_info
+      @malloc_arenas = Memtuner.malloc_arenas
       @gc_stat = GC.stat
+      @history = Memtuner.history
+      @request_stats = Memtuner.request_stats
+      @request_incidents = Memtuner.request_incidents
     end
   
     def self.ruby_rvalue_size
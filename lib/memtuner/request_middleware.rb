@@ -0,0 +1,35 @@
+module Memtuner
+  # Charges the memory each request allocates, frees and retains to its
+  # controller action. The top endpoints are kept natively; see
+  # Memtuner.request_stats. malloc and free bytes are counted only while
+  # the malloc tracer runs; otherwise requests are ranked by RSS growth.
+  # RSS is process-wide, so in a threaded server that fallback charges each
+  # request for the growth of every request running alongside it.
+  #
+  # With the tracer running, Memtuner.set_request_budget('users#index', bytes)
+  # makes requests allocating past bytes record their heaviest stacks in
+  # Memtuner.request_incidents.
+  class RequestMiddleware
+    def initialize(app)
+      @app = app
+    end
+
+    def call(env)
+      Memtuner.request_begin
+      @app.call(env)
+    ensure
+      Memtuner.request_end(endpoint_of(env))
+    end
+
+    private
+
+    def endpoint_of(env)
+      params = env['action_dispatch.request.path_parameters']
+      if params && params[:controller]
+        "#{params[:controller]}##{params[:action]}"
+      else
+        'unrouted'
+      end
+    end
+  end
+end
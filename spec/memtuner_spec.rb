@@ -1,6 +1,22 @@
 require "spec_helper"
+require "tmpdir"
+
+# allocates from a frame the tracer examples can look for
+module MemtunerSpecHelpers
+  RETAIN_FRAME = 'MemtunerSpecHelpers#retain_allocations'.freeze
+
+  def retain_allocations
+    Array.new(100) { 'x' * 10_000 }
+  end
+
+  def from_retain_allocations?(entry)
+    entry[:frames].any? { |frame| frame.end_with?(RETAIN_FRAME) }
+  end
+end
 
 describe Memtuner do
+  include MemtunerSpecHelpers
+
   it "has a version number" do
     expect(Memtuner::VERSION).not_to be nil
   end
@@ -29,4 +45,211 @@ describe Memtuner do
       expect(Memtuner.rss_usage).to include :peak
     end
   end
+
+  describe '#allocation_profile' do
+    it 'returns array of stacks' do
+      expect(Memtuner.allocation_profile).to be_an Array
+      expect(Memtuner.allocation_profile(1).size).to be <= 1
+    end
+
+    it 'charges allocations to the calling Ruby stack' do
+      Memtuner.start_malloc_tracer
+      _retained = retain_allocations
+      stack = Memtuner.allocation_profile(1000).find { |entry| from_retain_allocations?(entry) }
+      expect(stack[:alloc_count]).to be >= 100
+      expect(stack[:alloc_size]).to be >= 1_000_000
+    end
+  end
+
+  describe '#start_sampling' do
+    it 'rejects non-positive interval' do
+      expect { Memtuner.start_sampling(bytes_interval: 0) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe '#live_heap_snapshot' do
+    it 'returns array of stacks' do
+      expect(Memtuner.live_heap_snapshot).to be_an Array
+    end
+
+    it 'reports the bytes a traced method retains' do
+      Memtuner.start_malloc_tracer
+      _retained = retain_allocations
+      stack = Memtuner.live_heap_snapshot(1000).find { |entry| from_retain_allocations?(entry) }
+      expect(stack[:bytes]).to be >= 1_000_000
+      expect(stack[:count]).to be >= 100
+      expect(stack[:oldest_age]).to be >= 0
+    end
+  end
+
+  describe '#snapshot' do
+    it 'returns heap snapshot' do
+      snapshot = Memtuner.snapshot
+      expect(snapshot).to be_a Memtuner::HeapSnapshot
+      expect(snapshot.diff(Memtuner.snapshot)).to be_an Array
+    end
+
+    it 'diffs the growth between snapshots' do
+      Memtuner.start_malloc_tracer
+      older = Memtuner.snapshot
+      _retained = retain_allocations
+      deltas = Memtuner.snapshot.diff(older)
+      expect(deltas).not_to be_empty
+      growth = deltas.find { |delta| from_retain_allocations?(delta) }
+      expect(growth[:bytes]).to be >= 1_000_000
+      expect(growth[:count]).to be >= 100
+    end
+  end
+
+  describe '#mapping_report' do
+    it 'totals mapped bytes by origin once the tracer runs' do
+      Memtuner.start_malloc_tracer
+      _retained = 'x' * 10_000_000
+      report = Memtuner.mapping_report
+      expect(report).to include(:mapping_count, :mmap_anonymous_bytes, :mmap_file_bytes, :malloc_mmap_bytes,
+                                :reserved_bytes, :brk_bytes, :overflow_count)
+      expect(report[:mapped_bytes]).to be > 0
+      expect(report[:mapped_bytes]).to eq report.values_at(:mmap_anonymous_bytes, :mmap_file_bytes, :malloc_mmap_bytes, :brk_bytes).inject(:+)
+    end
+  end
+
+  describe '#thread_allocation_stats' do
+    it 'returns array of per-thread counters' do
+      expect(Memtuner.thread_allocation_stats).to be_an Array
+    end
+  end
+
+  describe '#memory_breakdown' do
+    it 'returns RSS broken down by kind' do
+      breakdown = Memtuner.memory_breakdown
+      expect(breakdown[:rss]).to be > 0
+      expect(breakdown).to include(:pss, :private_dirty, :swap)
+    end
+  end
+
+  describe '#mappings' do
+    it 'classifies mappings and totals RSS per class' do
+      report = Memtuner.mappings
+      expect(report[:mappings]).not_to be_empty
+      expect(report[:classes][:library_text][:rss]).to be > 0
+    end
+  end
+
+  describe '#malloc_arenas' do
+    it 'returns per-arena statistics' do
+      arenas = Memtuner.malloc_arenas
+      expect(arenas[:arenas].first[:nr]).to eq 0
+      expect(arenas[:total][:system_current]).to be > 0
+    end
+  end
+
+  describe '#fragmentation_report' do
+    it 'returns fragmentation per arena with recommendations' do
+      report = Memtuner.fragmentation_report
+      expect(report[:total][:fragmentation_ratio]).to be_a Float
+      expect(report[:arenas].first).to include(:free_bytes, :largest_free_chunk, :trimmable_bytes)
+      expect(report[:recommendations]).to be_an Array
+    end
+  end
+
+  describe '#malloc_trim' do
+    it 'returns the bytes of RSS released' do
+      expect(Memtuner.malloc_trim).to be >= 0
+    end
+  end
+
+  describe '#start_trim_scheduler' do
+    it 'runs until stopped' do
+      expect(Memtuner.start_trim_scheduler(fragmentation: 0.2, min_interval: 1)).to eq true
+      GC.start
+      expect(Memtuner.trim_scheduler_stats[:running]).to eq true
+      expect(Memtuner.stop_trim_scheduler).to eq true
+    end
+  end
+
+  describe '#history' do
+    it 'returns sampled series as columns' do
+      Memtuner.start_sampler(interval_ms: 10, capacity: 100)
+      sleep 0.05
+      history = Memtuner.history
+      Memtuner.stop_sampler
+      expect(history[:time].size).to be >= 2
+      expect(history[:rss].size).to eq history[:time].size
+      expect(Memtuner.history(since: history[:time].last)[:time]).to be_empty
+    end
+  end
+
+  describe '#metrics_text' do
+    it 'renders gauges in Prometheus text format' do
+      text = Memtuner.metrics_text
+      expect(text).to include("# TYPE memtuner_rss_bytes gauge\n")
+      expect(text).to match(/^memtuner_ruby_heap_live_slots\{pid="\d+"\} \d+$/)
+    end
+  end
+
+  describe '#request_stats' do
+    it 'keeps the endpoints that retain the most' do
+      Memtuner.reset_request_stats(2)
+      retained = []
+      3.times do
+        %w(a#index b#show c#create).each do |endpoint|
+          Memtuner.request_begin
+          retained << 'x' * 1_000_000 if endpoint == 'b#show'
+          Memtuner.request_end(endpoint)
+        end
+      end
+      stats = Memtuner.request_stats
+      expect(stats.size).to eq 2
+      expect(stats.first[:endpoint]).to eq 'b#show'
+      expect(stats.first[:requests]).to eq 3
+    end
+  end
+
+  describe '#request_incidents' do
+    after do
+      Memtuner.set_request_budget('heavy#index', nil)
+      # back to recording every call, which the other examples expect
+      Memtuner.start_malloc_tracer
+    end
+
+    it 'logs the stacks of requests over budget' do
+      Memtuner.start_sampling
+      Memtuner.set_request_budget('heavy#index', 100_000)
+      Memtuner.request_begin
+      Memtuner.request_route('heavy#index')
+      _retained = Array.new(100) { 'x' * 10_000 }
+      Memtuner.request_end('heavy#index')
+      incident = Memtuner.request_incidents.first
+      expect(incident[:endpoint]).to eq 'heavy#index'
+      expect(incident[:stacks]).not_to be_empty
+    end
+  end
+
+  describe '#start_trace' do
+    it 'writes a chunked trace file' do
+      path = File.join(Dir.tmpdir, "memtuner-#{Process.pid}.trace")
+      expect(Memtuner.start_trace(path)).to be true
+      _retained = Array.new(100) { 'x' * 10_000 }
+      expect(Memtuner.stop_trace).to be true
+      expect(File.binread(path, 8)).to eq 'MTTRACE1'
+      expect(Memtuner.trace_stats[:bytes_written]).to eq File.size(path)
+      File.delete(path)
+    end
+  end
+
+  describe '#analyze_trace' do
+    it 'aggregates a trace by stack' do
+      path = File.join(Dir.tmpdir, "memtuner-#{Process.pid}.trace")
+      Memtuner.start_trace(path)
+      _retained = Array.new(100) { 'x' * 10_000 }
+      Memtuner.stop_trace
+      result = Memtuner.analyze_trace(path, top: 5, folded: :retained)
+      File.delete(path)
+      expect(result[:sessions]).to eq 1
+      expect(result[:truncated]).to be false
+      expect(result[:top_retaining].first[:retained_bytes]).to be >= 1_000_000
+      expect(result[:timeline][:live_bytes].max).to be >= 1_000_000
+      expect(result[:folded]).to match(/ \d+$/)
+    end
+  end
 end